@@ -0,0 +1,306 @@
+#include "attrlist.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/vnode.h>
+
+#include "communicate.h"
+
+// Newer SDKs name these; older kernels just never return them.
+#ifndef ATTR_CMN_RETURNED_ATTRS
+#define ATTR_CMN_RETURNED_ATTRS 0x80000000
+#endif
+#ifndef ATTR_CMN_GEN_COUNT
+#define ATTR_CMN_GEN_COUNT      0x00080000
+#endif
+#ifndef ATTR_CMN_DOCUMENT_ID
+#define ATTR_CMN_DOCUMENT_ID    0x00100000
+#endif
+#ifndef FSOPT_PACK_INVAL_ATTRS
+#define FSOPT_PACK_INVAL_ATTRS  0x00000008
+#endif
+
+// The common attributes in the order they're packed, as far as the last
+// one we need to find. The rest of an entry just gets moved along.
+enum {
+    A_RETURNED_ATTRS, A_NAME, A_DEVID, A_FSID, A_OBJTYPE, A_OBJTAG,
+    A_OBJID, A_OBJPERMANENTID, A_PAROBJID, A_SCRIPT, A_CRTIME, A_MODTIME,
+    A_CHGTIME, A_ACCTIME, A_BKUPTIME, A_FNDRINFO, A_OWNERID, A_GRPID,
+    A_ACCESSMASK, A_FLAGS, A_GEN_COUNT, A_DOCUMENT_ID, A_USERACCESS,
+    A_EXTENDED_SECURITY, A_UUID, A_GRPUUID, A_FILEID,
+    NCMN
+};
+
+static const struct cmn_attr {
+    attrgroup_t bit;
+    unsigned size;
+    int is_ref;     // an attrreference_t to data after the fixed part
+} cmn_attrs[NCMN] = {
+    [A_RETURNED_ATTRS]      = { ATTR_CMN_RETURNED_ATTRS,
+                                sizeof(attribute_set_t) },
+    [A_NAME]                = { ATTR_CMN_NAME, sizeof(attrreference_t), 1 },
+    [A_DEVID]               = { ATTR_CMN_DEVID, sizeof(dev_t) },
+    [A_FSID]                = { ATTR_CMN_FSID, sizeof(fsid_t) },
+    [A_OBJTYPE]             = { ATTR_CMN_OBJTYPE, sizeof(fsobj_type_t) },
+    [A_OBJTAG]              = { ATTR_CMN_OBJTAG, sizeof(fsobj_tag_t) },
+    [A_OBJID]               = { ATTR_CMN_OBJID, sizeof(fsobj_id_t) },
+    [A_OBJPERMANENTID]      = { ATTR_CMN_OBJPERMANENTID,
+                                sizeof(fsobj_id_t) },
+    [A_PAROBJID]            = { ATTR_CMN_PAROBJID, sizeof(fsobj_id_t) },
+    [A_SCRIPT]              = { ATTR_CMN_SCRIPT, sizeof(text_encoding_t) },
+    [A_CRTIME]              = { ATTR_CMN_CRTIME, sizeof(struct timespec) },
+    [A_MODTIME]             = { ATTR_CMN_MODTIME, sizeof(struct timespec) },
+    [A_CHGTIME]             = { ATTR_CMN_CHGTIME, sizeof(struct timespec) },
+    [A_ACCTIME]             = { ATTR_CMN_ACCTIME, sizeof(struct timespec) },
+    [A_BKUPTIME]            = { ATTR_CMN_BKUPTIME, sizeof(struct timespec) },
+    [A_FNDRINFO]            = { ATTR_CMN_FNDRINFO, 32 },
+    [A_OWNERID]             = { ATTR_CMN_OWNERID, sizeof(uid_t) },
+    [A_GRPID]               = { ATTR_CMN_GRPID, sizeof(gid_t) },
+    [A_ACCESSMASK]          = { ATTR_CMN_ACCESSMASK, sizeof(uint32_t) },
+    [A_FLAGS]               = { ATTR_CMN_FLAGS, sizeof(uint32_t) },
+    [A_GEN_COUNT]           = { ATTR_CMN_GEN_COUNT, sizeof(uint32_t) },
+    [A_DOCUMENT_ID]         = { ATTR_CMN_DOCUMENT_ID, sizeof(uint32_t) },
+    [A_USERACCESS]          = { ATTR_CMN_USERACCESS, sizeof(uint32_t) },
+    [A_EXTENDED_SECURITY]   = { ATTR_CMN_EXTENDED_SECURITY,
+                                sizeof(attrreference_t), 1 },
+    [A_UUID]                = { ATTR_CMN_UUID, sizeof(guid_t) },
+    [A_GRPUUID]             = { ATTR_CMN_GRPUUID, sizeof(guid_t) },
+    [A_FILEID]              = { ATTR_CMN_FILEID, sizeof(uint64_t) },
+};
+
+// Attributes whose values we fake.
+#define FAKED_ATTRS (ATTR_CMN_OBJTYPE | ATTR_CMN_OWNERID | ATTR_CMN_GRPID | \
+                     ATTR_CMN_ACCESSMASK)
+
+// Which of asked an entry actually holds: all of them, unless the kernel
+// was allowed to leave out the ones it doesn't have, in which case it
+// says which it sent.
+static attrgroup_t entry_attrs(const char *ent, attrgroup_t asked,
+        unsigned long options)
+{
+    if(!(asked & ATTR_CMN_RETURNED_ATTRS) ||
+       (options & FSOPT_PACK_INVAL_ATTRS))
+        return asked;
+
+    attribute_set_t set;
+    memcpy(&set, ent + sizeof(uint32_t), sizeof(set));
+    return asked & (set.commonattr | ATTR_CMN_RETURNED_ATTRS);
+}
+
+// Where each of cmn_attrs[] is in an entry holding the attributes in
+// present (-1 if it isn't there). Returns where the last one ends.
+static size_t cmn_layout(attrgroup_t present, int *off)
+{
+    size_t pos = sizeof(uint32_t);
+
+    for(int i = 0; i < NCMN; i++) {
+        if(present & cmn_attrs[i].bit) {
+            off[i] = pos;
+            pos += cmn_attrs[i].size;
+        } else {
+            off[i] = -1;
+        }
+    }
+
+    return pos;
+}
+
+// Copy an entry of len bytes down from in to out (out <= in), leaving out
+// the attributes in drop. A reference stays pointing at its data: those
+// after a field we cut move along with it, those before it need their
+// offsets shortened. Returns the new length.
+static uint32_t repack(char *out, const char *in, uint32_t len,
+        attrgroup_t drop, const int *off)
+{
+    int cut_before[NCMN];
+    uint32_t cut = 0;
+    size_t w = 0, r = 0;
+
+    for(int i = 0; i < NCMN; i++) {
+        cut_before[i] = cut;
+        if(off[i] < 0 || !(cmn_attrs[i].bit & drop))
+            continue;
+
+        memmove(out + w, in + r, off[i] - r);
+        w += off[i] - r;
+        r = off[i] + cmn_attrs[i].size;
+        cut += cmn_attrs[i].size;
+    }
+
+    memmove(out + w, in + r, len - r);
+    len -= cut;
+    memcpy(out, &len, sizeof(len));
+
+    if(!cut)
+        return len;
+
+    for(int i = 0; i < NCMN; i++) {
+        if(off[i] < 0 || !cmn_attrs[i].is_ref || (cmn_attrs[i].bit & drop))
+            continue;
+
+        attrreference_t ref;
+        char *at = out + off[i] - cut_before[i];
+        memcpy(&ref, at, sizeof(ref));
+        ref.attr_dataoffset -= cut - cut_before[i];
+        memcpy(at, &ref, sizeof(ref));
+    }
+
+    if(off[A_RETURNED_ATTRS] >= 0) {
+        attribute_set_t set;
+        char *at = out + off[A_RETURNED_ATTRS];
+        memcpy(&set, at, sizeof(set));
+        set.commonattr &= ~drop;
+        memcpy(at, &set, sizeof(set));
+    }
+
+    return len;
+}
+
+static fsobj_type_t vtype(mode_t mode)
+{
+    switch(mode & S_IFMT) {
+        case S_IFREG: return VREG;
+        case S_IFDIR: return VDIR;
+        case S_IFBLK: return VBLK;
+        case S_IFCHR: return VCHR;
+        case S_IFLNK: return VLNK;
+        case S_IFSOCK: return VSOCK;
+        case S_IFIFO: return VFIFO;
+        default: return VNON;
+    }
+}
+
+// What OVERLAY_ATTRS does to a stat buffer, done to an entry.
+static void overlay(char *ent, const struct attr_fixup *f,
+        const struct owner_query *q)
+{
+    int off[NCMN];
+    cmn_layout(entry_attrs(ent, f->asked, f->options), off);
+
+    uid_t uid = q->uid;
+    gid_t gid = q->gid;
+    int owned = q->known & FAKE_OWNER;
+
+    // Without the real owner, only a device rule can say.
+    if(!owned) {
+        uid = (uid_t) -1;
+        if(off[A_OWNERID] >= 0)
+            memcpy(&uid, ent + off[A_OWNERID], sizeof(uid));
+        owned = implied_owner(q->dev, &uid, &gid);
+    }
+
+    if(owned) {
+        if(off[A_OWNERID] >= 0)
+            memcpy(ent + off[A_OWNERID], &uid, sizeof(uid_t));
+        if(off[A_GRPID] >= 0)
+            memcpy(ent + off[A_GRPID], &gid, sizeof(gid_t));
+    }
+
+    if(off[A_ACCESSMASK] >= 0 && (q->known & (FAKE_MODE | FAKE_TYPE))) {
+        uint32_t mask;
+        memcpy(&mask, ent + off[A_ACCESSMASK], sizeof(mask));
+
+        if(q->known & FAKE_MODE)
+            mask = (mask & ~07777) | (q->mode & 07777);
+        if((q->known & FAKE_TYPE) && (mask & S_IFMT))
+            mask = (mask & 07777) | (q->mode & S_IFMT);
+
+        memcpy(ent + off[A_ACCESSMASK], &mask, sizeof(mask));
+    }
+
+    if(off[A_OBJTYPE] >= 0 && (q->known & FAKE_TYPE)) {
+        fsobj_type_t type = vtype(q->mode);
+        memcpy(ent + off[A_OBJTYPE], &type, sizeof(type));
+    }
+}
+
+
+int attr_begin(struct attr_fixup *f, const struct attrlist *al,
+        unsigned long options)
+{
+    if(al->bitmapcount != ATTR_BIT_MAP_COUNT ||
+       !(al->commonattr & FAKED_ATTRS))
+        return 0;
+
+    f->al = *al;
+    f->asked = al->commonattr;
+    f->added = (ATTR_CMN_DEVID | ATTR_CMN_FILEID) & ~al->commonattr;
+    f->al.commonattr |= f->added;
+    f->options = options;
+    return 1;
+}
+
+
+int attr_finish(const struct attr_fixup *f, void *buf, size_t size, int n)
+{
+    char *in = buf, *out = buf, *end = in + size;
+    struct owner_query *q = malloc(n * sizeof(*q) + 1);
+    size_t *where = malloc(n * sizeof(*where) + 1);
+    int nq = 0, res = 0;
+
+    if(!q || !where) {
+        free(q);
+        free(where);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // Put the entries back the way they were asked for, noting which
+    // inode each is as we go.
+    for(int i = 0; i < n && end - in >= sizeof(uint32_t); i++) {
+        int off[NCMN];
+        uint32_t len;
+
+        memcpy(&len, in, sizeof(len));
+        if(len > end - in)
+            len = end - in;     // getattrlist() ran out of room
+
+        attrgroup_t present = entry_attrs(in, f->al.commonattr, f->options);
+        if(cmn_layout(present, off) > len) {
+            res = 1;
+            break;
+        }
+
+        if(off[A_DEVID] >= 0 && off[A_FILEID] >= 0) {
+            dev_t dev;
+            uint64_t ino;
+            memcpy(&dev, in + off[A_DEVID], sizeof(dev));
+            memcpy(&ino, in + off[A_FILEID], sizeof(ino));
+
+            q[nq] = (struct owner_query) { .dev = dev, .ino = ino };
+            where[nq++] = out - (char *) buf;
+        }
+
+        uint32_t step = len;
+        len = repack(out, in, len, f->added, off);
+
+        // Entries that came 8-byte aligned stay that way.
+        if(step % 8 == 0 && len % 8) {
+            uint32_t pad = 8 - len % 8;
+            memset(out + len, 0, pad);
+            len += pad;
+            memcpy(out, &len, sizeof(len));
+        }
+
+        in += step;
+        out += len;
+    }
+
+    // ...then everything we fake about them in one go.
+    if(res == 0 && nq > 0) {
+        if(get_owner_many(q, nq) < 0) {
+            errno = EIO;
+            res = -1;
+        } else {
+            for(int i = 0; i < nq; i++)
+                overlay((char *) buf + where[i], f, &q[i]);
+        }
+    }
+
+    free(q);
+    free(where);
+    return res;
+}
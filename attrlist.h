@@ -0,0 +1,34 @@
+#ifndef ATTRLIST_H
+#define ATTRLIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/attr.h>
+
+// getattrlist() and its bulk relatives (Darwin). Their answers are packed
+// entries of whatever attributes were asked for, so we have no dev/ino to
+// look up unless the caller happened to ask for those too. When they
+// didn't, we ask for ATTR_CMN_DEVID and ATTR_CMN_FILEID on top and cut
+// them back out of the answer afterwards.
+
+// Room an entry may need for what we add.
+#define ATTR_EXTRA  (sizeof(dev_t) + sizeof(uint64_t))
+
+struct attr_fixup {
+    struct attrlist al;         // what to ask the kernel for
+    attrgroup_t asked, added;   // the caller's commonattr, and our extras
+    unsigned long options;
+};
+
+// Work out what to ask for. Returns 0 if nothing we fake was asked for,
+// and the call can go straight through.
+int attr_begin(struct attr_fixup *f, const struct attrlist *al,
+        unsigned long options);
+
+// Turn n entries the kernel packed into buf back into what the caller
+// asked for, owners and modes faked with one exchange with the daemon.
+// Returns -1 (errno set) if the daemon couldn't be asked, 1 if an entry
+// was cut short before the attributes we need.
+int attr_finish(const struct attr_fixup *f, void *buf, size_t size, int n);
+
+#endif
@@ -0,0 +1,604 @@
+// Daemon core throughput: the ownership store and request handling from
+// daemon.c, driven in-process and over a socketpair the way libfakeroot
+// reaches it. Each result is printed as one JSON object per line; save
+// them, and a later run with --baseline compares against them and exits
+// nonzero if anything got slower than --threshold allows.
+//
+//     bench-daemon [-s sizes] [-d dists] [-n ops] [-b batch] [-r read%]
+//                  [--baseline file] [--threshold pct]
+//
+// Sizes take k/M suffixes (1k,1M,50M; 50M wants a few GB of memory).
+// Distributions are seq, uniform and zipf, for which keys get looked up.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "communicate.h"
+#include "daemon.h"
+#include "nodetable.h"
+
+#define ZIPF_THETA  0.99
+
+enum { DIST_SEQ, DIST_UNIFORM, DIST_ZIPF };
+static const char *dist_names[] = { "seq", "uniform", "zipf" };
+
+static long nops = 1000000;
+static int batch = 64, read_pct = 90;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+// Same keys as bench-table: a few devices, inode numbers that look like
+// real ones (dense but not sequential).
+static void make_pkt(struct comm_pkt *pkt, int action, uint64_t i)
+{
+    memset(pkt, 0, sizeof(*pkt));
+    pkt->action = action;
+    pkt->dev = 0x1000001 + (i & 3);
+    pkt->ino = 2 + i * 7919;
+
+    if(action == SET_OWNER) {
+        pkt->known = FAKE_OWNER;
+        pkt->uid = i & 0xffff;
+        pkt->gid = i & 0xffff;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// Which keys get used, worked out before the clock starts. Zipf ranks come
+// from Gray et al.'s generator, spread over the table so the hot keys
+// aren't all neighbours.
+static uint64_t *make_indices(int dist, uint64_t n, long count)
+{
+    uint64_t *idx = malloc(count * sizeof(*idx));
+    if(!idx)
+        fatal("malloc");
+
+    double zetan = 0, zeta2 = 1 + pow(0.5, ZIPF_THETA), alpha = 0, eta = 0;
+
+    if(dist == DIST_ZIPF) {
+        for(uint64_t i = 1; i <= n; i++)
+            zetan += pow(1.0 / i, ZIPF_THETA);
+        alpha = 1 / (1 - ZIPF_THETA);
+        eta = (1 - pow(2.0 / n, 1 - ZIPF_THETA)) / (1 - zeta2 / zetan);
+    }
+
+    for(long i = 0; i < count; i++) {
+        switch(dist) {
+            case DIST_SEQ:
+                idx[i] = i % n;
+                break;
+
+            case DIST_UNIFORM:
+                idx[i] = rng() % n;
+                break;
+
+            case DIST_ZIPF:
+            {
+                double u = (rng() >> 11) * (1.0 / (1ULL << 53));
+                double uz = u * zetan;
+                uint64_t rank;
+
+                if(uz < 1)
+                    rank = 0;
+                else if(uz < zeta2)
+                    rank = 1;
+                else
+                    rank = n * pow(eta * u - eta + 1, alpha);
+
+                idx[i] = (rank * 0x9e3779b97f4a7c15ULL) % n;
+            }
+                break;
+        }
+    }
+
+    return idx;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// What one run does with each key: look it up (hit, or miss on a key
+// that's never been stored), set it, or a read_pct mix of the two.
+enum { OP_INSERT, OP_HIT, OP_MISS, OP_UPDATE, OP_MIXED };
+static const char *op_names[] = { "insert", "hit", "miss", "update", "mixed" };
+
+static int op_action(int op)
+{
+    switch(op) {
+        case OP_HIT:
+        case OP_MISS:
+            return GET_OWNER;
+        case OP_MIXED:
+            return (int) (rng() % 100) < read_pct ? GET_OWNER : SET_OWNER;
+        default:
+            return SET_OWNER;
+    }
+}
+
+static uint64_t op_key(int op, uint64_t idx, uint64_t n)
+{
+    return op == OP_MISS ? idx + n : idx;
+}
+
+struct result {
+    const char *mode, *op, *dist;
+    uint64_t keys;
+    int batch;
+    long ops;
+    double elapsed;
+};
+
+static struct result *baseline;
+static int nbaseline, regressions;
+static double threshold = 10;
+
+static void compare(const struct result *r)
+{
+    double ns = r->elapsed / r->ops * 1e9;
+
+    for(int i = 0; i < nbaseline; i++) {
+        const struct result *b = &baseline[i];
+
+        if(strcmp(b->mode, r->mode) != 0 || strcmp(b->op, r->op) != 0 ||
+           strcmp(b->dist, r->dist) != 0 || b->keys != r->keys ||
+           b->batch != r->batch)
+            continue;
+
+        double was = b->elapsed, change = (ns - was) / was * 100;
+        int worse = change > threshold;
+
+        fprintf(stderr, "%-7s %-7s %9llu %-8s b%-5d %9.1f -> %9.1f ns/op "
+                "%+7.1f%%%s\n", r->mode, r->op, (unsigned long long) r->keys,
+                r->dist, r->batch, was, ns, change,
+                worse ? "  REGRESSION" : "");
+
+        regressions += worse;
+        return;
+    }
+}
+
+static void report(const struct result *r)
+{
+    double ns = r->elapsed / r->ops * 1e9;
+
+    printf("{\"mode\":\"%s\",\"op\":\"%s\",\"keys\":%llu,\"dist\":\"%s\","
+           "\"batch\":%d,\"ops\":%ld,\"ns_per_op\":%.1f,"
+           "\"ops_per_sec\":%.0f}\n",
+           r->mode, r->op, (unsigned long long) r->keys, r->dist, r->batch,
+           r->ops, ns, r->ops / r->elapsed);
+    fflush(stdout);
+
+    if(nbaseline)
+        compare(r);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// In-process: process_pkt() one request at a time, or process_many() on
+// whole frames as the socket path hands them over.
+
+static double run_inproc(int op, const uint64_t *idx, long count, uint64_t n)
+{
+    struct comm_pkt pkt;
+    double start = now();
+
+    for(long i = 0; i < count; i++) {
+        make_pkt(&pkt, op_action(op), op_key(op, idx[i], n));
+        process_pkt(&pkt);
+    }
+
+    return now() - start;
+}
+
+static double run_batch(int op, const uint64_t *idx, long count, uint64_t n)
+{
+    struct comm_pkt ents[batch];
+    double start = now();
+
+    for(long i = 0; i < count; i += batch) {
+        int action = op_action(op), k = 0;
+
+        for(; k < batch && i + k < count; k++)
+            make_pkt(&ents[k], action, op_key(op, idx[i + k], n));
+        process_many(action, ents, k);
+    }
+
+    return now() - start;
+}
+
+// Over a socketpair: frames as communicate.c builds them, answered by a
+// thread doing what the daemon does with them. GETs wait for their
+// replies; SETs are one-way, so a run ends with a SYNC to make sure
+// they've all landed.
+
+static int sv[2];
+
+static int read_full(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+
+    while(len > 0) {
+        ssize_t n = read(fd, p, len);
+        if(n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while(len > 0) {
+        ssize_t n = write(fd, p, len);
+        if(n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static void *server(void *arg)
+{
+    char *buf = malloc(FRAME_LENGTH(MAX_FRAME_ENTS));
+    if(!buf)
+        fatal("malloc");
+
+    struct comm_hdr *hdr = (struct comm_hdr *) buf;
+    struct comm_pkt *ents = (struct comm_pkt *) (buf + sizeof(*hdr));
+
+    while(read_full(sv[1], hdr, sizeof(*hdr)) == 0) {
+        if(hdr->count > MAX_FRAME_ENTS ||
+           read_full(sv[1], ents, hdr->count * sizeof(*ents)) < 0)
+            break;
+
+        if(hdr->action == SYNC) {
+            hdr->generation = shared->generation;
+        } else {
+            hdr->generation = process_many(hdr->action, ents, hdr->count);
+            if(hdr->action != GET_OWNER)
+                continue;
+        }
+
+        if(write_full(sv[1], buf, hdr->length) < 0)
+            break;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static void round_trip(char *buf, uint32_t reqid)
+{
+    struct comm_hdr *hdr = (struct comm_hdr *) buf;
+
+    if(write_full(sv[0], buf, hdr->length) < 0 ||
+       read_full(sv[0], hdr, sizeof(*hdr)) < 0 ||
+       read_full(sv[0], buf + sizeof(*hdr),
+           hdr->length - sizeof(*hdr)) < 0)
+        fatal("bench socket");
+
+    if(hdr->reqid != reqid) {
+        fprintf(stderr, "bench: reply %u for request %u\n", hdr->reqid, reqid);
+        exit(1);
+    }
+}
+
+static double run_socket(int op, const uint64_t *idx, long count, uint64_t n)
+{
+    static char buf[FRAME_LENGTH(MAX_FRAME_ENTS)] __attribute__((aligned(8)));
+    struct comm_hdr *hdr = (struct comm_hdr *) buf;
+    struct comm_pkt *ents = (struct comm_pkt *) (buf + sizeof(*hdr));
+    uint32_t reqid = 0;
+    double start = now();
+
+    for(long i = 0; i < count; i += batch) {
+        int action = op_action(op), k = 0;
+
+        for(; k < batch && i + k < count; k++)
+            make_pkt(&ents[k], action, op_key(op, idx[i + k], n));
+
+        *hdr = (struct comm_hdr) {
+            .length = FRAME_LENGTH(k),
+            .version = PROTO_VERSION,
+            .action = action,
+            .reqid = ++reqid,
+            .count = k,
+        };
+
+        if(action == GET_OWNER)
+            round_trip(buf, reqid);
+        else if(write_full(sv[0], buf, hdr->length) < 0)
+            fatal("bench socket");
+    }
+
+    *hdr = (struct comm_hdr) {
+        .length = FRAME_LENGTH(0),
+        .version = PROTO_VERSION,
+        .action = SYNC,
+        .reqid = ++reqid,
+    };
+    round_trip(buf, reqid);
+
+    return now() - start;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+struct mode {
+    const char *name;
+    double (*run)(int op, const uint64_t *idx, long count, uint64_t n);
+    int batched, slow;
+};
+
+// Round trips cost microseconds, so one at a time over the socket only
+// gets a tenth of the ops.
+static const struct mode modes[] = {
+    { "inproc", run_inproc, 0, 0 },
+    { "batch",  run_batch,  1, 0 },
+    { "socket", run_socket, 0, 1 },
+    { "socket", run_socket, 1, 0 },
+};
+
+#define NMODES  (sizeof(modes) / sizeof(modes[0]))
+
+static void bench_size(uint64_t n, const int *dists, int ndists)
+{
+    int saved_batch = batch;
+
+    init_shards(0);
+
+    // Filling the table is the insert benchmark; it's the same whatever
+    // the distribution.
+    {
+        struct comm_pkt pkt;
+        double start = now();
+
+        for(uint64_t i = 0; i < n; i++) {
+            make_pkt(&pkt, SET_OWNER, i);
+            process_pkt(&pkt);
+        }
+
+        struct result r = { "inproc", "insert", "seq", n, 1, n, now() - start };
+        report(&r);
+    }
+
+    for(int d = 0; d < ndists; d++) {
+        uint64_t *idx = make_indices(dists[d], n, nops);
+
+        for(size_t m = 0; m < NMODES; m++) {
+            const struct mode *mode = &modes[m];
+            long count = mode->slow ? nops / 10 : nops;
+
+            if(count < 1)
+                count = 1;
+            batch = mode->batched ? saved_batch : 1;
+
+            for(int op = OP_HIT; op <= OP_MIXED; op++) {
+                // Keep the same mix of reads and writes from run to run.
+                rng_state = 88172645463325252ULL;
+
+                struct result r = {
+                    mode->name, op_names[op], dist_names[dists[d]],
+                    n, batch, count, mode->run(op, idx, count, n),
+                };
+                report(&r);
+            }
+        }
+
+        batch = saved_batch;
+        free(idx);
+    }
+
+    free_shards();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+static const char *json_str(const char *line, const char *field, char *buf,
+        size_t len)
+{
+    char pat[64];
+    snprintf(pat, sizeof(pat), "\"%s\":\"", field);
+
+    const char *p = strstr(line, pat);
+    if(!p)
+        return NULL;
+    p += strlen(pat);
+
+    size_t i = 0;
+    while(p[i] && p[i] != '"' && i + 1 < len) {
+        buf[i] = p[i];
+        i++;
+    }
+    buf[i] = 0;
+    return buf;
+}
+
+static int json_num(const char *line, const char *field, double *val)
+{
+    char pat[64];
+    snprintf(pat, sizeof(pat), "\"%s\":", field);
+
+    const char *p = strstr(line, pat);
+    if(!p)
+        return -1;
+
+    *val = strtod(p + strlen(pat), NULL);
+    return 0;
+}
+
+// Baseline results keep ns/op in elapsed.
+static void load_baseline(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if(!fp)
+        fatal(path);
+
+    char line[512];
+    int cap = 0;
+
+    while(fgets(line, sizeof(line), fp)) {
+        char mode[32], op[32], dist[32];
+        double keys, b, ns;
+
+        if(!json_str(line, "mode", mode, sizeof(mode)) ||
+           !json_str(line, "op", op, sizeof(op)) ||
+           !json_str(line, "dist", dist, sizeof(dist)) ||
+           json_num(line, "keys", &keys) < 0 ||
+           json_num(line, "batch", &b) < 0 ||
+           json_num(line, "ns_per_op", &ns) < 0)
+            continue;
+
+        if(nbaseline == cap) {
+            cap = cap ? cap * 2 : 64;
+            baseline = realloc(baseline, cap * sizeof(*baseline));
+            if(!baseline)
+                fatal("realloc");
+        }
+
+        baseline[nbaseline++] = (struct result) {
+            strdup(mode), strdup(op), strdup(dist), keys, b, 1, ns,
+        };
+    }
+
+    fclose(fp);
+
+    if(!nbaseline) {
+        fprintf(stderr, "%s: no results in it\n", path);
+        exit(1);
+    }
+}
+
+static uint64_t parse_size(const char *s)
+{
+    char *end;
+    double n = strtod(s, &end);
+
+    if(*end == 'k' || *end == 'K')
+        n *= 1000;
+    else if(*end == 'm' || *end == 'M')
+        n *= 1000000;
+
+    return n;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: bench-daemon [options]\n"
+            "\n"
+            "Options:\n"
+            "    -s,  --sizes=[list]      Table sizes (default 1k,100k,1M)\n"
+            "    -d,  --dists=[list]      seq, uniform, zipf (default all)\n"
+            "    -n,  --ops=[n]           Operations per run (default 1M)\n"
+            "    -b,  --batch=[n]         Entries per frame (default 64)\n"
+            "    -r,  --read=[pct]        GETs in the mixed runs (default 90)\n"
+            "         --baseline=[file]   Compare against earlier output\n"
+            "         --threshold=[pct]   Slowdown that counts (default 10)\n"
+           );
+    exit(1);
+}
+
+static struct option cmdLineOpts[] = {
+    { "help",       no_argument,        NULL,   'h' },
+    { "sizes",      required_argument,  NULL,   's' },
+    { "dists",      required_argument,  NULL,   'd' },
+    { "ops",        required_argument,  NULL,   'n' },
+    { "batch",      required_argument,  NULL,   'b' },
+    { "read",       required_argument,  NULL,   'r' },
+    { "baseline",   required_argument,  NULL,   'B' },
+    { "threshold",  required_argument,  NULL,   'T' },
+    { NULL, 0, NULL, 0},
+};
+
+int main(int argc, char **argv)
+{
+    const char *sizes = "1k,100k,1M", *dist_list = "seq,uniform,zipf";
+    int ch;
+
+    while((ch = getopt_long(argc, argv, "hs:d:n:b:r:", cmdLineOpts,
+                    NULL)) != -1) {
+        switch(ch) {
+            case 's': sizes = optarg; break;
+            case 'd': dist_list = optarg; break;
+            case 'n': nops = parse_size(optarg); break;
+            case 'b': batch = atoi(optarg); break;
+            case 'r': read_pct = atoi(optarg); break;
+            case 'B': load_baseline(optarg); break;
+            case 'T': threshold = atof(optarg); break;
+            default: usage();
+        }
+    }
+
+    if(nops < 1 || batch < 1 || batch > MAX_FRAME_ENTS ||
+       read_pct < 0 || read_pct > 100)
+        usage();
+
+    int dists[3], ndists = 0;
+    char *list = strdup(dist_list);
+
+    for(char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        int d = 0;
+        while(d < 3 && strcmp(tok, dist_names[d]) != 0)
+            d++;
+        if(d == 3 || ndists == 3)
+            usage();
+        dists[ndists++] = d;
+    }
+    free(list);
+
+    if(socketpair(PF_LOCAL, SOCK_STREAM, 0, sv) < 0)
+        fatal("socketpair");
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, server, NULL) != 0)
+        fatal("pthread_create");
+
+    list = strdup(sizes);
+    for(char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        uint64_t n = parse_size(tok);
+        if(n < 1)
+            usage();
+        bench_size(n, dists, ndists);
+    }
+    free(list);
+
+    close(sv[0]);
+    pthread_join(thread, NULL);
+
+    if(nbaseline && regressions) {
+        fprintf(stderr, "%d regression(s) over %.0f%%\n",
+                regressions, threshold);
+        return 1;
+    }
+
+    return 0;
+}
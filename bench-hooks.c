@@ -0,0 +1,112 @@
+// Cost of the hooked calls as a program sees them. Run it under fakeroot
+// and on its own; the difference is what libfakeroot adds per call.
+//
+//     ./fakeroot -l $PWD/libfakeroot.so ./bench-hooks [n]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define NFILES  256
+
+static char dir[] = "/tmp/bench-hooks.XXXXXX";
+static char paths[NFILES][64];
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, long n, double elapsed)
+{
+    printf("%-12s %10ld calls  %8.0f ns/op  %10.0f ops/s\n",
+            name, n, elapsed / n * 1e9, n / elapsed);
+}
+
+// Files half of which have been chown()ed, so stats see both known and
+// unknown inodes.
+static void setup(void)
+{
+    if(!mkdtemp(dir)) {
+        perror("mkdtemp");
+        exit(1);
+    }
+
+    for(int i = 0; i < NFILES; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "%s/f%d", dir, i);
+        int fd = open(paths[i], O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if(fd < 0) {
+            perror(paths[i]);
+            exit(1);
+        }
+        close(fd);
+        if(i % 2)
+            chown(paths[i], 1000 + i, 1000 + i);
+    }
+}
+
+static void cleanup(void)
+{
+    for(int i = 0; i < NFILES; i++)
+        unlink(paths[i]);
+    rmdir(dir);
+}
+
+int main(int argc, char **argv)
+{
+    long n = argc > 1 ? atol(argv[1]) : 200000;
+    struct stat sbuf;
+    double start;
+
+    setup();
+
+    start = now();
+    for(long i = 0; i < n; i++)
+        getuid();
+    report("getuid", n, now() - start);
+
+    start = now();
+    for(long i = 0; i < n; i++)
+        stat(paths[i % NFILES], &sbuf);
+    report("stat", n, now() - start);
+
+    start = now();
+    for(long i = 0; i < n; i++)
+        lstat(paths[i % NFILES], &sbuf);
+    report("lstat", n, now() - start);
+
+    int fd = open(paths[0], O_RDONLY);
+    start = now();
+    for(long i = 0; i < n; i++)
+        fstat(fd, &sbuf);
+    report("fstat", n, now() - start);
+    close(fd);
+
+    start = now();
+    for(long i = 0; i < n / 10; i++)
+        close(open(paths[i % NFILES], O_RDONLY));
+    report("open+close", n / 10, now() - start);
+
+    start = now();
+    for(long i = 0; i < n / 10; i++)
+        chown(paths[i % NFILES], i, i);
+    report("chown", n / 10, now() - start);
+
+    char path[sizeof(dir) + 32];
+    start = now();
+    for(long i = 0; i < n / 100; i++) {
+        snprintf(path, sizeof(path), "%s/new", dir);
+        close(open(path, O_WRONLY | O_CREAT | O_EXCL, 0644));
+        unlink(path);
+    }
+    report("create+unlink", n / 100, now() - start);
+
+    cleanup();
+    return 0;
+}
@@ -0,0 +1,126 @@
+// Round-trip latency of the shared-memory ring versus the socket transport.
+//
+// The "daemon" is a forked child answering GET_OWNER from a small table, so
+// both transports pay for crossing a process boundary exactly as they would
+// between libfakeroot and fakeroot.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "communicate.h"
+#include "ring.h"
+
+#define TABLE_SIZE  1024
+
+static uint32_t table[TABLE_SIZE];
+
+static int answer(struct comm_pkt *pkt, void *arg)
+{
+    if(pkt->action != GET_OWNER)
+        return 0;
+
+    pkt->uid = table[pkt->ino % TABLE_SIZE];
+    pkt->gid = pkt->uid;
+    pkt->known = 1;
+    return 1;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, long n, double elapsed)
+{
+    printf("%-8s %10ld round trips  %8.0f ns/op  %10.0f ops/s\n",
+            name, n, elapsed / n * 1e9, n / elapsed);
+}
+
+static void bench_ring(long n)
+{
+    struct comm_ring *ring = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(ring == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    ring_init(ring);
+
+    pid_t pid = fork();
+    if(pid == 0) {
+        ring_serve(ring, answer, NULL);
+        _exit(0);
+    }
+
+    double start = now();
+    for(long i = 0; i < n; i++) {
+        struct comm_pkt pkt = { .action = GET_OWNER, .ino = i };
+        if(ring_call(ring, &pkt, 1) < 0 || !pkt.known) {
+            fprintf(stderr, "ring: bad reply\n");
+            exit(1);
+        }
+    }
+    report("ring", n, now() - start);
+
+    ring_close(ring);
+    waitpid(pid, NULL, 0);
+    munmap(ring, sizeof(*ring));
+}
+
+static void bench_socket(long n)
+{
+    int sv[2];
+    if(socketpair(PF_LOCAL, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+
+    pid_t pid = fork();
+    if(pid == 0) {
+        struct comm_pkt pkt;
+        close(sv[0]);
+        while(recv(sv[1], &pkt, sizeof(pkt), MSG_WAITALL) == sizeof(pkt)) {
+            answer(&pkt, NULL);
+            if(send(sv[1], &pkt, sizeof(pkt), 0) != sizeof(pkt))
+                break;
+        }
+        _exit(0);
+    }
+    close(sv[1]);
+
+    double start = now();
+    for(long i = 0; i < n; i++) {
+        struct comm_pkt pkt = { .action = GET_OWNER, .ino = i };
+        if(send(sv[0], &pkt, sizeof(pkt), 0) != sizeof(pkt) ||
+           recv(sv[0], &pkt, sizeof(pkt), MSG_WAITALL) != sizeof(pkt) ||
+           !pkt.known) {
+            fprintf(stderr, "socket: bad reply\n");
+            exit(1);
+        }
+    }
+    report("socket", n, now() - start);
+
+    close(sv[0]);
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char **argv)
+{
+    long n = argc > 1 ? atol(argv[1]) : 200000;
+
+    for(int i = 0; i < TABLE_SIZE; i++)
+        table[i] = i;
+
+    bench_socket(n);
+    bench_ring(n);
+    return 0;
+}
@@ -0,0 +1,169 @@
+// Ownership store throughput: nodetable versus the old dbopen(DB_HASH)
+// store, driven through the same operations process_pkt() performs.
+//
+//     bench-table [keys]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "nodetable.h"
+
+#ifdef HAVE_DBOPEN
+#ifdef __APPLE__
+#include <db.h>
+#else
+#include <db_185.h>
+#endif
+#endif
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *store, const char *op, long n, double elapsed,
+        double worst)
+{
+    printf("%-10s %-12s %10ld ops  %7.1f ns/op  worst %9.1f us\n",
+            store, op, n, elapsed / n * 1e9, worst * 1e6);
+}
+
+// Spread keys over a few devices, with inode numbers that look like real
+// ones (dense but not sequential).
+static struct dbKey make_key(long i)
+{
+    struct dbKey key = {
+        .dev = 0x1000001 + (i & 3),
+        .ino = 2 + (uint64_t) i * 7919,
+    };
+    return key;
+}
+
+static void bench_nodetable(long n)
+{
+    struct node_table t;
+    double start, worst, t0, t1;
+
+    nodetable_init(&t, 0);
+
+    start = now();
+    worst = 0;
+    for(long i = 0; i < n; i++) {
+        struct dbKey key = make_key(i);
+        t0 = now();
+        struct dbVal *val = nodetable_upsert(&t, &key, NULL);
+        val->uid = i;
+        val->gid = i;
+        t1 = now();
+        if(t1 - t0 > worst)
+            worst = t1 - t0;
+    }
+    report("nodetable", "insert", n, now() - start, worst);
+
+    start = now();
+    long found = 0;
+    for(long i = 0; i < n; i++) {
+        struct dbKey key = make_key(i);
+        found += nodetable_get(&t, &key) != NULL;
+    }
+    report("nodetable", "lookup-hit", n, now() - start, 0);
+
+    start = now();
+    for(long i = n; i < 2 * n; i++) {
+        struct dbKey key = make_key(i);
+        found += nodetable_get(&t, &key) != NULL;
+    }
+    report("nodetable", "lookup-miss", n, now() - start, 0);
+
+    start = now();
+    for(long i = 0; i < n; i++) {
+        struct dbKey key = make_key(i);
+        nodetable_upsert(&t, &key, NULL)->uid = 0;
+    }
+    report("nodetable", "update", n, now() - start, 0);
+
+    if(found != n)
+        fprintf(stderr, "nodetable: expected %ld hits, got %ld\n", n, found);
+
+    nodetable_free(&t);
+}
+
+#ifdef HAVE_DBOPEN
+static void bench_dbopen(long n)
+{
+    DB *db = dbopen(NULL, O_RDWR | O_CREAT, 0666, DB_HASH, NULL);
+    double start, worst, t0, t1;
+
+    if(!db) {
+        perror("dbopen");
+        return;
+    }
+
+    start = now();
+    worst = 0;
+    for(long i = 0; i < n; i++) {
+        struct dbKey key = make_key(i);
+        struct dbVal val = { .uid = i, .gid = i };
+        DBT dkey = { .data = &key, .size = sizeof(key) };
+        DBT dval;
+
+        t0 = now();
+        if(db->get(db, &dkey, &dval, 0) == 1) {
+            dval.data = &val;
+            dval.size = sizeof(val);
+            db->put(db, &dkey, &dval, 0);
+        }
+        t1 = now();
+        if(t1 - t0 > worst)
+            worst = t1 - t0;
+    }
+    report("dbopen", "insert", n, now() - start, worst);
+
+    start = now();
+    long found = 0;
+    for(long i = 0; i < n; i++) {
+        struct dbKey key = make_key(i);
+        DBT dkey = { .data = &key, .size = sizeof(key) }, dval;
+        found += db->get(db, &dkey, &dval, 0) == 0;
+    }
+    report("dbopen", "lookup-hit", n, now() - start, 0);
+
+    start = now();
+    for(long i = n; i < 2 * n; i++) {
+        struct dbKey key = make_key(i);
+        DBT dkey = { .data = &key, .size = sizeof(key) }, dval;
+        found += db->get(db, &dkey, &dval, 0) == 0;
+    }
+    report("dbopen", "lookup-miss", n, now() - start, 0);
+
+    start = now();
+    for(long i = 0; i < n; i++) {
+        struct dbKey key = make_key(i);
+        DBT dkey = { .data = &key, .size = sizeof(key) }, dval;
+        if(db->get(db, &dkey, &dval, 0) == 0)
+            ((struct dbVal *) dval.data)->uid = 0;
+    }
+    report("dbopen", "update", n, now() - start, 0);
+
+    if(found != n)
+        fprintf(stderr, "dbopen: expected %ld hits, got %ld\n", n, found);
+
+    db->close(db);
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    long n = argc > 1 ? atol(argv[1]) : 1000000;
+
+    bench_nodetable(n);
+#ifdef HAVE_DBOPEN
+    bench_dbopen(n);
+#endif
+    return 0;
+}
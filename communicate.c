@@ -1,20 +1,206 @@
 #include "communicate.h"
+#include "ring.h"
+#include "trace.h"
 
 #include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <pthread.h>
+#include <time.h>
 
-static pthread_mutex_t comm_lockout;
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
 
-int init_commfd(const char *sockpath)
+// Every thread talks to the daemon over its own connection (a "channel"),
+// made the first time the thread needs one, so threads never wait on each
+// other for a lookup. A channel is only ever used by the thread that owns
+// it; channel_lock just protects the list of them.
+//
+// Each channel also caches lookups (whole records), including negative
+// ones. Entries stay valid for as long as the daemon's generation is the
+// one the channel last synchronized with. SET_OWNERs (and DEL_OWNERs) sent
+// on the channel bump the generation too, so we count them; if the next
+// reply from the daemon shows exactly that many bumps, nobody else has
+// written in the meantime and the cache can be kept.
+
+#define CACHE_SIZE  4096    // must be a power of two
+
+struct cache_ent {
+    uint64_t dev, ino;
+    uint32_t uid, gid, rdev;
+    uint16_t mode;
+    uint8_t known, valid;
+};
+
+struct channel {
+    int fd;
+    struct comm_ring *ring;     // NULL means "use the socket"
+    uint64_t seen_generation, own_sets;
+    uint32_t next_reqid;
+    uint64_t ipc_time;          // with timing on
+    struct channel *next;
+    struct cache_ent cache[CACHE_SIZE];
+};
+
+static char sockpath[256], ring_shm_name[64];
+static uint32_t namespace_id;
+
+static const struct fakeroot_shared *shared;
+
+static pthread_key_t channel_key;
+static pthread_mutex_t channel_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct channel *channels;
+
+static unsigned long cache_hits, cache_misses, filter_skips;
+static int timing;
+
+// SET_OWNER and DEL_OWNER are one-way, so we queue them up and send a
+// whole batch at once.
+// The batch is shared by all threads and goes out on whichever channel
+// flushes it: when it fills up, before any GET_OWNER (which must see our
+// writes), and on exec, fork and exit.
+#define BATCH_SIZE  512
+
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct comm_pkt set_batch[BATCH_SIZE];
+static int batch_len;
+
+// Writes we've sent on any channel that the daemon hasn't said it has
+// applied. Until it has, its filter may not know about them yet.
+static uint64_t unconfirmed;
+
+static struct cache_ent *cache_slot(struct channel *ch, dev_t dev, ino_t ino)
 {
-    if(pthread_mutex_init(&comm_lockout, NULL) != 0)
-        return -1;
+    uint64_t h = ((uint64_t) ino * 0x9e3779b97f4a7c15ULL) ^ (uint64_t) dev;
+    return &ch->cache[(h ^ (h >> 29)) & (CACHE_SIZE - 1)];
+}
+
+// The cached record for dev/ino, if we have one we can trust.
+static struct cache_ent *cache_lookup(struct channel *ch, dev_t dev,
+        ino_t ino)
+{
+    if(!shared || shared->generation != ch->seen_generation)
+        return NULL;
+
+    struct cache_ent *ent = cache_slot(ch, dev, ino);
+    return ent->valid && ent->dev == dev && ent->ino == ino ? ent : NULL;
+}
+
+static void cache_load(const struct cache_ent *ent, struct fake_attrs *attrs)
+{
+    attrs->known = ent->known;
+    attrs->uid = ent->uid;
+    attrs->gid = ent->gid;
+    attrs->mode = ent->mode;
+    attrs->rdev = ent->rdev;
+}
+
+static void cache_store(struct channel *ch, dev_t dev, ino_t ino,
+        const struct fake_attrs *attrs)
+{
+    struct cache_ent *ent = cache_slot(ch, dev, ino);
+    ent->dev = dev;
+    ent->ino = ino;
+    ent->uid = attrs->uid;
+    ent->gid = attrs->gid;
+    ent->mode = attrs->mode;
+    ent->rdev = attrs->rdev;
+    ent->known = attrs->known & FAKE_FIELDS;
+    ent->valid = 1;
+}
+
+// What a SET does to a record; the daemon does the same.
+static void merge_attrs(struct fake_attrs *to, const struct fake_attrs *set)
+{
+    if(set->known & FAKE_FRESH)
+        memset(to, 0, sizeof(*to));
+
+    if(set->known & FAKE_OWNER) {
+        to->uid = set->uid;
+        to->gid = set->gid;
+    }
+
+    if(set->known & FAKE_MODE)
+        to->mode = (to->mode & S_IFMT) | (set->mode & 07777);
 
+    if(set->known & FAKE_TYPE) {
+        to->mode = (to->mode & 07777) | (set->mode & S_IFMT);
+        to->rdev = set->rdev;
+    }
+
+    to->known |= set->known & FAKE_FIELDS;
+}
+
+// Keep the cache up to date with our own SETs. Unless the inode is
+// fresh, we can only do that if we already have the rest of its record.
+static void cache_update(struct channel *ch, dev_t dev, ino_t ino,
+        const struct fake_attrs *set)
+{
+    struct cache_ent *ent = cache_slot(ch, dev, ino);
+    struct fake_attrs attrs = { 0 };
+
+    if(!(set->known & FAKE_FRESH)) {
+        if(!ent->valid || ent->dev != dev || ent->ino != ino)
+            return;
+        cache_load(ent, &attrs);
+    }
+
+    merge_attrs(&attrs, set);
+    cache_store(ch, dev, ino, &attrs);
+}
+
+static void pkt_attrs(const struct comm_pkt *pkt, struct fake_attrs *attrs)
+{
+    attrs->known = pkt->known;
+    attrs->uid = pkt->uid;
+    attrs->gid = pkt->gid;
+    attrs->mode = pkt->mode;
+    attrs->rdev = pkt->rdev;
+}
+
+static void cache_sync(struct channel *ch, uint64_t generation)
+{
+    if(generation != ch->seen_generation + ch->own_sets)
+        memset(ch->cache, 0, sizeof(ch->cache));
+
+    __sync_fetch_and_sub(&unconfirmed, ch->own_sets);
+    ch->seen_generation = generation;
+    ch->own_sets = 0;
+}
+
+// Whether the daemon's filter says it has no record of dev/ino. Only to be
+// believed with nothing of ours in the batch or in flight.
+static int filter_says_unknown(dev_t dev, ino_t ino)
+{
+    if(!shared || unconfirmed)
+        return 0;
+
+    uint64_t seq = shared->filter_seq;
+    if(seq & 1)
+        return 0;
+
+    __sync_synchronize();
+    int miss = !filter_test(shared, dev, ino);
+    __sync_synchronize();
+
+    if(!miss || shared->filter_seq != seq)
+        return 0;
+
+    __sync_fetch_and_add(&filter_skips, 1);
+    return 1;
+}
+
+
+static int connect_daemon(void)
+{
     int sock = socket(PF_LOCAL, SOCK_STREAM, PF_UNSPEC);
     if(sock < 0)
         return -1;
@@ -23,51 +209,763 @@ int init_commfd(const char *sockpath)
 
     {
         struct sockaddr_un uaddr;
-        strncpy(uaddr.sun_path, sockpath, sizeof(uaddr.sun_path));
+        memset(&uaddr, 0, sizeof(uaddr));
+        strncpy(uaddr.sun_path, sockpath, sizeof(uaddr.sun_path) - 1);
         uaddr.sun_family = PF_LOCAL;
+#ifndef __linux__
         uaddr.sun_len = SUN_LEN(&uaddr);
+#endif
 
-        if(connect(sock, (struct sockaddr *) &uaddr, sizeof(uaddr)) < 0)
+        if(connect(sock, (struct sockaddr *) &uaddr, sizeof(uaddr)) < 0) {
+            close(sock);
             return -1;
+        }
     }
 
     return sock;
 }
 
+static int send_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
 
-int set_owner(int fd, dev_t dev, ino_t ino, uid_t uid, gid_t gid)
+    while(len > 0) {
+        ssize_t n = send(fd, p, len, 0);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+// Send a frame with count entries. Fills in the rest of the header,
+// including a fresh request ID.
+static int send_frame(struct channel *ch, struct comm_hdr *hdr, int action,
+        const struct comm_pkt *ents, uint32_t count)
+{
+    *hdr = (struct comm_hdr) {
+        .length     = FRAME_LENGTH(count),
+        .version    = PROTO_VERSION,
+        .action     = action,
+        .reqid      = ch->next_reqid++,
+        .count      = count,
+    };
+
+    struct iovec iov[2] = {
+        { .iov_base = hdr, .iov_len = sizeof(*hdr) },
+        { .iov_base = (void *) ents, .iov_len = count * sizeof(*ents) },
+    };
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = count ? 2 : 1,
+    };
+
+    ssize_t n;
+    do {
+        n = sendmsg(ch->fd, &msg, 0);
+    } while(n < 0 && errno == EINTR);
+
+    // Finish up a short write the slow way.
+    for(int i = 0; n >= 0 && i < msg.msg_iovlen; i++) {
+        if(n >= iov[i].iov_len) {
+            n -= iov[i].iov_len;
+            continue;
+        }
+
+        if(send_all(ch->fd, (char *) iov[i].iov_base + n,
+                    iov[i].iov_len - n) < 0)
+            n = -1;
+        else
+            n = 0;
+    }
+
+    if(n < 0) {
+        perror("send");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int check_reply(const struct comm_hdr *hdr, uint32_t max)
+{
+    if(hdr->version != PROTO_VERSION) {
+        fprintf(stderr, "fakeroot: daemon speaks protocol version %d, "
+                "not %d\n", (int) hdr->version, PROTO_VERSION);
+        return -1;
+    }
+
+    if(hdr->count > max || hdr->length != FRAME_LENGTH(hdr->count)) {
+        fprintf(stderr, "fakeroot: bad reply from daemon\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Send a request that gets an answer, and wait for it. Over the socket,
+// that's a frame with pkt as its only entry (none for SYNC).
+static int send_request(struct channel *ch, struct comm_pkt *pkt)
 {
-    if(pthread_mutex_lock(&comm_lockout) != 0) {
-        perror("pthread_mutex_lock");
+    if(ch->ring && ring_call(ch->ring, pkt, 1) == 0)
+        return 0;
+
+    ch->ring = NULL;
+
+    struct comm_hdr hdr;
+    uint32_t count = pkt->action != SYNC, reqid = ch->next_reqid;
+
+    if(send_frame(ch, &hdr, pkt->action, pkt, count) < 0)
+        return -1;
+
+    // We never have anything else outstanding here, so this is the one.
+    struct iovec iov[2] = {
+        { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = pkt, .iov_len = count * sizeof(*pkt) },
+    };
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = count ? 2 : 1,
+    };
+
+    if(recvmsg(ch->fd, &msg, MSG_WAITALL) != FRAME_LENGTH(count)) {
+        perror("recv");
         return -1;
     }
 
+    if(check_reply(&hdr, count) < 0)
+        return -1;
+
+    if(hdr.reqid != reqid || hdr.count != count) {
+        fprintf(stderr, "fakeroot: unexpected reply from daemon\n");
+        return -1;
+    }
+
+    pkt->generation = hdr.generation;
+    return 0;
+}
+
+// Up to this many GET_OWNER frames are in flight at once, which keeps the
+// daemon's queued answers to us under its limit.
+#define PIPELINE_DEPTH  4
+
+// Look up n entries, answering in place. Over the socket they go as
+// frames of up to MAX_FRAME_ENTS, several at a time; over the ring, as
+// individual GET_OWNERs, a ring's worth at a time. Returns the generation
+// the answers are good for.
+static int send_requests(struct channel *ch, struct comm_pkt *ents, size_t n,
+        uint64_t *generation)
+{
+    for(size_t done = 0; ch->ring && done < n; ) {
+        size_t k = n - done < RING_SLOTS ? n - done : RING_SLOTS;
+
+        for(size_t i = 0; i < k; i++) {
+            ents[done + i].action = GET_OWNER;
+            if(ring_push(ch->ring, &ch->ring->sq, &ents[done + i]) < 0)
+                goto no_ring;
+        }
+
+        for(size_t i = 0; i < k; i++)
+            if(ring_pop(ch->ring, &ch->ring->cq, &ents[done + i]) < 0)
+                goto no_ring;
+
+        // The first answer is the oldest, which is what counts.
+        if(done == 0)
+            *generation = ents[0].generation;
+
+        done += k;
+        if(done == n)
+            return 0;
+    }
+
+no_ring:
+    ch->ring = NULL;
+
+    size_t nframes = (n + MAX_FRAME_ENTS - 1) / MAX_FRAME_ENTS;
+    size_t sent = 0, received = 0;
+    uint32_t first = ch->next_reqid;
+
+    *generation = ~0ULL;
+
+    while(received < nframes) {
+        struct comm_hdr hdr;
+
+        while(sent < nframes && sent - received < PIPELINE_DEPTH) {
+            size_t base = sent * MAX_FRAME_ENTS;
+            size_t k = n - base < MAX_FRAME_ENTS ? n - base : MAX_FRAME_ENTS;
+
+            if(send_frame(ch, &hdr, GET_OWNER, &ents[base], k) < 0)
+                return -1;
+            sent++;
+        }
+
+        if(recv(ch->fd, &hdr, sizeof(hdr), MSG_WAITALL) != sizeof(hdr)) {
+            perror("recv");
+            return -1;
+        }
+
+        if(check_reply(&hdr, MAX_FRAME_ENTS) < 0)
+            return -1;
+
+        // Answers can come back in any order; the reqid says where this
+        // one goes.
+        size_t frame = hdr.reqid - first, base = frame * MAX_FRAME_ENTS;
+
+        size_t want = n - base < MAX_FRAME_ENTS ? n - base : MAX_FRAME_ENTS;
+
+        if(hdr.action != GET_OWNER || frame >= sent || hdr.count != want) {
+            fprintf(stderr, "fakeroot: unexpected reply from daemon\n");
+            return -1;
+        }
+
+        size_t len = hdr.count * sizeof(*ents);
+        if(recv(ch->fd, &ents[base], len, MSG_WAITALL) != len) {
+            perror("recv");
+            return -1;
+        }
+
+        if(hdr.generation < *generation)
+            *generation = hdr.generation;
+        received++;
+    }
+
+    return 0;
+}
+
+// Time spent in these counts as talking to the daemon, and goes in the
+// trace.
+static uint64_t ipc_begin(void)
+{
+    return timing || trace_on ? comm_clock() : 0;
+}
+
+static void ipc_end(struct channel *ch, uint64_t start)
+{
+    if(start)
+        ch->ipc_time += comm_clock() - start;
+}
+
+static int request(struct channel *ch, struct comm_pkt *pkt)
+{
+    uint64_t start = ipc_begin();
+    int res = send_request(ch, pkt);
+    ipc_end(ch, start);
+    if(trace_on && res == 0)
+        trace_pkts(pkt, 1, start, comm_clock());
+    return res;
+}
+
+static int request_many(struct channel *ch, struct comm_pkt *ents, size_t n,
+        uint64_t *generation)
+{
+    uint64_t start = ipc_begin();
+    int res = send_requests(ch, ents, n, generation);
+    ipc_end(ch, start);
+    if(trace_on && res == 0)
+        trace_pkts(ents, n, start, comm_clock());
+    return res;
+}
+
+static int open_ring(struct channel *ch)
+{
+    struct comm_pkt pkt = {
+        .action = OPEN_RING,
+    };
+
+    if(request(ch, &pkt) < 0 || pkt.action != OPEN_RING || !pkt.known)
+        return -1;
+
+    char name[96];
+    snprintf(name, sizeof(name), "%s.r%llu", ring_shm_name,
+            (unsigned long long) pkt.ino);
+
+    int rfd = shm_open(name, O_RDWR, 0);
+    if(rfd < 0)
+        return -1;
+    shm_unlink(name);
+
+    void *map = mmap(NULL, sizeof(struct comm_ring),
+            PROT_READ | PROT_WRITE, MAP_SHARED, rfd, 0);
+    close(rfd);
+
+    if(map == MAP_FAILED)
+        return -1;
+
+    if(((struct comm_ring *) map)->magic != RING_MAGIC) {
+        munmap(map, sizeof(struct comm_ring));
+        return -1;
+    }
+
+    ch->ring = map;
+    return 0;
+}
+
+// Make sure we're talking to a daemon that speaks our protocol, and tell
+// it which namespace we're in.
+static int hello(struct channel *ch)
+{
+    struct comm_hdr hdr;
+    struct comm_pkt ns = {
+        .action = HELLO,
+        .dev = namespace_id,
+    };
+
+    if(send_frame(ch, &hdr, HELLO, &ns, namespace_id ? 1 : 0) < 0)
+        return -1;
+
+    if(recv(ch->fd, &hdr, sizeof(hdr), MSG_WAITALL) != sizeof(hdr)) {
+        perror("recv");
+        return -1;
+    }
+
+    return check_reply(&hdr, 0);
+}
+
+// A connection handed down to us by the image that exec()ed us; the first
+// channel gets it instead of making a new one.
+static int inherited_fd = -1;
+
+static int channel_connect(struct channel *ch)
+{
+    if(inherited_fd >= 0) {
+        ch->fd = inherited_fd;
+        inherited_fd = -1;
+        fcntl(ch->fd, F_SETFD, 1); // close-on-exec
+        return 0;
+    }
+
+    ch->fd = connect_daemon();
+    if(ch->fd < 0)
+        return -1;
+
+    if(hello(ch) < 0) {
+        close(ch->fd);
+        ch->fd = -1;
+        errno = EPROTO;
+        return -1;
+    }
+
+    // Falls back to the socket on its own if this doesn't work out.
+    if(ring_shm_name[0])
+        open_ring(ch);
+
+    return 0;
+}
+
+static void channel_free(void *arg)
+{
+    struct channel *ch = arg, **pp;
+
+    // Off the list first, or our own close() hook would refuse to close it.
+    pthread_mutex_lock(&channel_lock);
+    for(pp = &channels; *pp; pp = &(*pp)->next) {
+        if(*pp == ch) {
+            *pp = ch->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&channel_lock);
+
+    if(ch->ring)
+        munmap(ch->ring, sizeof(struct comm_ring));
+    if(ch->fd >= 0)
+        close(ch->fd);
+    free(ch);
+}
+
+static struct channel *get_channel(void)
+{
+    struct channel *ch = pthread_getspecific(channel_key);
+
+    if(ch) {
+        // Left disconnected by a fork().
+        if(ch->fd < 0 && channel_connect(ch) < 0) {
+            perror("fakeroot: connect");
+            return NULL;
+        }
+        return ch;
+    }
+
+    ch = calloc(1, sizeof(*ch));
+    if(!ch)
+        return NULL;
+
+    // Start out "stale" so that the first lookup synchronizes with the
+    // daemon before anything is trusted.
+    ch->seen_generation = ~0ULL;
+
+    if(channel_connect(ch) < 0) {
+        perror("fakeroot: connect");
+        free(ch);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&channel_lock);
+    ch->next = channels;
+    channels = ch;
+    pthread_mutex_unlock(&channel_lock);
+
+    pthread_setspecific(channel_key, ch);
+    return ch;
+}
+
+
+// Call with batch_lock held.
+static int flush_batch(struct channel *ch)
+{
+    uint64_t start = ipc_begin();
+    int i = 0, res = 0;
+
+    if(ch->ring) {
+        for(; i < batch_len; i++) {
+            if(ring_push(ch->ring, &ch->ring->sq, &set_batch[i]) < 0) {
+                ch->ring = NULL;
+                break;
+            }
+        }
+    }
+
+    // Over the socket, a frame for each run of the same action.
+    while(i < batch_len && res == 0) {
+        struct comm_hdr hdr;
+        int run = 1;
+
+        while(i + run < batch_len &&
+              set_batch[i + run].action == set_batch[i].action)
+            run++;
+
+        res = send_frame(ch, &hdr, set_batch[i].action, &set_batch[i], run);
+        i += run;
+    }
+
+    ch->own_sets += batch_len;
+    __sync_fetch_and_add(&unconfirmed, batch_len);
+    ipc_end(ch, start);
+    if(trace_on)
+        trace_pkts(set_batch, batch_len, start, comm_clock());
+    batch_len = 0;
+    return res;
+}
+
+// Wait until the daemon has applied everything we've sent on ch.
+static int sync_channel(struct channel *ch)
+{
     struct comm_pkt pkt = {
+        .action = SYNC,
+    };
+
+    if(request(ch, &pkt) < 0)
+        return -1;
+
+    cache_sync(ch, pkt.generation);
+    return 0;
+}
+
+
+int flush_owners(void)
+{
+    struct channel *ch = get_channel();
+    if(!ch)
+        return -1;
+
+    int res = 0;
+
+    pthread_mutex_lock(&batch_lock);
+    if(batch_len)
+        res = flush_batch(ch);
+    pthread_mutex_unlock(&batch_lock);
+
+    // Whoever runs next (our parent after we exit, the new image after an
+    // exec) will use a different connection, so make sure the daemon has
+    // actually seen our writes.
+    if(res == 0 && ch->own_sets)
+        res = sync_channel(ch);
+
+    return res;
+}
+
+
+// The child of a fork() inherits our connections, which the parent is
+// still using. Before the fork we push out everything pending, so the
+// child may talk to the daemon over a new connection without racing our
+// writes; afterwards the child drops everything it inherited and makes its
+// own connection the first time it needs one.
+
+static struct channel *forking_channel;
+
+static void atfork_prepare(void)
+{
+    forking_channel = get_channel();
+
+    if(forking_channel)
+        flush_owners();
+
+    pthread_mutex_lock(&batch_lock);
+    pthread_mutex_lock(&channel_lock);
+}
+
+static void atfork_parent(void)
+{
+    pthread_mutex_unlock(&channel_lock);
+    pthread_mutex_unlock(&batch_lock);
+}
+
+static void atfork_child(void)
+{
+    struct channel *inherited = channels, *self = forking_channel;
+
+    channels = NULL;
+    if(self) {
+        self->next = NULL;
+        channels = self;
+    }
+
+    // Whatever the other threads had in flight, the daemon will have done
+    // by the time a new connection of ours gets through to it.
+    unconfirmed = self ? self->own_sets : 0;
+
+    pthread_mutex_unlock(&channel_lock);
+    pthread_mutex_unlock(&batch_lock);
+
+    // The other threads' channels died with the threads; ours keeps its
+    // cache but gets a fresh connection.
+    while(inherited) {
+        struct channel *ch = inherited;
+        int fd = ch->fd;
+        inherited = ch->next;
+
+        if(ch->ring)
+            munmap(ch->ring, sizeof(struct comm_ring));
+
+        if(ch == self) {
+            ch->ring = NULL;
+            ch->fd = -1;
+        } else {
+            free(ch);
+        }
+
+        close(fd);
+    }
+}
+
+
+int comm_init(const char *socket_path, int fd, uint32_t ns)
+{
+    if(pthread_key_create(&channel_key, channel_free) != 0)
+        return -1;
+
+    strncpy(sockpath, socket_path, sizeof(sockpath) - 1);
+    namespace_id = ns;
+
+    // Make sure it really is what we were told it is.
+    struct sockaddr_un uaddr;
+    socklen_t len = sizeof(uaddr);
+
+    if(fd >= 0 &&
+       getpeername(fd, (struct sockaddr *) &uaddr, &len) == 0 &&
+       uaddr.sun_family == PF_LOCAL &&
+       strncmp(uaddr.sun_path, sockpath, sizeof(uaddr.sun_path)) == 0)
+        inherited_fd = fd;
+
+    if(!get_channel())
+        return -1;
+
+    pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
+    return 0;
+}
+
+
+int comm_exec_fd(void)
+{
+    struct channel *ch = get_channel();
+
+    if(!ch || flush_owners() < 0)
+        return -1;
+
+    // The new image can't use our mapping of the ring, and will ask for
+    // a new one; stop using it now so nothing's left half-done in it.
+    if(ch->ring) {
+        munmap(ch->ring, sizeof(struct comm_ring));
+        ch->ring = NULL;
+    }
+
+    fcntl(ch->fd, F_SETFD, 0);
+    return ch->fd;
+}
+
+
+void comm_exec_failed(int fd)
+{
+    if(fd >= 0)
+        fcntl(fd, F_SETFD, 1);
+}
+
+
+int init_shared(const char *shm_name)
+{
+    int fd = shm_open(shm_name, O_RDONLY, 0);
+    if(fd < 0)
+        return -1;
+
+    void *page = mmap(NULL, sizeof(struct fakeroot_shared),
+            PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(page == MAP_FAILED)
+        return -1;
+
+    if(((struct fakeroot_shared *) page)->magic != SHARED_MAGIC) {
+        munmap(page, sizeof(struct fakeroot_shared));
+        return -1;
+    }
+
+    shared = page;
+    return 0;
+}
+
+
+int init_ring(const char *shm_name)
+{
+    strncpy(ring_shm_name, shm_name, sizeof(ring_shm_name) - 1);
+
+    struct channel *ch = get_channel();
+    return ch ? open_ring(ch) : -1;
+}
+
+
+int is_comm_fd(int fd)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&channel_lock);
+    for(struct channel *ch = channels; ch; ch = ch->next) {
+        if(ch->fd == fd) {
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&channel_lock);
+
+    return found;
+}
+
+
+int set_attrs(dev_t dev, ino_t ino, const struct fake_attrs *attrs)
+{
+    struct channel *ch = get_channel();
+    if(!ch)
+        return -1;
+
+    // A fresh inode with nothing to record just mustn't inherit a record
+    // left over from a deleted one, and usually the filter says it can't.
+    if(attrs->known == FAKE_FRESH) {
+        if(!batch_len && filter_says_unknown(dev, ino)) {
+            struct fake_attrs none = { .known = 0 };
+            cache_store(ch, dev, ino, &none);
+            return 0;
+        }
+
+        return del_attrs(dev, ino);
+    }
+
+    int res = 0;
+
+    pthread_mutex_lock(&batch_lock);
+
+    set_batch[batch_len++] = (struct comm_pkt) {
         .action = SET_OWNER,
+        .known = attrs->known,
         .dev = dev,
         .ino = ino,
-        .uid = uid,
-        .gid = gid,
+        .uid = attrs->uid,
+        .gid = attrs->gid,
+        .mode = attrs->mode,
+        .rdev = attrs->rdev,
     };
 
-    int res = send(fd, &pkt, sizeof(pkt), 0);
+    if(batch_len == BATCH_SIZE)
+        res = flush_batch(ch);
 
-    pthread_mutex_unlock(&comm_lockout);
+    pthread_mutex_unlock(&batch_lock);
 
-    if(res != sizeof(pkt)) {
-        perror("send");
+    cache_update(ch, dev, ino, attrs);
+    return res;
+}
+
+
+int del_attrs(dev_t dev, ino_t ino)
+{
+    struct channel *ch = get_channel();
+    if(!ch)
         return -1;
-    }
 
-    return 0;
+    int res = 0;
+
+    pthread_mutex_lock(&batch_lock);
+
+    set_batch[batch_len++] = (struct comm_pkt) {
+        .action = DEL_OWNER,
+        .dev = dev,
+        .ino = ino,
+    };
+
+    if(batch_len == BATCH_SIZE)
+        res = flush_batch(ch);
+
+    pthread_mutex_unlock(&batch_lock);
+
+    // Gone is as good as known.
+    struct fake_attrs none = { .known = 0 };
+    cache_store(ch, dev, ino, &none);
+    return res;
+}
+
+
+int set_owner(dev_t dev, ino_t ino, uid_t uid, gid_t gid)
+{
+    struct fake_attrs attrs = {
+        .known = FAKE_OWNER,
+        .uid = uid,
+        .gid = gid,
+    };
+
+    return set_attrs(dev, ino, &attrs);
 }
 
 
-int get_owner(int fd, dev_t dev, ino_t ino, uid_t *uid, gid_t *gid)
+int get_attrs(dev_t dev, ino_t ino, struct fake_attrs *attrs)
 {
-    if(pthread_mutex_lock(&comm_lockout) != 0) {
-        perror("pthread_mutex_lock");
+    struct channel *ch = get_channel();
+    if(!ch)
         return -1;
+
+    struct cache_ent *ent = cache_lookup(ch, dev, ino);
+    if(ent) {
+        cache_load(ent, attrs);
+        __sync_fetch_and_add(&cache_hits, 1);
+        return attrs->known;
+    }
+
+    if(!batch_len && filter_says_unknown(dev, ino)) {
+        attrs->known = 0;
+        return 0;
+    }
+
+    __sync_fetch_and_add(&cache_misses, 1);
+
+    // Our own pending writes have to land before we ask about anything.
+    if(batch_len) {
+        pthread_mutex_lock(&batch_lock);
+        int res = batch_len ? flush_batch(ch) : 0;
+        pthread_mutex_unlock(&batch_lock);
+
+        if(res < 0)
+            return -1;
     }
 
     struct comm_pkt pkt = {
@@ -76,25 +974,239 @@ int get_owner(int fd, dev_t dev, ino_t ino, uid_t *uid, gid_t *gid)
         .ino = ino,
     };
 
-    if(send(fd, &pkt, sizeof(pkt), 0) != sizeof(pkt)) {
-        pthread_mutex_unlock(&comm_lockout);
-        perror("send");
+    if(request(ch, &pkt) < 0)
         return -1;
-    }
 
-    if(recv(fd, &pkt, sizeof(pkt), 0) != sizeof(pkt)) {
-        pthread_mutex_unlock(&comm_lockout);
-        perror("recv");
+    pkt_attrs(&pkt, attrs);
+    cache_sync(ch, pkt.generation);
+    cache_store(ch, dev, ino, attrs);
+
+    return attrs->known;
+}
+
+
+int get_owner(dev_t dev, ino_t ino, uid_t *uid, gid_t *gid)
+{
+    struct fake_attrs attrs;
+    int known = get_attrs(dev, ino, &attrs);
+
+    if(known < 0)
+        return -1;
+
+    if(!(known & FAKE_OWNER))
+        return 0;
+
+    if(uid) *uid = attrs.uid;
+    if(gid) *gid = attrs.gid;
+    return 1;
+}
+
+
+int get_owner_many(struct owner_query *q, int n)
+{
+    struct channel *ch = get_channel();
+    if(!ch)
         return -1;
+
+    if(n == 0)
+        return 0;
+
+    struct comm_pkt *ents = malloc(n * sizeof(*ents));
+    int *idx = malloc(n * sizeof(*idx));
+    int nmiss = 0, res = 0;
+
+    if(!ents || !idx) {
+        free(ents);
+        free(idx);
+        return -1;
+    }
+
+    for(int i = 0; i < n; i++) {
+        struct cache_ent *ent = cache_lookup(ch, q[i].dev, q[i].ino);
+
+        if(ent) {
+            q[i].known = ent->known;
+            q[i].uid = ent->uid;
+            q[i].gid = ent->gid;
+            q[i].mode = ent->mode;
+            __sync_fetch_and_add(&cache_hits, 1);
+            continue;
+        }
+
+        if(!batch_len && filter_says_unknown(q[i].dev, q[i].ino)) {
+            q[i].known = 0;
+            continue;
+        }
+
+        __sync_fetch_and_add(&cache_misses, 1);
+        ents[nmiss] = (struct comm_pkt) {
+            .action = GET_OWNER,
+            .dev = q[i].dev,
+            .ino = q[i].ino,
+        };
+        idx[nmiss++] = i;
+    }
+
+    if(nmiss && batch_len) {
+        pthread_mutex_lock(&batch_lock);
+        res = batch_len ? flush_batch(ch) : 0;
+        pthread_mutex_unlock(&batch_lock);
+    }
+
+    uint64_t generation;
+
+    if(nmiss && res == 0 &&
+       (res = request_many(ch, ents, nmiss, &generation)) == 0) {
+        cache_sync(ch, generation);
+
+        for(int i = 0; i < nmiss; i++) {
+            struct owner_query *qe = &q[idx[i]];
+            struct fake_attrs attrs;
+
+            pkt_attrs(&ents[i], &attrs);
+            cache_store(ch, qe->dev, qe->ino, &attrs);
+
+            qe->known = attrs.known;
+            qe->uid = attrs.uid;
+            qe->gid = attrs.gid;
+            qe->mode = attrs.mode;
+        }
     }
 
-    pthread_mutex_unlock(&comm_lockout);
+    free(ents);
+    free(idx);
+    return res;
+}
+
+
+int implied_owner(dev_t dev, uid_t *uid, gid_t *gid)
+{
+    if(!shared)
+        return 0;
+
+    const struct owner_policy *p = &shared->policy;
+
+    for(uint32_t i = 0; i < p->ndevices; i++) {
+        if(p->devices[i].dev == (uint64_t) dev) {
+            *uid = p->devices[i].uid;
+            *gid = p->devices[i].gid;
+            return 1;
+        }
+    }
 
-    if(pkt.known) {
-        if(uid) *uid = pkt.uid;
-        if(gid) *gid = pkt.gid;
+    if((p->flags & POLICY_DEFAULT) && *uid == p->session_uid) {
+        *uid = p->default_uid;
+        *gid = p->default_gid;
+        return 1;
     }
 
-    return pkt.known;
+    return 0;
+}
+
+
+int fresh_owner(dev_t dev, uid_t *uid, gid_t *gid)
+{
+    if(!shared)
+        return 0;
+
+    *uid = shared->policy.session_uid;
+    return implied_owner(dev, uid, gid);
+}
+
+
+int set_owner_many(const struct owner_query *q, int n)
+{
+    struct channel *ch = get_channel();
+    if(!ch)
+        return -1;
+
+    int res = 0;
+
+    pthread_mutex_lock(&batch_lock);
+    for(int i = 0; i < n; i++) {
+        set_batch[batch_len++] = (struct comm_pkt) {
+            .action = SET_OWNER,
+            .known = FAKE_OWNER,
+            .dev = q[i].dev,
+            .ino = q[i].ino,
+            .uid = q[i].uid,
+            .gid = q[i].gid,
+        };
+
+        if(batch_len == BATCH_SIZE && flush_batch(ch) < 0)
+            res = -1;
+    }
+    pthread_mutex_unlock(&batch_lock);
+
+    for(int i = 0; i < n; i++) {
+        struct fake_attrs attrs = {
+            .known = FAKE_OWNER,
+            .uid = q[i].uid,
+            .gid = q[i].gid,
+        };
+        cache_update(ch, q[i].dev, q[i].ino, &attrs);
+    }
+
+    return res;
+}
+
+
+void get_cache_stats(unsigned long *hits, unsigned long *misses,
+        unsigned long *skipped)
+{
+    if(hits) *hits = cache_hits;
+    if(misses) *misses = cache_misses;
+    if(skipped) *skipped = filter_skips;
+}
+
+
+void comm_timing(int on)
+{
+    timing = on;
+}
+
+
+uint64_t comm_clock(void)
+{
+#ifdef __APPLE__
+    static mach_timebase_info_data_t tb;
+    if(!tb.denom)
+        mach_timebase_info(&tb);
+    return mach_absolute_time() * tb.numer / tb.denom;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
 }
 
+
+uint64_t comm_ipc_time(void)
+{
+    struct channel *ch = pthread_getspecific(channel_key);
+    return ch ? ch->ipc_time : 0;
+}
+
+
+int send_stats(const struct comm_stat *stats, uint32_t n)
+{
+    struct channel *ch = get_channel();
+    if(!ch)
+        return -1;
+
+    struct comm_hdr hdr = {
+        .length     = STATS_LENGTH(n),
+        .version    = PROTO_VERSION,
+        .action     = STATS,
+        .reqid      = ch->next_reqid++,
+        .count      = n,
+    };
+
+    if(send_all(ch->fd, &hdr, sizeof(hdr)) < 0 ||
+       send_all(ch->fd, stats, n * sizeof(*stats)) < 0) {
+        perror("send");
+        return -1;
+    }
+
+    return 0;
+}
@@ -1,17 +1,230 @@
+#ifndef COMMUNICATE_H
+#define COMMUNICATE_H
+
 #include <unistd.h>
 #include <sys/stat.h>
 #include <stdint.h>
 
-int init_commfd(const char *socket_path);
-int get_owner(int fd, dev_t dev, ino_t ino, uid_t *uid, gid_t *gid);
-int set_owner(int fd, dev_t dev, ino_t ino, uid_t uid, gid_t gid);
+// fd, if it isn't -1, is a connection inherited across exec(); ns is the
+// session's namespace (see NS_DEV), 0 unless it was attached to a shared
+// daemon.
+int comm_init(const char *socket_path, int fd, uint32_t ns);
+int init_shared(const char *shm_name);
+int init_ring(const char *shm_name);
+int is_comm_fd(int fd);
+
+// Hand this thread's connection down across an exec(): flushes everything
+// and makes the fd inheritable. If the exec fails, call comm_exec_failed().
+int comm_exec_fd(void);
+void comm_exec_failed(int fd);
+int get_owner(dev_t dev, ino_t ino, uid_t *uid, gid_t *gid);
+int set_owner(dev_t dev, ino_t ino, uid_t uid, gid_t gid);
+int flush_owners(void);
+
+// Everything we fake about an inode. `known` says which of the other
+// fields are set; the rest come from the real file.
+#define FAKE_OWNER  0x1     // uid and gid
+#define FAKE_MODE   0x2     // permission bits (07777) of mode
+#define FAKE_TYPE   0x4     // file type bits of mode, and rdev
+#define FAKE_FIELDS (FAKE_OWNER | FAKE_MODE | FAKE_TYPE)
+
+// Only in SETs: the inode was just created, so drop whatever was recorded
+// for it before (its number may have been used by a deleted file).
+#define FAKE_FRESH  0x100
+
+struct fake_attrs {
+    unsigned known;
+    uid_t uid;
+    gid_t gid;
+    mode_t mode;
+    dev_t rdev;
+};
+
+// Returns attrs->known, or -1 on error.
+int get_attrs(dev_t dev, ino_t ino, struct fake_attrs *attrs);
+int set_attrs(dev_t dev, ino_t ino, const struct fake_attrs *attrs);
+int del_attrs(dev_t dev, ino_t ino);
+
+// Look up or record many inodes in one exchange with the daemon. A lookup
+// fills in known with the record's FAKE_* bits, and mode along with the
+// owner; set_owner_many() only records owners.
+struct owner_query {
+    dev_t dev;
+    ino_t ino;
+    uid_t uid;
+    gid_t gid;
+    mode_t mode;
+    int known;
+};
+
+int get_owner_many(struct owner_query *q, int n);
+
+// The owner the policy gives an inode on dev that's really owned by *uid
+// and has no owner on record, if there's a rule for it: returns 1 and sets
+// *uid and *gid. fresh_owner() is the same for one we've just made.
+int implied_owner(dev_t dev, uid_t *uid, gid_t *gid);
+int fresh_owner(dev_t dev, uid_t *uid, gid_t *gid);
+int set_owner_many(const struct owner_query *q, int n);
+// Lookups answered from our cache, sent to the daemon, and answered by the
+// shared filter instead.
+void get_cache_stats(unsigned long *hits, unsigned long *misses,
+        unsigned long *skipped);
+
+// Timing for FAKEROOT_STATS: comm_clock() is a nanosecond clock, and with
+// comm_timing() on, comm_ipc_time() is how long this thread has spent
+// talking to the daemon so far.
+struct comm_stat;
+void comm_timing(int on);
+uint64_t comm_clock(void);
+uint64_t comm_ipc_time(void);
+int send_stats(const struct comm_stat *stats, uint32_t n);
 
+// GET_OWNER answers with the whole record, with its FAKE_* bits in known.
+// SET_OWNER sets the fields named in known (FAKE_FRESH included).
 #define GET_OWNER   0x1000
-#define SET_OWNER   0x1001
+#define SET_OWNER   0x1001  // one-way: no reply is sent
+#define OPEN_RING   0x1002
+#define SYNC        0x1003  // reply once everything before it is applied
+#define HELLO       0x1004  // first frame on every connection; see NS_DEV
+#define DEL_OWNER   0x1005  // one-way: forget an inode that's gone
+#define STATS       0x1006  // one-way: a process's comm_stats, as it exits
 
 // Make sure that this structure is laid out the same way on 32- and 64-bit!
 struct comm_pkt {
     uint64_t action, known;
     uint64_t dev, ino, uid, gid;
+    uint64_t generation;
+    uint64_t mode, rdev;
 };
 
+// On the socket, everything travels in frames: a header followed by
+// `count` entries, each a comm_pkt carrying dev/ino (and uid/gid for SET).
+// A reply has the request's action and reqid, with one entry per entry
+// asked about; replies to different requests may come back in any order.
+// The shared-memory ring carries bare comm_pkts instead.
+#define PROTO_VERSION   3
+#define MAX_FRAME_ENTS  4096
+
+// Sessions attached to a shared daemon (fakeroot --attach) each keep their
+// records apart under a namespace, which a client names in its HELLO (in
+// the dev of its one entry; no entry is namespace 0). The daemon folds it
+// into the top half of every dev it's sent, which namespace 0 leaves as
+// it is. Device numbers only rarely use those bits; the filter and the
+// device rules go by the bottom half, so they hold in every namespace.
+#define NS_DEV(ns, dev) ((uint64_t) (dev) ^ (uint64_t) (ns) << 32)
+
+struct comm_hdr {
+    uint32_t length;        // of the whole frame, header included
+    uint16_t version;       // PROTO_VERSION
+    uint16_t action;
+    uint32_t reqid;
+    uint32_t count;
+    uint64_t generation;    // in replies
+};
+
+#define FRAME_LENGTH(count) \
+    (sizeof(struct comm_hdr) + (size_t) (count) * sizeof(struct comm_pkt))
+
+// A STATS frame's entries are these instead, one per hooked call that was
+// made. Time spent waiting on the daemon is counted apart from the rest
+// (the real call and our own work), each with a histogram of how long
+// calls took: bucket b counts those under 2^b ns.
+#define STAT_BUCKETS    32
+#define STAT_CALLS      1024    // callno is always below this
+
+struct comm_stat {
+    uint32_t callno, pad;
+    uint64_t count;
+    uint64_t real_ns, ipc_ns;
+    uint32_t real_hist[STAT_BUCKETS], ipc_hist[STAT_BUCKETS];
+};
+
+#define STATS_LENGTH(count) \
+    (sizeof(struct comm_hdr) + (size_t) (count) * sizeof(struct comm_stat))
+
+// How the daemon gets libfakeroot into the processes it runs.
+#ifdef __APPLE__
+#define PRELOAD_VAR     "DYLD_INSERT_LIBRARIES"
+#define LIBFAKEROOT     "libfakeroot.dylib"
+#else
+#define PRELOAD_VAR     "LD_PRELOAD"
+#define LIBFAKEROOT     "libfakeroot.so"
+#endif
+
+// Read-only page published by the daemon (via shm_open) to every client.
+// The generation is bumped once for every SET_OWNER the daemon processes,
+// which lets clients tell when their cached lookups may have gone stale.
+#define SHARED_MAGIC    0x666b72745348ULL
+
+//
+// After that comes a filter of every inode the daemon has a record for, so
+// a client can tell without asking when the answer would be "unknown": a
+// bit per device (by hash) that has any, and a Bloom filter over dev/ino
+// whose FILTER_HASHES bits for a key all fall in one 64-byte line. Bits
+// are only ever added, except when the daemon rebuilds the filter to shed
+// deleted inodes; filter_seq is odd while it does, and changes each time.
+#define FILTER_DEVICES  4096
+#define FILTER_LINES    (1 << 16)   // 4 MiB
+#define FILTER_HASHES   4
+
+// The owner policy, set before any client starts: who an inode with no
+// owner on record belongs to. A device rule covers everything on that
+// device; failing that, with POLICY_DEFAULT, anything really owned by
+// session_uid (who started fakeroot, so whoever made the files the
+// session makes) belongs to default_uid:default_gid. Anything else is
+// owned by whoever really owns it.
+#define POLICY_DEVICES  16
+#define POLICY_DEFAULT  0x1
+
+struct owner_policy {
+    uint32_t flags, ndevices;
+    uint32_t session_uid, default_uid, default_gid, pad;
+    struct {
+        uint64_t dev;
+        uint32_t uid, gid;
+    } devices[POLICY_DEVICES];
+};
+
+struct fakeroot_shared {
+    uint64_t magic;
+    volatile uint64_t generation;
+    struct owner_policy policy;
+    volatile uint64_t filter_seq;
+    volatile uint64_t devices[FILTER_DEVICES / 64];
+    volatile uint64_t filter[FILTER_LINES][8] __attribute__((aligned(64)));
+};
+
+static inline uint64_t filter_hash(uint64_t dev, uint64_t ino)
+{
+    dev = (uint32_t) dev;
+    uint64_t h = ino * 0x9e3779b97f4a7c15ULL ^ dev * 0xc2b2ae3d27d4eb4fULL;
+    h = (h ^ (h >> 31)) * 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 29);
+}
+
+static inline unsigned filter_device(uint64_t dev)
+{
+    return ((uint32_t) dev * 0x9e3779b97f4a7c15ULL) >> 52;
+}
+
+// Whether dev/ino might have a record. Not a snapshot: see filter_seq.
+static inline int filter_test(const struct fakeroot_shared *sh,
+        uint64_t dev, uint64_t ino)
+{
+    unsigned d = filter_device(dev);
+    if(!(sh->devices[d / 64] & (1ULL << (d % 64))))
+        return 0;
+
+    uint64_t h = filter_hash(dev, ino);
+    const volatile uint64_t *line = sh->filter[h % FILTER_LINES];
+
+    h /= FILTER_LINES;
+    for(int i = 0; i < FILTER_HASHES; i++, h >>= 9) {
+        if(!(line[(h >> 6) & 7] & (1ULL << (h & 63))))
+            return 0;
+    }
+
+    return 1;
+}
+
+#endif
@@ -0,0 +1,915 @@
+#include "daemon.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "nodetable.h"
+#include "snapshot.h"
+#include "wal.h"
+
+// The table is split into shards by key hash, each with its own lock, so
+// worker and ring threads only contend when they touch the same shard.
+#define SHARD_BITS  6
+#define NSHARDS     (1 << SHARD_BITS)
+
+static struct shard {
+    pthread_mutex_t lock;
+    struct node_table table;
+    uint64_t gets, hits, sets, dels;    // entries, for the control socket
+} __attribute__((aligned(64))) shards[NSHARDS];
+
+// Until main() maps the real page, generations and the filter just go
+// in here.
+static struct fakeroot_shared fallback_shared;
+struct fakeroot_shared *shared = &fallback_shared;
+
+// The --persist file as of startup, mapped read-only, and the log of
+// changes since.
+static struct snapshot snap;
+static struct wal wal;
+static int journaling = 0;
+
+static struct owner_policy policy;
+static int policy_given;
+
+// Deletes since the filter was last rebuilt, and how many rebuilds.
+static uint64_t filter_dels, filter_rebuilds;
+
+static int shard_index(const struct dbKey *key)
+{
+    return nodetable_hash(key) >> (64 - SHARD_BITS);
+}
+
+static struct shard *shard_for(const struct dbKey *key)
+{
+    return &shards[shard_index(key)];
+}
+
+void init_shards(size_t hint)
+{
+    for(int i = 0; i < NSHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        if(nodetable_init(&shards[i].table, hint / NSHARDS) < 0)
+            fatal("nodetable_init");
+    }
+}
+
+void free_shards(void)
+{
+    for(int i = 0; i < NSHARDS; i++)
+        nodetable_free(&shards[i].table);
+}
+
+int migrate_shards(void)
+{
+    int pending = 0;
+
+    for(int i = 0; i < NSHARDS; i++) {
+        struct shard *sh = &shards[i];
+        if(!sh->table.old)
+            continue;
+
+        if(pthread_mutex_trylock(&sh->lock) == 0) {
+            pending |= nodetable_migrate(&sh->table, 256);
+            pthread_mutex_unlock(&sh->lock);
+        } else {
+            pending = 1;
+        }
+    }
+
+    return pending;
+}
+
+// Note that key has a record in the shared filter. This has to happen
+// before the write's generation bump: that's what tells a client it may
+// ask again.
+static void filter_add(const struct dbKey *key)
+{
+    unsigned d = filter_device(key->dev);
+    uint64_t h = filter_hash(key->dev, key->ino);
+    volatile uint64_t *line = shared->filter[h % FILTER_LINES];
+
+    if(!(shared->devices[d / 64] & (1ULL << (d % 64))))
+        __sync_fetch_and_or(&shared->devices[d / 64], 1ULL << (d % 64));
+
+    h /= FILTER_LINES;
+    for(int i = 0; i < FILTER_HASHES; i++, h >>= 9) {
+        uint64_t bit = 1ULL << (h & 63);
+        if(!(line[(h >> 6) & 7] & bit))
+            __sync_fetch_and_or(&line[(h >> 6) & 7], bit);
+    }
+}
+
+static void filter_add_entry(const struct node_entry *ent, void *arg)
+{
+    if(ent->val.flags)
+        filter_add(&ent->key);
+}
+
+void rebuild_filter(void)
+{
+    for(int i = 0; i < NSHARDS; i++)
+        pthread_mutex_lock(&shards[i].lock);
+
+    // Clients ignore the filter while the sequence number is odd.
+    __sync_fetch_and_add((uint64_t *) &shared->filter_seq, 1);
+    memset((void *) shared->devices, 0, sizeof(shared->devices));
+    memset((void *) shared->filter, 0, sizeof(shared->filter));
+
+    // Snapshot records that the tables have blanked out since only make
+    // for false positives.
+    for(uint64_t i = 0; i < snap.count; i++) {
+        struct dbKey key = {
+            .dev = snap.recs[i].dev,
+            .ino = snap.recs[i].ino,
+        };
+        filter_add(&key);
+    }
+    for(int i = 0; i < NSHARDS; i++)
+        nodetable_foreach(&shards[i].table, filter_add_entry, NULL);
+
+    __sync_fetch_and_add((uint64_t *) &shared->filter_seq, 1);
+    filter_dels = 0;
+    filter_rebuilds++;
+
+    for(int i = 0; i < NSHARDS; i++)
+        pthread_mutex_unlock(&shards[i].lock);
+}
+
+// Deleted inodes stay in the filter until it's rebuilt; do that once they
+// could be a good part of what's in it.
+#define FILTER_STALE_MIN    65536
+
+int refresh_filter(void)
+{
+    if(filter_dels < FILTER_STALE_MIN)
+        return 0;
+
+    uint64_t entries = snap.count;
+    for(int i = 0; i < NSHARDS; i++)
+        entries += shards[i].table.count;
+
+    if(filter_dels < entries / 4)
+        return 0;
+
+    rebuild_filter();
+    return 1;
+}
+
+// Log a SET or DEL. Call with the shard locked, so each inode's changes
+// go in the log in the order they were made.
+static void journal(int op, const struct comm_pkt *pkt)
+{
+    if(!journaling)
+        return;
+
+    struct wal_rec rec = {
+        .dev = pkt->dev,
+        .ino = pkt->ino,
+        .uid = pkt->uid,
+        .gid = pkt->gid,
+        .rdev = pkt->rdev,
+        .known = pkt->known,
+        .mode = pkt->mode,
+        .op = op,
+    };
+
+    wal_append(&wal, &rec);
+}
+
+// What a GET answers with, and what a SET does to the record.
+static void get_val(struct comm_pkt *pkt, const struct dbVal *val)
+{
+    if(!val) {
+        pkt->known = 0;
+        return;
+    }
+
+    pkt->known = val->flags;
+    pkt->uid = val->uid;
+    pkt->gid = val->gid;
+    pkt->mode = val->mode;
+    pkt->rdev = val->rdev;
+}
+
+static void set_val(struct dbVal *val, const struct comm_pkt *pkt)
+{
+    if(pkt->known & FAKE_FRESH)
+        memset(val, 0, sizeof(*val));
+
+    if(pkt->known & FAKE_OWNER) {
+        val->uid = pkt->uid;
+        val->gid = pkt->gid;
+    }
+
+    if(pkt->known & FAKE_MODE)
+        val->mode = (val->mode & S_IFMT) | (pkt->mode & 07777);
+
+    if(pkt->known & FAKE_TYPE) {
+        val->mode = (val->mode & 07777) | (pkt->mode & S_IFMT);
+        val->rdev = pkt->rdev;
+    }
+
+    val->flags |= pkt->known & FAKE_FIELDS;
+}
+
+// Records come from the shard's table if they've been touched this
+// session, otherwise from the snapshot. All of these need the shard
+// locked.
+static const struct dbVal *lookup(struct shard *sh, const struct dbKey *key,
+        struct dbVal *buf)
+{
+    struct dbVal *val = nodetable_get(&sh->table, key);
+    if(val)
+        return val;
+
+    return snapshot_get(&snap, key, buf) ? buf : NULL;
+}
+
+static struct dbVal *lookup_write(struct shard *sh, const struct dbKey *key)
+{
+    int created;
+    struct dbVal *val = nodetable_upsert(&sh->table, key, &created);
+
+    if(val && created)
+        snapshot_get(&snap, key, val);
+
+    return val;
+}
+
+static void forget(struct shard *sh, const struct dbKey *key)
+{
+    // A blank record hides the snapshot's.
+    if(snapshot_get(&snap, key, NULL)) {
+        struct dbVal *val = nodetable_upsert(&sh->table, key, NULL);
+        if(val)
+            memset(val, 0, sizeof(*val));
+    } else {
+        nodetable_del(&sh->table, key);
+    }
+}
+
+// Whether a device rule already gives the owner a SET records. (Only
+// clients know real owners, so the session rule is up to them.)
+static int owner_implied(const struct comm_pkt *pkt)
+{
+    const struct owner_policy *p = &shared->policy;
+
+    if(!(pkt->known & FAKE_OWNER))
+        return 0;
+
+    for(uint32_t i = 0; i < p->ndevices; i++) {
+        if((uint32_t) p->devices[i].dev == (uint32_t) pkt->dev)
+            return p->devices[i].uid == pkt->uid &&
+                p->devices[i].gid == pkt->gid;
+    }
+
+    return 0;
+}
+
+// Apply a SET to the shard's record for key. Returns 0 if the table is
+// full. Call with the shard locked.
+static int store(struct shard *sh, const struct dbKey *key,
+        const struct comm_pkt *pkt)
+{
+    struct dbVal *val = lookup_write(sh, key);
+    if(!val)
+        return 0;
+
+    set_val(val, pkt);
+
+    if(!owner_implied(pkt)) {
+        journal(WAL_SET, pkt);
+        filter_add(key);
+        return 1;
+    }
+
+    // The policy says as much already, so keep only the rest. Replaying
+    // the SET wouldn't drop an owner, so what goes in the log is the
+    // record as it now stands.
+    val->flags &= ~FAKE_OWNER;
+    if(!val->flags) {
+        forget(sh, key);
+        journal(WAL_DEL, pkt);
+        return 1;
+    }
+
+    struct comm_pkt now = {
+        .known = val->flags | FAKE_FRESH,
+        .dev = pkt->dev,
+        .ino = pkt->ino,
+        .mode = val->mode,
+        .rdev = val->rdev,
+    };
+    journal(WAL_SET, &now);
+    filter_add(key);
+    return 1;
+}
+
+void process_pkt(struct comm_pkt *pkt)
+{
+    struct dbKey key = {
+        .dev = pkt->dev,
+        .ino = pkt->ino,
+    };
+
+    struct shard *sh = shard_for(&key);
+
+    switch(pkt->action) {
+        case GET_OWNER:
+        {
+            // Read the generation first: if a SET sneaks in before our
+            // lookup, the client will just resync with us sooner.
+            pkt->generation = shared->generation;
+
+            struct dbVal buf;
+            pthread_mutex_lock(&sh->lock);
+            get_val(pkt, lookup(sh, &key, &buf));
+            sh->gets++;
+            sh->hits += pkt->known != 0;
+            pthread_mutex_unlock(&sh->lock);
+        }
+            break;
+
+        case SET_OWNER:
+        {
+            pthread_mutex_lock(&sh->lock);
+            int stored = store(sh, &key, pkt);
+            sh->sets++;
+            pthread_mutex_unlock(&sh->lock);
+
+            if(!stored) {
+                fprintf(stderr, "fakeroot: ownership table full\n");
+                break;
+            }
+
+            __sync_fetch_and_add((uint64_t *) &shared->generation, 1);
+        }
+            break;
+
+        case DEL_OWNER:
+            pthread_mutex_lock(&sh->lock);
+            forget(sh, &key);
+            journal(WAL_DEL, pkt);
+            sh->dels++;
+            pthread_mutex_unlock(&sh->lock);
+
+            __sync_fetch_and_add(&filter_dels, 1);
+            // Clients count on every write bumping the generation.
+            __sync_fetch_and_add((uint64_t *) &shared->generation, 1);
+            break;
+
+        case SYNC:
+            // Connections are served in order, so everything this client
+            // sent before has been applied by now.
+            pkt->generation = shared->generation;
+            break;
+
+        default:
+            fprintf(stderr, "Unknown action %x\n", (int) pkt->action);
+    }
+}
+
+// A GET_OWNER, SET_OWNER or DEL_OWNER frame with n entries. Entries are
+// grouped by shard so each shard's lock is taken only once. Returns the
+// generation a GET's answers are good for.
+uint64_t process_many(int action, struct comm_pkt *ents, size_t n)
+{
+    size_t start[NSHARDS + 1] = { 0 };
+    uint16_t order[n];
+    uint8_t which[n];
+    uint64_t updated = 0, generation = shared->generation;
+
+    for(size_t i = 0; i < n; i++) {
+        struct dbKey key = { .dev = ents[i].dev, .ino = ents[i].ino };
+        which[i] = shard_index(&key);
+        start[which[i] + 1]++;
+    }
+
+    for(int s = 0; s < NSHARDS; s++)
+        start[s + 1] += start[s];
+
+    {
+        size_t fill[NSHARDS];
+        memcpy(fill, start, sizeof(fill));
+        for(size_t i = 0; i < n; i++)
+            order[fill[which[i]]++] = i;
+    }
+
+    for(int s = 0; s < NSHARDS; s++) {
+        if(start[s] == start[s + 1])
+            continue;
+
+        struct shard *sh = &shards[s];
+        pthread_mutex_lock(&sh->lock);
+
+        for(size_t k = start[s]; k < start[s + 1]; k++) {
+            struct comm_pkt *ent = &ents[order[k]];
+            struct dbKey key = { .dev = ent->dev, .ino = ent->ino };
+
+            if(action == GET_OWNER) {
+                struct dbVal buf;
+                get_val(ent, lookup(sh, &key, &buf));
+                sh->hits += ent->known != 0;
+            } else if(action == DEL_OWNER) {
+                forget(sh, &key);
+                journal(WAL_DEL, ent);
+                updated++;
+            } else {
+                updated += store(sh, &key, ent);
+            }
+        }
+
+        size_t k = start[s + 1] - start[s];
+        if(action == GET_OWNER)
+            sh->gets += k;
+        else if(action == DEL_OWNER)
+            sh->dels += k;
+        else
+            sh->sets += k;
+
+        pthread_mutex_unlock(&sh->lock);
+    }
+
+    if(action == DEL_OWNER)
+        __sync_fetch_and_add(&filter_dels, updated);
+
+    if(updated != 0)
+        __sync_fetch_and_add((uint64_t *) &shared->generation, updated);
+
+    if(action == SET_OWNER && updated != n)
+        fprintf(stderr, "fakeroot: ownership table full\n");
+
+    return generation;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// Files from before the snapshot format: the same header, then unsorted
+// records, which we just read into the tables.
+
+struct legacy_header {
+    char magic[8];
+    uint32_t version, reclen;
+    uint64_t count;
+};
+
+struct legacy_rec_v1 {
+    uint64_t dev, ino;
+    uint32_t uid, gid;
+};
+
+static void load_legacy(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if(!fp)
+        fatal(path);
+
+    // Version 2 records are laid out like the snapshot's.
+    struct legacy_header hdr;
+    if(fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+       memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0 ||
+       !((hdr.version == 2 &&
+          hdr.reclen == sizeof(struct snapshot_rec)) ||
+         (hdr.version == 1 &&
+          hdr.reclen == sizeof(struct legacy_rec_v1)))) {
+        fprintf(stderr, "%s: not a fakeroot state file\n", path);
+        exit(1);
+    }
+
+    init_shards(hdr.count);
+
+    struct snapshot_rec recs[1024];
+    size_t n;
+    uint64_t left = hdr.count;
+
+    while(left && (n = fread(recs, hdr.reclen,
+                    left < 1024 ? left : 1024, fp)) > 0) {
+        // Widen old records in place, back to front.
+        if(hdr.version == 1) {
+            struct legacy_rec_v1 *old = (struct legacy_rec_v1 *) recs;
+            for(size_t i = n; i-- > 0; ) {
+                struct legacy_rec_v1 rec = old[i];
+                recs[i] = (struct snapshot_rec) {
+                    .dev = rec.dev,
+                    .ino = rec.ino,
+                    .uid = rec.uid,
+                    .gid = rec.gid,
+                    .flags = FAKE_OWNER,
+                };
+            }
+        }
+
+        for(size_t i = 0; i < n; i++) {
+            struct dbKey key = { .dev = recs[i].dev, .ino = recs[i].ino };
+            struct dbVal *val = nodetable_upsert(&shard_for(&key)->table,
+                    &key, NULL);
+            if(!val)
+                fatal("nodetable_upsert");
+            val->uid = recs[i].uid;
+            val->gid = recs[i].gid;
+            val->rdev = recs[i].rdev;
+            val->mode = recs[i].mode;
+            val->flags = recs[i].flags;
+        }
+        left -= n;
+    }
+
+    if(left)
+        fprintf(stderr, "%s: truncated state file\n", path);
+
+    fclose(fp);
+}
+
+static void load_persist(const char *path)
+{
+    if(snapshot_open(&snap, path) == 0) {
+        init_shards(0);
+        return;
+    }
+
+    if(errno == ENOENT)
+        init_shards(0);
+    else if(errno == EINVAL)
+        load_legacy(path);
+    else
+        fatal(path);
+}
+
+struct save_state {
+    struct node_entry *ents;
+    size_t n;
+};
+
+static void collect_entry(const struct node_entry *ent, void *arg)
+{
+    struct save_state *st = arg;
+    st->ents[st->n++] = *ent;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+    const struct node_entry *x = a, *y = b;
+    return snapshot_cmp(x->key.dev, x->key.ino, y->key.dev, y->key.ino);
+}
+
+static void add_entry(struct snapshot_writer *w, const struct node_entry *ent)
+{
+    // Blank records stand for ones deleted from the snapshot.
+    if(!ent->val.flags)
+        return;
+
+    struct snapshot_rec rec = {
+        .dev = ent->key.dev,
+        .ino = ent->key.ino,
+        .uid = ent->val.uid,
+        .gid = ent->val.gid,
+        .rdev = ent->val.rdev,
+        .mode = ent->val.mode,
+        .flags = ent->val.flags,
+    };
+
+    snapshot_add(w, &rec);
+}
+
+// Copy out everything changed this session. Call with all shards locked.
+static int collect_changes(struct save_state *st)
+{
+    size_t total = 0;
+
+    for(int i = 0; i < NSHARDS; i++)
+        total += shards[i].table.count;
+
+    st->ents = NULL;
+    st->n = 0;
+
+    if(total && !(st->ents = malloc(total * sizeof(*st->ents)))) {
+        perror("malloc");
+        return -1;
+    }
+
+    for(int i = 0; i < NSHARDS; i++)
+        nodetable_foreach(&shards[i].table, collect_entry, st);
+
+    return 0;
+}
+
+// Merge changes with the snapshot we started from into a new one.
+static int write_snapshot(const char *path, struct save_state *st)
+{
+    qsort(st->ents, st->n, sizeof(*st->ents), entry_cmp);
+
+    struct snapshot_writer w;
+    if(snapshot_begin(&w, path) < 0) {
+        perror(w.tmppath);
+        free(st->ents);
+        return -1;
+    }
+
+    uint64_t i = 0;
+    size_t j = 0;
+
+    while(i < snap.count || j < st->n) {
+        const struct snapshot_rec *rec = i < snap.count ? &snap.recs[i] : NULL;
+        const struct node_entry *ent = j < st->n ? &st->ents[j] : NULL;
+        int c = !rec ? 1 : !ent ? -1 :
+            snapshot_cmp(rec->dev, rec->ino, ent->key.dev, ent->key.ino);
+
+        if(c < 0) {
+            snapshot_add(&w, rec);
+            i++;
+        } else {
+            // Ours replaces the snapshot's.
+            add_entry(&w, ent);
+            j++;
+            if(c == 0)
+                i++;
+        }
+    }
+
+    free(st->ents);
+    return snapshot_finish(&w);
+}
+
+static int save_persist(const char *path)
+{
+    struct save_state st;
+
+    if(collect_changes(&st) < 0)
+        return -1;
+
+    return write_snapshot(path, &st);
+}
+
+static void replay_rec(const struct wal_rec *rec, void *arg)
+{
+    struct dbKey key = { .dev = rec->dev, .ino = rec->ino };
+    struct shard *sh = shard_for(&key);
+
+    if(rec->op == WAL_DEL) {
+        forget(sh, &key);
+        return;
+    }
+
+    struct comm_pkt pkt = {
+        .known = rec->known,
+        .uid = rec->uid,
+        .gid = rec->gid,
+        .mode = rec->mode,
+        .rdev = rec->rdev,
+    };
+
+    struct dbVal *val = lookup_write(sh, &key);
+    if(!val)
+        fatal("nodetable_upsert");
+    set_val(val, &pkt);
+}
+
+// Every so often the log is folded into a new snapshot, so that it (and
+// replaying it at startup) doesn't grow without bound. The tables keep
+// everything; they're still relative to the snapshot we started from.
+#define CHECKPOINT_BYTES    (64 << 20)
+#define CHECKPOINT_SECS     300
+
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *persist_path;
+
+static int checkpoint(const char *path)
+{
+    struct save_state st;
+    int res;
+
+    for(int i = 0; i < NSHARDS; i++)
+        pthread_mutex_lock(&shards[i].lock);
+
+    res = collect_changes(&st);
+    if(res == 0 && (res = wal_rotate(&wal)) < 0)
+        free(st.ents);
+
+    for(int i = 0; i < NSHARDS; i++)
+        pthread_mutex_unlock(&shards[i].lock);
+
+    if(res == 0 && (res = write_snapshot(path, &st)) == 0)
+        wal_drop_old(&wal);
+    return res;
+}
+
+static void *checkpoint_thread(void *arg)
+{
+    time_t last = time(NULL);
+
+    for(;;) {
+        sleep(1);
+
+        uint64_t size = wal_size(&wal);
+        if(size < CHECKPOINT_BYTES &&
+           !(size && time(NULL) - last >= CHECKPOINT_SECS))
+            continue;
+
+        pthread_mutex_lock(&checkpoint_lock);
+        checkpoint(arg);
+        pthread_mutex_unlock(&checkpoint_lock);
+
+        last = time(NULL);
+    }
+
+    return NULL;
+}
+
+
+void get_store_stats(struct store_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+
+    // No locking: these are only for watching, and a count that's off by
+    // a few doesn't matter.
+    for(int i = 0; i < NSHARDS; i++) {
+        const struct shard *sh = &shards[i];
+
+        st->entries += sh->table.count;
+        st->bytes += (sh->table.nbuckets + sh->table.old_nbuckets) *
+            sizeof(struct node_bucket);
+        st->gets += sh->gets;
+        st->hits += sh->hits;
+        st->sets += sh->sets;
+        st->dels += sh->dels;
+    }
+
+    st->snap_entries = snap.count;
+    st->snap_bytes = snap.maplen;
+
+    for(int i = 0; i < FILTER_LINES; i++) {
+        for(int w = 0; w < 8; w++)
+            st->filter_bits += __builtin_popcountll(shared->filter[i][w]);
+    }
+    st->filter_rebuilds = filter_rebuilds;
+}
+
+
+int policy_add_device(uint64_t dev, uint32_t uid, uint32_t gid)
+{
+    for(uint32_t i = 0; i < policy.ndevices; i++) {
+        if(policy.devices[i].dev == dev) {
+            policy.devices[i].uid = uid;
+            policy.devices[i].gid = gid;
+            return 0;
+        }
+    }
+
+    if(policy.ndevices == POLICY_DEVICES)
+        return -1;
+
+    policy.devices[policy.ndevices].dev = dev;
+    policy.devices[policy.ndevices].uid = uid;
+    policy.devices[policy.ndevices].gid = gid;
+    policy.ndevices++;
+    policy_given = 1;
+    return 0;
+}
+
+void policy_set_default(uint32_t uid, uint32_t gid)
+{
+    policy.flags |= POLICY_DEFAULT;
+    policy.default_uid = uid;
+    policy.default_gid = gid;
+    policy_given = 1;
+}
+
+void publish_policy(void)
+{
+    policy.session_uid = getuid();
+    shared->policy = policy;
+}
+
+// What the records in a --persist file leave out depends on the policy
+// they were made under, so it's kept in path.policy next to it.
+static int load_policy(const char *path, struct owner_policy *p)
+{
+    FILE *fp = fopen(path, "r");
+    if(!fp)
+        return -1;
+
+    char kind[16];
+    unsigned long long dev;
+    unsigned uid, gid;
+
+    memset(p, 0, sizeof(*p));
+    while(fscanf(fp, "%15s", kind) == 1) {
+        if(strcmp(kind, "default") == 0 &&
+           fscanf(fp, "%u %u", &uid, &gid) == 2) {
+            p->flags |= POLICY_DEFAULT;
+            p->default_uid = uid;
+            p->default_gid = gid;
+        } else if(strcmp(kind, "device") == 0 &&
+                  fscanf(fp, "%llu %u %u", &dev, &uid, &gid) == 3 &&
+                  p->ndevices < POLICY_DEVICES) {
+            p->devices[p->ndevices].dev = dev;
+            p->devices[p->ndevices].uid = uid;
+            p->devices[p->ndevices].gid = gid;
+            p->ndevices++;
+        } else {
+            fprintf(stderr, "fakeroot: %s: bad policy\n", path);
+            exit(1);
+        }
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+static void save_policy(const char *path, const struct owner_policy *p)
+{
+    if(!p->flags && !p->ndevices) {
+        unlink(path);
+        return;
+    }
+
+    FILE *fp = fopen(path, "w");
+    if(!fp)
+        fatal(path);
+
+    if(p->flags & POLICY_DEFAULT)
+        fprintf(fp, "default %u %u\n", p->default_uid, p->default_gid);
+    for(uint32_t i = 0; i < p->ndevices; i++) {
+        fprintf(fp, "device %llu %u %u\n",
+                (unsigned long long) p->devices[i].dev,
+                p->devices[i].uid, p->devices[i].gid);
+    }
+
+    if(fclose(fp) != 0)
+        fatal(path);
+}
+
+static void persist_policy(const char *path)
+{
+    char ppath[PATH_MAX];
+    struct owner_policy saved;
+    int have_saved;
+
+    snprintf(ppath, sizeof(ppath), "%s.policy", path);
+    have_saved = load_policy(ppath, &saved) == 0;
+
+    if(!policy_given) {
+        if(have_saved)
+            policy = saved;
+        return;
+    }
+
+    if(have_saved && (saved.flags != policy.flags ||
+            saved.default_uid != policy.default_uid ||
+            saved.default_gid != policy.default_gid ||
+            saved.ndevices != policy.ndevices ||
+            memcmp(saved.devices, policy.devices,
+                sizeof(saved.devices[0]) * saved.ndevices) != 0))
+        fprintf(stderr, "fakeroot: warning: %s was saved with a different "
+                "owner policy; files it covered will change owner\n", path);
+
+    save_policy(ppath, &policy);
+}
+
+int persist_checkpoint(void)
+{
+    if(!journaling)
+        return -1;
+
+    pthread_mutex_lock(&checkpoint_lock);
+    int res = checkpoint(persist_path);
+    pthread_mutex_unlock(&checkpoint_lock);
+    return res;
+}
+
+void persist_open(const char *path)
+{
+    persist_path = path;
+    persist_policy(path);
+    load_persist(path);
+
+    if(wal_open(&wal, path, replay_rec, NULL) < 0)
+        exit(1);
+    journaling = 1;
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, checkpoint_thread, (void *) path) != 0)
+        fatal("pthread_create (checkpoint)");
+}
+
+
+void persist_close(const char *path)
+{
+    // Workers are still running; keep them out for good.
+    pthread_mutex_lock(&checkpoint_lock);
+    for(int i = 0; i < NSHARDS; i++)
+        pthread_mutex_lock(&shards[i].lock);
+
+    // Only once it's all safely in the snapshot can the log go.
+    int saved = save_persist(path) == 0;
+    if(journaling)
+        wal_close(&wal, saved);
+}
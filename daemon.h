@@ -0,0 +1,67 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "communicate.h"
+
+// The daemon's ownership store and what it does with requests, apart from
+// how they arrive; fakeroot.c does the sockets. None of this is tied to
+// kqueue or Darwin, so the benchmarks link it directly.
+
+#define fatal(msg) do { perror(msg); exit(1); } while(0)
+
+// Bumped on every change; points into the shared page once there is one.
+extern struct fakeroot_shared *shared;
+
+void init_shards(size_t hint);
+void free_shards(void);
+
+// Give any shards that are in the middle of a resize a push. Returns
+// nonzero if there's more to do.
+int migrate_shards(void);
+
+void process_pkt(struct comm_pkt *pkt);
+
+// Fill the shared page's filter from scratch; main() does this once the
+// page is mapped. refresh_filter() does it only if enough has been deleted
+// to make it worthwhile, and returns nonzero if it did.
+void rebuild_filter(void);
+int refresh_filter(void);
+
+// A GET_OWNER, SET_OWNER or DEL_OWNER frame with n entries. Returns the
+// generation a GET's answers are good for.
+uint64_t process_many(int action, struct comm_pkt *ents, size_t n);
+
+// Totals for the control socket. Entries and bytes are the tables' (the
+// in-memory overlay, when there's a snapshot); gets and so on count
+// entries, whichever way they came in.
+struct store_stats {
+    uint64_t entries, bytes;
+    uint64_t snap_entries, snap_bytes;
+    uint64_t gets, hits, sets, dels;
+    uint64_t filter_bits, filter_rebuilds;
+};
+
+void get_store_stats(struct store_stats *st);
+
+// The owner policy (see communicate.h). Options set it up before
+// persist_open(), which keeps it alongside the --persist file (or, given
+// none, picks up what's there); publish_policy() puts it in the shared
+// page, which is what clients and the store go by from then on.
+int policy_add_device(uint64_t dev, uint32_t uid, uint32_t gid);
+void policy_set_default(uint32_t uid, uint32_t gid);
+void publish_policy(void);
+
+// Load the --persist file (setting up the shards) and start journaling
+// to it; persist_close() saves everything back on the way out.
+void persist_open(const char *path);
+void persist_close(const char *path);
+
+// Fold the log into the snapshot now rather than when it's next due.
+// Returns -1 without a --persist file, or if it couldn't be written.
+int persist_checkpoint(void);
+
+#endif
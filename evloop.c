@@ -0,0 +1,125 @@
+#include "evloop.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#else
+#include <sys/types.h>
+#include <sys/event.h>
+#endif
+
+#if defined(__linux__)
+
+int evloop_create(void)
+{
+    return epoll_create1(EPOLL_CLOEXEC);
+}
+
+static int watch(int loop, int fd, void *udata, uint32_t events)
+{
+    struct epoll_event ev = {
+        .events = events,
+        .data.ptr = udata,
+    };
+
+    return epoll_ctl(loop, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int evloop_add(int loop, int fd, void *udata)
+{
+    return watch(loop, fd, udata, EPOLLIN);
+}
+
+int evloop_add_client(int loop, int fd, void *udata)
+{
+    return watch(loop, fd, udata, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+}
+
+void evloop_client(int loop, int fd, void *udata, int want_read,
+        int want_write)
+{
+    // Edge-triggered: we only hear about changes anyway.
+}
+
+int evloop_wait(int loop, void **udata, int max, int timeout_ms)
+{
+    struct epoll_event events[max];
+    int n = epoll_wait(loop, events, max, timeout_ms);
+
+    for(int i = 0; i < n; i++)
+        udata[i] = events[i].data.ptr;
+
+    return n;
+}
+
+#else
+
+int evloop_create(void)
+{
+    int kq = kqueue();
+    if(kq >= 0)
+        fcntl(kq, F_SETFD, 1); // close-on-exec
+    return kq;
+}
+
+int evloop_add(int loop, int fd, void *udata)
+{
+    struct kevent ev = {
+        .ident  = fd,
+        .filter = EVFILT_READ,
+        .flags  = EV_ADD,
+        .udata  = udata,
+    };
+
+    return kevent(loop, &ev, 1, NULL, 0, NULL);
+}
+
+int evloop_add_client(int loop, int fd, void *udata)
+{
+    return evloop_add(loop, fd, udata);
+}
+
+void evloop_client(int loop, int fd, void *udata, int want_read,
+        int want_write)
+{
+    struct kevent ev[2] = {
+        {
+            .ident  = fd,
+            .filter = EVFILT_READ,
+            .flags  = EV_ADD | (want_read ? EV_ENABLE : EV_DISABLE),
+            .udata  = udata,
+        },
+        {
+            .ident  = fd,
+            .filter = EVFILT_WRITE,
+            .flags  = EV_ADD | (want_write ? EV_ENABLE : EV_DISABLE),
+            .udata  = udata,
+        },
+    };
+
+    if(kevent(loop, ev, 2, NULL, 0, NULL) < 0)
+        perror("kevent (client)");
+}
+
+int evloop_wait(int loop, void **udata, int max, int timeout_ms)
+{
+    struct kevent events[max];
+    struct timespec ts = {
+        timeout_ms / 1000,
+        (timeout_ms % 1000) * 1000000L,
+    };
+
+    int n = kevent(loop, NULL, 0, events, max,
+            timeout_ms < 0 ? NULL : &ts);
+
+    for(int i = 0; i < n; i++)
+        udata[i] = events[i].udata;
+
+    return n;
+}
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+// The daemon's event loops, over kqueue (Darwin and the BSDs) or epoll
+// (Linux). A loop is a kqueue or epoll fd; every fd it watches has a udata
+// pointer, which is all that comes back when the fd has something for us.
+//
+// evloop_add() watches for input, level-triggered. Client connections use
+// evloop_add_client() instead, which also reports room for output, and is
+// edge-triggered where the backend allows it: the owner has to read until
+// EAGAIN (unless it stops with output pending, whose draining brings it
+// back) and write until EAGAIN. Where it's level-triggered (kqueue), the
+// owner uses evloop_client() to only ask for what it can act on.
+
+int evloop_create(void);
+int evloop_add(int loop, int fd, void *udata);
+int evloop_add_client(int loop, int fd, void *udata);
+void evloop_client(int loop, int fd, void *udata, int want_read,
+        int want_write);
+
+// Wait for up to max fds to have events and store their udatas (one fd may
+// show up twice). timeout_ms < 0 waits for good. Returns how many, or -1.
+int evloop_wait(int loop, void **udata, int max, int timeout_ms);
+
+#endif
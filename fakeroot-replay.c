@@ -0,0 +1,412 @@
+// Play a FAKEROOT_TRACE file (fakeroot --trace) back against the daemon
+// core from daemon.c, in-process, and say how it held up: throughput, and
+// latency percentiles for each kind of request next to what the traced
+// clients saw (theirs include the trip to the daemon and back). Each
+// thread in the trace keeps its requests in order, on one of the replay
+// threads; --original waits until each request's time comes round again.
+// Results also go to stdout as one JSON object per line, as bench-daemon
+// does.
+//
+//     fakeroot-replay [-t threads] [--original] trace
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "communicate.h"
+#include "daemon.h"
+#include "trace.h"
+
+static int nthreads = 4, original = 0;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// Requests are what went to the daemon in one go: a frame's worth of
+// entries, or a single one. A batch of one-way SETs and DELs was recorded
+// as one exchange, and is replayed as a frame for each run of the same
+// action, as it was sent.
+struct request {
+    uint64_t time;              // offset into the trace
+    uint32_t stream, n;
+    uint32_t traced_ns;
+    struct comm_pkt *ents;
+};
+
+// GET_OWNER, SET_OWNER and DEL_OWNER; SYNC and OPEN_RING mean nothing here.
+#define KINDS   3
+static const char *kind_names[KINDS] = { "get", "set", "del" };
+
+static int kind_of(int action)
+{
+    switch(action) {
+        case GET_OWNER: return 0;
+        case SET_OWNER: return 1;
+        case DEL_OWNER: return 2;
+        default:        return -1;
+    }
+}
+
+// One per thread in the trace.
+struct stream {
+    uint32_t pid, tid;
+};
+
+static struct stream *streams;
+static uint32_t nstreams, stream_cap;
+
+static struct request *requests;
+static size_t nrequests;
+
+static uint64_t calls, call_ns, call_ipc_ns, processes;
+
+// Latencies, per kind of request, in ns.
+struct samples {
+    uint64_t *ns;
+    size_t n, cap, entries;
+};
+
+static void add_sample(struct samples *s, uint64_t ns, size_t entries)
+{
+    if(s->n == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->ns = realloc(s->ns, s->cap * sizeof(*s->ns));
+        if(!s->ns)
+            fatal("realloc");
+    }
+    s->ns[s->n++] = ns;
+    s->entries += entries;
+}
+
+static struct samples traced[KINDS];
+
+// Streams are few enough (a build's threads) that a linear search from the
+// last one found does.
+static uint32_t find_stream(uint32_t pid, uint32_t tid)
+{
+    static uint32_t last;
+
+    if(last < nstreams && streams[last].pid == pid &&
+       streams[last].tid == tid)
+        return last;
+
+    for(uint32_t i = 0; i < nstreams; i++)
+        if(streams[i].pid == pid && streams[i].tid == tid)
+            return last = i;
+
+    if(nstreams == stream_cap) {
+        stream_cap = stream_cap ? stream_cap * 2 : 64;
+        streams = realloc(streams, stream_cap * sizeof(*streams));
+        if(!streams)
+            fatal("realloc");
+    }
+
+    streams[nstreams] = (struct stream) { pid, tid };
+    return last = nstreams++;
+}
+
+// Turn the records into requests. An exchange's entries were recorded
+// together, but another process's buffer can land in the middle of them,
+// so they're picked out by thread.
+static void load_trace(const struct trace_rec *recs, size_t nrecs)
+{
+    struct pending {
+        struct request *req;
+        uint32_t left;
+    } *pending = NULL;
+    uint32_t npending = 0;
+    uint64_t t0 = ~0ULL;
+
+    requests = calloc(nrecs, sizeof(*requests));
+    struct comm_pkt *ents = calloc(nrecs, sizeof(*ents));
+    if(!requests || !ents)
+        fatal("calloc");
+
+    for(size_t i = 0; i < nrecs; i++)
+        if(recs[i].time < t0)
+            t0 = recs[i].time;
+
+    for(size_t i = 0; i < nrecs; i++) {
+        const struct trace_rec *r = &recs[i];
+
+        switch(r->kind) {
+            case TRACE_START:
+                if(r->what != TRACE_VERSION) {
+                    fprintf(stderr, "fakeroot-replay: trace version %d, "
+                            "not %d\n", r->what, TRACE_VERSION);
+                    exit(1);
+                }
+                processes++;
+                continue;
+
+            case TRACE_CALL:
+                calls++;
+                call_ns += r->ns;
+                call_ipc_ns += r->call.ipc_ns;
+                continue;
+
+            case TRACE_PKT:
+                break;
+
+            default:
+                fprintf(stderr, "fakeroot-replay: bad record %zu\n", i);
+                exit(1);
+        }
+
+        uint32_t s = find_stream(r->pid, r->tid);
+        if(s == npending) {
+            pending = realloc(pending, ++npending * sizeof(*pending));
+            if(!pending)
+                fatal("realloc");
+            pending[s].left = 0;
+        }
+
+        struct pending *p = &pending[s];
+        if(r->count) {
+            p->req = &requests[nrequests++];
+            *p->req = (struct request) {
+                .time = r->time - t0,
+                .stream = s,
+                .traced_ns = r->ns,
+                .ents = ents,
+            };
+            p->left = r->count;
+        } else if(!p->left) {
+            continue;       // the start of it was cut off
+        }
+
+        *ents++ = (struct comm_pkt) {
+            .action = r->what,
+            .known = r->what == GET_OWNER ? 0 : r->known,
+            .dev = r->pkt.dev,
+            .ino = r->pkt.ino,
+            .uid = r->pkt.uid,
+            .gid = r->pkt.gid,
+            .mode = r->pkt.mode,
+            .rdev = r->pkt.rdev,
+        };
+        p->req->n++;
+        p->left--;
+    }
+
+    free(pending);
+
+    for(size_t i = 0; i < nrequests; i++) {
+        int k = kind_of(requests[i].ents[0].action);
+        if(k >= 0)
+            add_sample(&traced[k], requests[i].traced_ns, requests[i].n);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+struct replayer {
+    pthread_t thread;
+    int id;
+    uint64_t start;
+    struct samples replayed[KINDS];
+};
+
+static void replay_request(struct replayer *w, struct request *req)
+{
+    struct comm_pkt *ents = req->ents;
+    uint32_t n = req->n;
+
+    while(n) {
+        uint32_t run = 1;
+        while(run < n && run < MAX_FRAME_ENTS &&
+              ents[run].action == ents[0].action)
+            run++;
+
+        int k = kind_of(ents[0].action);
+        if(k >= 0) {
+            uint64_t t = now_ns();
+            process_many(ents[0].action, ents, run);
+            add_sample(&w->replayed[k], now_ns() - t, run);
+        }
+
+        ents += run;
+        n -= run;
+    }
+}
+
+static void *replay_thread(void *arg)
+{
+    struct replayer *w = arg;
+
+    for(size_t i = 0; i < nrequests; i++) {
+        struct request *req = &requests[i];
+        if(req->stream % nthreads != w->id)
+            continue;
+
+        if(original) {
+            uint64_t due = w->start + req->time, t = now_ns();
+            if(due > t) {
+                struct timespec ts = {
+                    (due - t) / 1000000000, (due - t) % 1000000000
+                };
+                while(nanosleep(&ts, &ts) < 0 && errno == EINTR) {}
+            }
+        }
+
+        replay_request(w, req);
+    }
+
+    return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t pct(const struct samples *s, int p)
+{
+    return s->n ? s->ns[(s->n - 1) * p / 100] : 0;
+}
+
+static void report(const char *name, struct samples *replayed,
+        struct samples *was, double elapsed)
+{
+    qsort(replayed->ns, replayed->n, sizeof(uint64_t), cmp_u64);
+    qsort(was->ns, was->n, sizeof(uint64_t), cmp_u64);
+
+    fprintf(stderr, "%-4s %9zu %10zu %10.0f  %7.1f %7.1f %7.1f %8.1f  "
+            "%7.1f %7.1f\n", name, replayed->n, replayed->entries,
+            replayed->entries / elapsed, pct(replayed, 50) / 1e3,
+            pct(replayed, 90) / 1e3, pct(replayed, 99) / 1e3,
+            pct(replayed, 100) / 1e3, pct(was, 50) / 1e3, pct(was, 99) / 1e3);
+
+    printf("{\"op\":\"%s\",\"frames\":%zu,\"entries\":%zu,"
+           "\"entries_per_sec\":%.0f,\"p50_ns\":%llu,\"p90_ns\":%llu,"
+           "\"p99_ns\":%llu,\"max_ns\":%llu,\"traced_p50_ns\":%llu,"
+           "\"traced_p99_ns\":%llu}\n", name, replayed->n, replayed->entries,
+           replayed->entries / elapsed,
+           (unsigned long long) pct(replayed, 50),
+           (unsigned long long) pct(replayed, 90),
+           (unsigned long long) pct(replayed, 99),
+           (unsigned long long) pct(replayed, 100),
+           (unsigned long long) pct(was, 50),
+           (unsigned long long) pct(was, 99));
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: fakeroot-replay [options] trace\n"
+            "\n"
+            "Options:\n"
+            "    -t,  --threads=[n]   Replay from n threads (default 4)\n"
+            "    -o,  --original      Keep to the trace's timing, rather\n"
+            "                         than going as fast as possible\n"
+           );
+    exit(1);
+}
+
+static struct option cmdLineOpts[] = {
+    { "help",       no_argument,        NULL,   'h' },
+    { "threads",    required_argument,  NULL,   't' },
+    { "original",   no_argument,        NULL,   'o' },
+    { NULL, 0, NULL, 0},
+};
+
+int main(int argc, char **argv)
+{
+    int ch;
+
+    while((ch = getopt_long(argc, argv, "ht:o", cmdLineOpts, NULL)) != -1) {
+        switch(ch) {
+            case 't': nthreads = atoi(optarg); break;
+            case 'o': original = 1; break;
+            default: usage();
+        }
+    }
+
+    if(optind != argc - 1 || nthreads < 1)
+        usage();
+
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat sbuf;
+    if(fd < 0 || fstat(fd, &sbuf) < 0)
+        fatal(argv[optind]);
+
+    size_t nrecs = sbuf.st_size / sizeof(struct trace_rec);
+    if(sbuf.st_size % sizeof(struct trace_rec) || !nrecs) {
+        fprintf(stderr, "%s: not a trace\n", argv[optind]);
+        return 1;
+    }
+
+    void *map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED)
+        fatal("mmap");
+    close(fd);
+
+    load_trace(map, nrecs);
+    munmap(map, sbuf.st_size);
+
+    uint64_t span = 0;
+    for(size_t i = 0; i < nrequests; i++)
+        if(requests[i].time > span)
+            span = requests[i].time;
+
+    fprintf(stderr, "trace: %llu processes, %u threads, %llu calls "
+            "(%.1f ms, %.1f ms of it in the daemon), %zu requests over "
+            "%.1f s\n", (unsigned long long) processes, nstreams,
+            (unsigned long long) calls, call_ns / 1e6, call_ipc_ns / 1e6,
+            nrequests, span / 1e9);
+
+    init_shards(0);
+
+    struct replayer *w = calloc(nthreads, sizeof(*w));
+    if(!w)
+        fatal("calloc");
+
+    uint64_t start = now_ns();
+    for(int i = 0; i < nthreads; i++) {
+        w[i].id = i;
+        w[i].start = start;
+        if(pthread_create(&w[i].thread, NULL, replay_thread, &w[i]) != 0)
+            fatal("pthread_create");
+    }
+    for(int i = 0; i < nthreads; i++)
+        pthread_join(w[i].thread, NULL);
+    double elapsed = (now_ns() - start) / 1e9;
+
+    fprintf(stderr, "replayed in %.3f s from %d thread%s%s\n\n", elapsed,
+            nthreads, nthreads == 1 ? "" : "s",
+            original ? ", at the original pace" : "");
+    fprintf(stderr, "%-4s %9s %10s %10s  %7s %7s %7s %8s  %7s %7s\n", "",
+            "frames", "entries", "per sec", "p50 us", "p90", "p99", "max",
+            "traced", "p99");
+
+    for(int k = 0; k < KINDS; k++) {
+        struct samples all = { 0 };
+        for(int i = 0; i < nthreads; i++) {
+            struct samples *s = &w[i].replayed[k];
+            for(size_t j = 0; j < s->n; j++)
+                add_sample(&all, s->ns[j], 0);
+            all.entries += s->entries;
+        }
+        if(all.n || traced[k].n)
+            report(kind_names[k], &all, &traced[k], elapsed);
+    }
+
+    return 0;
+}
@@ -4,148 +4,1183 @@
 #include <string.h>
 #include <getopt.h>
 
-#include <db.h>
-
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <sys/un.h>
-#include <sys/event.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
-#include "communicate.h"
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
 
-#define fatal(msg) do { perror(msg); exit(1); } while(0)
+#include "communicate.h"
+#include "daemon.h"
+#include "evloop.h"
+#include "ring.h"
 
 #define _STR(x) #x
 #define STR(x) _STR(x)
 
-DB *nodeData;
+static char shmname[32] = "";
+
+static volatile sig_atomic_t exit_flag = 0;
+static int stats = 0, daemon_mode = 0;
+static int backlog = SOMAXCONN;
+static char sockpath[256] = "";
+static const char *persistPath = NULL, *tracePath = NULL,
+                  *libPath = STR(LIBINSTALLPATH) "/" LIBFAKEROOT;
+
+// The environment that points a command at the daemon, besides where it
+// is; for --trace, a fresh trace file.
+static void client_environ(void)
+{
+    setenv(PRELOAD_VAR, libPath, 1);
+    if(stats)
+        setenv("FAKEROOT_STATS", "1", 1);
+
+    if(tracePath) {
+        int fd = open(tracePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0)
+            fatal(tracePath);
+        close(fd);
+        setenv("FAKEROOT_TRACE", tracePath, 1);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// --stats: what every process's STATS frame adds up to over the session.
+static struct comm_stat session_stats[STAT_CALLS];
+static int stats_reports = 0;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
 
-struct dbKey {
-    dev_t dev;
-    ino_t ino;
+static void record_stats(const struct comm_stat *stats, uint32_t n)
+{
+    pthread_mutex_lock(&stats_lock);
+
+    for(uint32_t i = 0; i < n; i++) {
+        if(stats[i].callno >= STAT_CALLS)
+            continue;
+
+        struct comm_stat *st = &session_stats[stats[i].callno];
+        st->count += stats[i].count;
+        st->real_ns += stats[i].real_ns;
+        st->ipc_ns += stats[i].ipc_ns;
+        for(int b = 0; b < STAT_BUCKETS; b++) {
+            st->real_hist[b] += stats[i].real_hist[b];
+            st->ipc_hist[b] += stats[i].ipc_hist[b];
+        }
+    }
+
+    stats_reports++;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+#define CALL(name)  [SYS_##name] = #name
+
+static const char *call_names[STAT_CALLS] = {
+    CALL(getuid), CALL(getgid), CALL(geteuid), CALL(getegid),
+    CALL(setuid), CALL(setgid), CALL(setreuid), CALL(setregid),
+    CALL(execve), CALL(fstat), CALL(fchown), CALL(fchmod), CALL(close),
+    // Newer Linux ports only have the *at() versions of these.
+#ifdef SYS_open
+    CALL(open), CALL(mkdir), CALL(symlink), CALL(stat), CALL(lstat),
+    CALL(chown), CALL(lchown), CALL(chmod), CALL(mknod), CALL(unlink),
+    CALL(rmdir), CALL(rename), CALL(dup2),
+#endif
+#ifdef __APPLE__
+    CALL(seteuid), CALL(setegid), CALL(issetugid), CALL(posix_spawn),
+    CALL(open_nocancel), CALL(close_nocancel),
+    CALL(stat64), CALL(fstat64), CALL(lstat64),
+#endif
+#ifdef __linux__
+    CALL(setresuid), CALL(setresgid), CALL(getresuid), CALL(getresgid),
+    CALL(openat), CALL(mkdirat), CALL(symlinkat), CALL(mknodat),
+    CALL(statx), CALL(fchownat), CALL(fchmodat), CALL(unlinkat),
+    CALL(renameat), CALL(dup3),
+#ifdef SYS_newfstatat
+    CALL(newfstatat),
+#else
+    CALL(fstatat64),
+#endif
+#ifdef SYS_renameat2
+    CALL(renameat2),
+#endif
+#endif
 };
 
-struct dbVal {
-    uid_t uid;
-    gid_t gid;
+// Upper bound of the bucket the pct'th percentile falls in.
+static const char *percentile(char *buf, size_t len, const uint64_t *hist,
+        uint64_t count, int pct)
+{
+    uint64_t want = (count * pct + 99) / 100, seen = 0;
+    int b = 0;
+
+    if(!count)
+        return "-";
+
+    while(b < STAT_BUCKETS - 1 && (seen += hist[b]) < want)
+        b++;
+
+    uint64_t ns = 1ULL << b;
+    if(ns < 1000)
+        snprintf(buf, len, "%lluns", (unsigned long long) ns);
+    else if(ns < 1000000)
+        snprintf(buf, len, "%lluus", (unsigned long long) ns / 1000);
+    else
+        snprintf(buf, len, "%llums", (unsigned long long) ns / 1000000);
+    return buf;
+}
+
+static int stat_cmp(const void *a, const void *b)
+{
+    const struct comm_stat *x = *(const struct comm_stat **) a,
+          *y = *(const struct comm_stat **) b;
+    uint64_t tx = x->real_ns + x->ipc_ns, ty = y->real_ns + y->ipc_ns;
+    return tx < ty ? 1 : tx > ty ? -1 : 0;
+}
+
+// Costliest calls first. Percentiles are "under", to the histogram's
+// power-of-two resolution; IPC ones only count calls that went to us.
+static void print_stats(FILE *fp)
+{
+    const struct comm_stat *order[STAT_CALLS];
+    int n = 0;
+
+    for(int c = 0; c < STAT_CALLS; c++) {
+        session_stats[c].callno = c;
+        if(session_stats[c].count)
+            order[n++] = &session_stats[c];
+    }
+
+    qsort(order, n, sizeof(order[0]), stat_cmp);
+
+    fprintf(fp, "fakeroot: calls from %d process%s\n", stats_reports,
+            stats_reports == 1 ? "" : "es");
+    fprintf(fp, "%-16s %10s %10s %10s %8s %8s %8s %8s\n", "call", "count",
+            "real ms", "ipc ms", "real p50", "p99", "ipc p50", "p99");
+
+    for(int i = 0; i < n; i++) {
+        const struct comm_stat *st = order[i];
+        char name[32], p[4][16];
+        uint64_t real[STAT_BUCKETS], ipc[STAT_BUCKETS], nipc = 0;
+
+        for(int b = 0; b < STAT_BUCKETS; b++) {
+            real[b] = st->real_hist[b];
+            ipc[b] = st->ipc_hist[b];
+            nipc += ipc[b];
+        }
+
+        if(call_names[st->callno])
+            snprintf(name, sizeof(name), "%s", call_names[st->callno]);
+        else
+            snprintf(name, sizeof(name), "syscall %u", st->callno);
+
+        fprintf(fp, "%-16s %10llu %10.1f %10.1f %8s %8s %8s %8s\n", name,
+                (unsigned long long) st->count,
+                st->real_ns / 1e6, st->ipc_ns / 1e6,
+                percentile(p[0], 16, real, st->count, 50),
+                percentile(p[1], 16, real, st->count, 99),
+                percentile(p[2], 16, ipc, nipc, 50),
+                percentile(p[3], 16, ipc, nipc, 99));
+    }
+}
+
+// Requests are parsed a frame at a time out of rbuf as they come in, and
+// replies the socket won't take right away wait in wbuf until the event loop
+// says there's room. A client that stops reading its replies gets no more
+// of its requests read once OUT_HIGH bytes of them are queued up.
+#define IN_CHUNK    65536
+#define OUT_HIGH    (1 << 20)
+
+struct client {
+    int fd, loop;
+    struct worker *worker;
+    struct client *prev, *next;     // on all_clients
+    char *rbuf, *wbuf;
+    size_t rlen, rcap, wlen, woff, wcap;
+    int eof, blocked;           // peer is done sending; output over OUT_HIGH
+    int writing, paused;        // asked for write events; not for reads
+    struct comm_ring *ring;
+    unsigned long ring_id;
+    pthread_t ring_thread;
+    uint32_t ns;                // from its HELLO
 };
 
-void process_pkt(struct comm_pkt *pkt)
+// Into the client's namespace and (done again) back out of it.
+static void ns_swap(const struct client *c, struct comm_pkt *ents, size_t n)
 {
-    struct dbKey key = {
-        .dev = pkt->dev,
-        .ino = pkt->ino,
-    };
+    if(c->ns)
+        for(size_t i = 0; i < n; i++)
+            ents[i].dev = NS_DEV(c->ns, ents[i].dev);
+}
+
+static int serve_ring_pkt(struct comm_pkt *pkt, void *arg)
+{
+    ns_swap(arg, pkt, 1);
+    process_pkt(pkt);
+    ns_swap(arg, pkt, 1);
+    return pkt->action != SET_OWNER && pkt->action != DEL_OWNER;
+}
 
-    DBT dkey = {
-        .data = &key,
-        .size = sizeof(key),
+static void *ring_thread(void *arg)
+{
+    struct client *c = arg;
+    ring_serve(c->ring, serve_ring_pkt, c);
+    return NULL;
+}
+
+static void ring_name(char *buf, size_t len, unsigned long id)
+{
+    snprintf(buf, len, "%s.r%lu", shmname, id);
+}
+
+static void close_ring(struct client *c)
+{
+    char name[64];
+
+    ring_close(c->ring);
+    pthread_join(c->ring_thread, NULL);
+    munmap(c->ring, sizeof(struct comm_ring));
+
+    // Normally the client already did this.
+    ring_name(name, sizeof(name), c->ring_id);
+    shm_unlink(name);
+
+    c->ring = NULL;
+}
+
+static void open_ring(struct client *c, struct comm_pkt *pkt)
+{
+    static unsigned long next_ring_id = 0;
+    char name[64];
+
+    pkt->known = 0;
+
+    if(!shmname[0])
+        return;
+
+    // A connection inherited across exec() asks again; the old image's
+    // mapping went away with it.
+    if(c->ring)
+        close_ring(c);
+
+    c->ring_id = __sync_fetch_and_add(&next_ring_id, 1);
+    ring_name(name, sizeof(name), c->ring_id);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(fd < 0) {
+        perror("shm_open (ring)");
+        return;
+    }
+
+    void *map = MAP_FAILED;
+    if(ftruncate(fd, sizeof(struct comm_ring)) == 0)
+        map = mmap(NULL, sizeof(struct comm_ring), PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(map == MAP_FAILED) {
+        perror("mmap (ring)");
+        shm_unlink(name);
+        return;
+    }
+
+    ring_init(map);
+    c->ring = map;
+
+    if(pthread_create(&c->ring_thread, NULL, ring_thread, c) != 0) {
+        perror("pthread_create (ring)");
+        munmap(map, sizeof(struct comm_ring));
+        shm_unlink(name);
+        c->ring = NULL;
+        return;
+    }
+
+    pkt->ino = c->ring_id;
+    pkt->known = 1;
+}
+
+static void close_client(struct client *c)
+{
+    if(c->ring)
+        close_ring(c);
+
+    close(c->fd);
+    free(c->rbuf);
+    free(c->wbuf);
+    free(c);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// Connections are spread over worker threads, each with its own event loop.
+// The main thread is worker 0 and also handles accept() and shutdown.
+
+// Actions are numbered from GET_OWNER up.
+#define NACTIONS    (STATS - GET_OWNER + 1)
+
+static const char *action_names[NACTIONS] = {
+    "GET_OWNER", "SET_OWNER", "OPEN_RING", "SYNC", "HELLO", "DEL_OWNER",
+    "STATS",
+};
+
+#define WAKE_BUCKETS    8       // 1, 2-3, 4-7, ... 128 and up events
+
+struct worker {
+    int loop;
+    pthread_t thread;
+
+    // For the control socket. Only the worker itself writes these.
+    uint64_t frames[NACTIONS], entries[NACTIONS];
+    uint64_t service_hist[STAT_BUCKETS];    // per frame, as in comm_stat
+    uint64_t wakeups, wake_hist[WAKE_BUCKETS];
+};
+
+static struct worker *workers;
+static int nworkers = 1;
+
+static int connections = 0;
+static int wakefd[2] = { -1, -1 };
+
+// Every connected client, so the control socket can see their queues.
+static struct client *all_clients;
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ns(void)
+{
+#ifdef __APPLE__
+    static mach_timebase_info_data_t tb;
+    if(!tb.denom)
+        mach_timebase_info(&tb);
+    return mach_absolute_time() * tb.numer / tb.denom;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static int log2_bucket(uint64_t n, int nbuckets)
+{
+    int b = n ? 64 - __builtin_clzll(n) : 0;
+    return b < nbuckets ? b : nbuckets - 1;
+}
+
+static void count_frame(struct worker *w, const struct comm_hdr *hdr,
+        uint64_t ns)
+{
+    unsigned a = hdr->action - GET_OWNER;
+
+    if(a < NACTIONS) {
+        w->frames[a]++;
+        w->entries[a] += hdr->count;
+    }
+    w->service_hist[log2_bucket(ns, STAT_BUCKETS)]++;
+}
+
+static void count_wakeup(struct worker *w, int nevent)
+{
+    if(nevent <= 0)
+        return;
+
+    w->wakeups++;
+    w->wake_hist[log2_bucket(nevent, WAKE_BUCKETS + 1) - 1]++;
+}
+
+static void add_client(struct client *c)
+{
+    pthread_mutex_lock(&clients_lock);
+    c->prev = NULL;
+    c->next = all_clients;
+    if(all_clients)
+        all_clients->prev = c;
+    all_clients = c;
+    pthread_mutex_unlock(&clients_lock);
+}
+
+static void drop_client(struct client *c)
+{
+    pthread_mutex_lock(&clients_lock);
+    if(c->prev)
+        c->prev->next = c->next;
+    else
+        all_clients = c->next;
+    if(c->next)
+        c->next->prev = c->prev;
+    pthread_mutex_unlock(&clients_lock);
+
+    close_client(c);
+
+    // The main thread decides when to exit; make sure it notices.
+    if(__sync_sub_and_fetch(&connections, 1) == 0)
+        write(wakefd[1], "", 1);
+}
+
+static int reserve(char **buf, size_t *cap, size_t need)
+{
+    if(need <= *cap)
+        return 0;
+
+    size_t ncap = *cap ? *cap : IN_CHUNK;
+    while(ncap < need)
+        ncap *= 2;
+
+    char *nbuf = realloc(*buf, ncap);
+    if(!nbuf)
+        return -1;
+
+    *buf = nbuf;
+    *cap = ncap;
+    return 0;
+}
+
+static int queue_reply(struct client *c, const struct comm_hdr *req,
+        uint64_t generation, const struct comm_pkt *ents, uint32_t n)
+{
+    struct comm_hdr hdr = {
+        .length     = FRAME_LENGTH(n),
+        .version    = PROTO_VERSION,
+        .action     = req->action,
+        .reqid      = req->reqid,
+        .count      = n,
+        .generation = generation,
     };
 
-    int result;
+    if(reserve(&c->wbuf, &c->wcap, c->wlen + hdr.length) < 0) {
+        perror("realloc");
+        return -1;
+    }
+
+    memcpy(c->wbuf + c->wlen, &hdr, sizeof(hdr));
+    memcpy(c->wbuf + c->wlen + sizeof(hdr), ents, n * sizeof(*ents));
+    c->wlen += hdr.length;
+    return 0;
+}
+
+static int process_frame(struct client *c, const struct comm_hdr *hdr,
+        struct comm_pkt *ents)
+{
+    uint64_t generation = 0;
+
+    switch(hdr->action) {
+        case HELLO:
+            if(hdr->count > 1)
+                return -1;
+            if(hdr->count)
+                c->ns = (uint32_t) ents[0].dev;
+            return queue_reply(c, hdr, 0, NULL, 0);
 
-    switch(pkt->action) {
         case GET_OWNER:
-        {
-            DBT dval;
-
-            result = nodeData->get(nodeData, &dkey, &dval, 0);
-            if(result == 0) {
-                struct dbVal *val = dval.data;
-
-                pkt->uid = val->uid;
-                pkt->gid = val->gid;
-                pkt->known = 1;
-            } else if(result == 1) {
-                pkt->known = 0;
-            } else {
-                perror("db->get");
-                pkt->known = 0;
-            }
+        case SET_OWNER:
+        case DEL_OWNER:
+            ns_swap(c, ents, hdr->count);
+            if(hdr->count)
+                generation = process_many(hdr->action, ents, hdr->count);
+            if(hdr->action != GET_OWNER)
+                return 0;
+            ns_swap(c, ents, hdr->count);
+            break;
+
+        case SYNC:
+            // Frames are handled in order, so everything this client sent
+            // before has been applied by now.
+            generation = shared->generation;
+            break;
+
+        case STATS:
+            record_stats((const struct comm_stat *) ents, hdr->count);
+            return 0;
+
+        case OPEN_RING:
+            if(hdr->count != 1)
+                return -1;
+            open_ring(c, &ents[0]);
+            break;
+
+        default:
+            fprintf(stderr, "Unknown action %x\n", (int) hdr->action);
+            return -1;
+    }
+
+    return queue_reply(c, hdr, generation, ents, hdr->count);
+}
+
+// Handle every complete frame in rbuf, unless too many replies are piling
+// up already.
+static int parse_frames(struct client *c)
+{
+    size_t off = 0;
+    int res = 0;
+
+    while(c->wlen - c->woff < OUT_HIGH &&
+          c->rlen - off >= sizeof(struct comm_hdr)) {
+        struct comm_hdr hdr;
+        memcpy(&hdr, c->rbuf + off, sizeof(hdr));
+
+        if(hdr.length < sizeof(hdr) ||
+           hdr.length > FRAME_LENGTH(MAX_FRAME_ENTS)) {
+            fprintf(stderr, "fakeroot: bad frame from client\n");
+            res = -1;
+            break;
         }
+
+        if(c->rlen - off < hdr.length)
             break;
 
-        case SET_OWNER:
-        {
-            DBT dval;
-
-            result = nodeData->get(nodeData, &dkey, &dval, 0);
-            if(result == 1) {
-                struct dbVal val = {
-                    .uid = pkt->uid,
-                    .gid = pkt->gid,
-                };
-                dval.data = &val;
-                dval.size = sizeof(val);
-                result = nodeData->put(nodeData, &dkey, &dval, 0);
-                if(result != 0) {
-                    perror("db->put");
-                    break;
-                }
-            } else {
-                struct dbVal *val = dval.data;
-                val->uid = pkt->uid;
-                val->gid = pkt->gid;
-            }
+        // length and version stay put in every version of the header. Tell
+        // a client we don't speak its version which one we do, and hang up.
+        if(hdr.version != PROTO_VERSION) {
+            hdr.action = HELLO;
+            res = queue_reply(c, &hdr, 0, NULL, 0);
+            c->eof = 1;
+            c->rlen = off = 0;
+            break;
         }
+
+        if(hdr.length != (hdr.action == STATS ? STATS_LENGTH(hdr.count) :
+                    FRAME_LENGTH(hdr.count))) {
+            fprintf(stderr, "fakeroot: bad frame from client\n");
+            res = -1;
             break;
+        }
 
-        default:
-            fprintf(stderr, "Unknown action %x\n", (int) pkt->action);
+        uint64_t start = now_ns();
+        res = process_frame(c, &hdr,
+                (struct comm_pkt *) (c->rbuf + off + sizeof(hdr)));
+        count_frame(c->worker, &hdr, now_ns() - start);
+        if(res < 0)
+            break;
+
+        off += hdr.length;
+    }
+
+    memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+    c->rlen -= off;
+    c->blocked = c->wlen - c->woff >= OUT_HIGH;
+    return res;
+}
+
+// Read and handle everything the socket has for us.
+static int service_input(struct client *c)
+{
+    // First whatever was held back for OUT_HIGH.
+    if(parse_frames(c) < 0)
+        return -1;
+
+    while(!c->eof && !c->blocked) {
+        if(reserve(&c->rbuf, &c->rcap, c->rlen + IN_CHUNK) < 0) {
+            perror("realloc");
+            return -1;
+        }
+
+        ssize_t n = recv(c->fd, c->rbuf + c->rlen, c->rcap - c->rlen, 0);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+
+        if(n == 0)
+            c->eof = 1;
+
+        c->rlen += n;
+        if(parse_frames(c) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+// Send as much queued output as the socket will take.
+static int flush_output(struct client *c)
+{
+    while(c->woff < c->wlen) {
+        ssize_t n = send(c->fd, c->wbuf + c->woff, c->wlen - c->woff, 0);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        c->woff += n;
+    }
+
+    if(c->woff == c->wlen) {
+        c->woff = c->wlen = 0;
+    } else if(c->woff > c->wcap / 2) {
+        memmove(c->wbuf, c->wbuf + c->woff, c->wlen - c->woff);
+        c->wlen -= c->woff;
+        c->woff = 0;
+    }
+
+    return 0;
+}
+
+// Returns -1 if the client is gone.
+static int handle_client(struct client *c)
+{
+    // Output that drains quickly enough lets in more of what was held
+    // back; with edge-triggered events nobody will tell us to go on.
+    do {
+        if(flush_output(c) < 0 || service_input(c) < 0 ||
+           flush_output(c) < 0 || (c->eof && c->wlen == 0)) {
+            drop_client(c);
+            return -1;
+        }
+    } while(c->blocked && c->wlen - c->woff < OUT_HIGH);
+
+    // Only wait for what we can act on: room for pending output, and
+    // more input if we're taking any.
+    int writing = c->wlen != 0, paused = c->eof || c->blocked;
+
+    if(writing != c->writing || paused != c->paused)
+        evloop_client(c->loop, c->fd, c, !paused, writing);
+
+    c->writing = writing;
+    c->paused = paused;
+    return 0;
+}
+
+// If an event drops its client, skip any others for the same client that
+// came back from the same wait.
+static void client_event(void **events, int i, int nevent)
+{
+    struct client *c = events[i];
+
+    if(c && handle_client(c) < 0) {
+        for(int j = i + 1; j < nevent; j++)
+            if(events[j] == c)
+                events[j] = NULL;
+    }
+}
+
+// Events are taken in batches that grow while waits keep filling them (a
+// parallel build starting up, say) and shrink back once things calm down.
+#define BATCH_MIN   16
+#define BATCH_MAX   1024
+
+static int wait_events(int loop, void **events, int *batch, int timeout_ms)
+{
+    int n = evloop_wait(loop, events, *batch, timeout_ms);
+
+    if(n == *batch && *batch < BATCH_MAX)
+        *batch *= 2;
+    else if(n >= 0 && n < *batch / 4 && *batch > BATCH_MIN)
+        *batch /= 2;
+
+    return n;
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    void *events[BATCH_MAX];
+    int batch = BATCH_MIN;
+
+    for(;;) {
+        int nevent = wait_events(w->loop, events, &batch, -1);
+        if(nevent < 0 && errno != EINTR)
+            fatal("evloop_wait (worker)");
+
+        count_wakeup(w, nevent);
+
+        for(int i = 0; i < nevent; i++)
+            client_event(events, i, nevent);
+    }
+
+    return NULL;
+}
+
+static void add_event(int loop, int fd, void *udata)
+{
+    if(evloop_add(loop, fd, udata) < 0)
+        fatal("evloop_add");
+}
+
+static void start_workers(int loop)
+{
+    workers = calloc(nworkers, sizeof(*workers));
+    if(!workers)
+        fatal("calloc");
+
+    workers[0].loop = loop;
+
+    for(int i = 1; i < nworkers; i++) {
+        workers[i].loop = evloop_create();
+        if(workers[i].loop < 0)
+            fatal("evloop_create");
+
+        if(pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]))
+            fatal("pthread_create (worker)");
+    }
+}
+
+static int lsock = -1;
+
+// Take every connection that's waiting, not just one per wakeup: a
+// parallel build can start hundreds of processes at once.
+static void accept_clients(void)
+{
+    static int next_worker = 0;
+
+    for(;;) {
+        int csock = accept(lsock, NULL, NULL);
+        if(csock < 0) {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
+        }
+
+        struct client *c = calloc(1, sizeof(*c));
+        if(!c)
+            fatal("calloc");
+        fcntl(csock, F_SETFL, O_NONBLOCK);
+        fcntl(csock, F_SETFD, 1); // close-on-exec
+
+        __sync_add_and_fetch(&connections, 1);
+
+        struct worker *w = &workers[next_worker++ % nworkers];
+        c->fd = csock;
+        c->loop = w->loop;
+        c->worker = w;
+        add_client(c);
+
+        if(evloop_add_client(w->loop, csock, c) < 0)
+            fatal("evloop_add_client");
     }
 }
 
 //////////////////////////////////////////////////////////////////////////////
 
+// The control socket, /tmp/fakeroot.<pid>.ctl: connect to it, send a
+// command line, and the answer comes back before it hangs up. "query" is
+// a report on how the daemon is doing (fakeroot --query); "checkpoint"
+// saves the --persist file (fakeroot --checkpoint). Nothing here is locked
+// against the threads doing the counting, so numbers can be a little
+// stale.
+
+static char ctlpath[256] = "";
+static int ctlsock = -1;
+static uint64_t start_time;
+
+static struct {
+    uint64_t time, gets, sets, dels, entries[NACTIONS];
+} last_query;
+
+static double rate(uint64_t now, uint64_t then, uint64_t ns)
+{
+    return ns ? (now - then) * 1e9 / ns : 0;
+}
+
+static double mb(uint64_t bytes)
+{
+    return bytes / (1024.0 * 1024.0);
+}
+
+static void write_report(FILE *fp)
+{
+    struct store_stats st;
+    struct worker sum;
+    uint64_t now = now_ns(), elapsed = now - last_query.time;
+    uint64_t qin = 0, qout = 0, bufs = 0, ring_depth = 0, frames = 0;
+    int nclients = 0, nrings = 0, nblocked = 0;
+
+    get_store_stats(&st);
+
+    memset(&sum, 0, sizeof(sum));
+    for(int i = 0; i < nworkers; i++) {
+        const struct worker *w = &workers[i];
+
+        for(int a = 0; a < NACTIONS; a++) {
+            sum.frames[a] += w->frames[a];
+            sum.entries[a] += w->entries[a];
+            frames += w->frames[a];
+        }
+        for(int b = 0; b < STAT_BUCKETS; b++)
+            sum.service_hist[b] += w->service_hist[b];
+        for(int b = 0; b < WAKE_BUCKETS; b++)
+            sum.wake_hist[b] += w->wake_hist[b];
+        sum.wakeups += w->wakeups;
+    }
+
+    pthread_mutex_lock(&clients_lock);
+    for(struct client *c = all_clients; c; c = c->next) {
+        nclients++;
+        qin += c->rlen;
+        qout += c->wlen - c->woff;
+        bufs += c->rcap + c->wcap;
+        nblocked += c->blocked;
+        if(c->ring) {
+            nrings++;
+            ring_depth += c->ring->sq.tail - c->ring->sq.head;
+        }
+    }
+    pthread_mutex_unlock(&clients_lock);
+
+    fprintf(fp, "fakeroot daemon %d, up %.1fs, %d thread%s\n", getpid(),
+            (now - start_time) / 1e9, nworkers, nworkers == 1 ? "" : "s");
+    fprintf(fp, "connections   %d (%d with a ring)\n", nclients, nrings);
+    fprintf(fp, "queued        %llu bytes in, %llu out, %d client%s "
+            "blocked, %llu on rings\n", (unsigned long long) qin,
+            (unsigned long long) qout, nblocked, nblocked == 1 ? "" : "s",
+            (unsigned long long) ring_depth);
+    fprintf(fp, "table         %llu entries, %.1f MB\n",
+            (unsigned long long) st.entries, mb(st.bytes));
+    fprintf(fp, "snapshot      %llu entries, %.1f MB mapped\n",
+            (unsigned long long) st.snap_entries, mb(st.snap_bytes));
+    const struct owner_policy *policy = &shared->policy;
+    fprintf(fp, "policy        ");
+    if(policy->flags & POLICY_DEFAULT)
+        fprintf(fp, "uid %u's files are %u:%u, ", policy->session_uid,
+                policy->default_uid, policy->default_gid);
+    fprintf(fp, "%u device rule%s\n", policy->ndevices,
+            policy->ndevices == 1 ? "" : "s");
+
+    // A key's bits are all set by chance with about fill^k odds.
+    double fill = st.filter_bits / (FILTER_LINES * 512.0), falsepos = 1;
+    for(int k = 0; k < FILTER_HASHES; k++)
+        falsepos *= fill;
+    fprintf(fp, "filter        %.2f%% of bits set, ~%.2g%% false "
+            "positives, %llu rebuild%s\n", fill * 100, falsepos * 100,
+            (unsigned long long) st.filter_rebuilds,
+            st.filter_rebuilds == 1 ? "" : "s");
+    fprintf(fp, "buffers       %.1f MB\n", mb(bufs));
+
+    // Rates are since the last query (or since startup).
+    fprintf(fp, "\n%-13s %12s %10s\n", "store", "entries", "per sec");
+    fprintf(fp, "%-13s %12llu %10.0f  %.1f%% known\n", "lookups",
+            (unsigned long long) st.gets,
+            rate(st.gets, last_query.gets, elapsed),
+            st.gets ? st.hits * 100.0 / st.gets : 0);
+    fprintf(fp, "%-13s %12llu %10.0f\n", "sets",
+            (unsigned long long) st.sets,
+            rate(st.sets, last_query.sets, elapsed));
+    fprintf(fp, "%-13s %12llu %10.0f\n", "deletes",
+            (unsigned long long) st.dels,
+            rate(st.dels, last_query.dels, elapsed));
+
+    fprintf(fp, "\n%-13s %12s %12s %10s\n", "socket frames", "frames",
+            "entries", "per sec");
+    for(int a = 0; a < NACTIONS; a++) {
+        fprintf(fp, "%-13s %12llu %12llu %10.0f\n", action_names[a],
+                (unsigned long long) sum.frames[a],
+                (unsigned long long) sum.entries[a],
+                rate(sum.entries[a], last_query.entries[a], elapsed));
+    }
+
+    char p[4][16];
+    fprintf(fp, "\nservice time  p50 %s, p90 %s, p99 %s per frame\n",
+            percentile(p[0], 16, sum.service_hist, frames, 50),
+            percentile(p[1], 16, sum.service_hist, frames, 90),
+            percentile(p[2], 16, sum.service_hist, frames, 99));
+
+    fprintf(fp, "wakeups       %llu; events each:",
+            (unsigned long long) sum.wakeups);
+    static const char *wake_labels[WAKE_BUCKETS] = {
+        "1", "2-3", "4-7", "8-15", "16-31", "32-63", "64-127", "128+",
+    };
+    for(int b = 0; b < WAKE_BUCKETS; b++)
+        fprintf(fp, " %s %.0f%%", wake_labels[b], sum.wakeups ?
+                sum.wake_hist[b] * 100.0 / sum.wakeups : 0);
+    fprintf(fp, "\n");
+
+    last_query.time = now;
+    last_query.gets = st.gets;
+    last_query.sets = st.sets;
+    last_query.dels = st.dels;
+    memcpy(last_query.entries, sum.entries, sizeof(sum.entries));
+}
+
+// Saving can take a while, and the main thread has clients of its own.
+static void *checkpoint_thread(void *arg)
+{
+    int fd = (intptr_t) arg;
+
+    if(persist_checkpoint() == 0)
+        dprintf(fd, "checkpointed %s\n", persistPath);
+    else if(!persistPath)
+        dprintf(fd, "fakeroot: no --persist file to checkpoint\n");
+    else
+        dprintf(fd, "fakeroot: couldn't checkpoint %s\n", persistPath);
+
+    close(fd);
+    return NULL;
+}
+
+static void serve_query(void)
+{
+    int fd = accept(ctlsock, NULL, NULL);
+    if(fd < 0) {
+        perror("accept (control)");
+        return;
+    }
+
+    // Don't let someone who won't talk or read hold up the main thread.
+    struct timeval tv = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    char cmd[32];
+    ssize_t n = recv(fd, cmd, sizeof(cmd) - 1, 0);
+    cmd[n > 0 ? n : 0] = 0;
+    cmd[strcspn(cmd, "\n")] = 0;
+
+    if(strcmp(cmd, "checkpoint") == 0) {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, checkpoint_thread,
+                    (void *) (intptr_t) fd) != 0) {
+            perror("pthread_create (checkpoint)");
+            close(fd);
+        } else {
+            pthread_detach(thread);
+        }
+        return;
+    }
+
+    FILE *fp = fdopen(fd, "w");
+    if(!fp) {
+        close(fd);
+        return;
+    }
+
+    write_report(fp);
+    fclose(fp);
+}
+
+static void unix_addr(struct sockaddr_un *uaddr, const char *path)
+{
+    memset(uaddr, 0, sizeof(*uaddr));
+    strncpy(uaddr->sun_path, path, sizeof(uaddr->sun_path) - 1);
+    uaddr->sun_family = PF_LOCAL;
+#ifndef __linux__
+    uaddr->sun_len = SUN_LEN(uaddr);
+#endif
+}
+
+static int connect_path(const char *path)
+{
+    int sock = socket(PF_LOCAL, SOCK_STREAM, PF_UNSPEC);
+    if(sock < 0)
+        return -1;
+
+    struct sockaddr_un uaddr;
+    unix_addr(&uaddr, path);
+
+    if(connect(sock, (struct sockaddr *) &uaddr, sizeof(uaddr)) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+// A session is a daemon's pid, or its socket (as in $FAKEROOT_SOCKET).
+// Find the one of its sockets with the given suffix; anything else is
+// taken to be that socket already.
+static void session_path(char *buf, size_t len, const char *session,
+        const char *suffix)
+{
+    size_t n = strlen(session);
+
+    if(n && strspn(session, "0123456789") == n)
+        snprintf(buf, len, "/tmp/fakeroot.%s%s", session, suffix);
+    else if(n > 5 && strcmp(session + n - 5, ".sock") == 0)
+        snprintf(buf, len, "%.*s%s", (int) n - 5, session, suffix);
+    else
+        snprintf(buf, len, "%s", session);
+}
+
+// Send cmd to the session's control socket and print the answer. Answers
+// that start "fakeroot:" are errors.
+static int control(const char *session, const char *cmd)
+{
+    char path[256], buf[4096];
+    ssize_t n;
+    int failed = -1;
+
+    session_path(path, sizeof(path), session, ".ctl");
+
+    int sock = connect_path(path);
+    if(sock < 0) {
+        perror(path);
+        return 1;
+    }
+
+    dprintf(sock, "%s\n", cmd);
+    shutdown(sock, SHUT_WR);
+
+    while((n = read(sock, buf, sizeof(buf))) > 0) {
+        if(failed < 0)
+            failed = n >= 9 && memcmp(buf, "fakeroot:", 9) == 0;
+        fwrite(buf, 1, n, failed ? stderr : stdout);
+    }
+
+    close(sock);
+    return n < 0 || failed;
+}
+
+// Run cmd as part of a session that's already going: no daemon of our own,
+// just the environment that points the preloaded library at theirs.
+static void attach(const char *session, uint32_t ns, char **argv)
+{
+    char path[256], abspath[PATH_MAX], shm[32];
+    int pid = 0;
+
+    session_path(path, sizeof(path), session, ".sock");
+
+    // Everything we start needs to find it, wherever they chdir() to.
+    const char *sock_path = path;
+    if(path[0] != '/' && realpath(path, abspath))
+        sock_path = abspath;
+
+    // Better to find out now than from every process we start.
+    int sock = connect_path(sock_path);
+    if(sock < 0)
+        fatal(sock_path);
+    close(sock);
+
+    setenv("FAKEROOT_SOCKET", sock_path, 1);
+    client_environ();
+
+    // The shared page is named for the daemon's pid, as the socket is.
+    const char *base = strrchr(sock_path, '/');
+    sscanf(base ? base + 1 : sock_path, "fakeroot.%d.", &pid);
+    snprintf(shm, sizeof(shm), "/fakeroot.%d", pid);
+
+    int fd = pid ? shm_open(shm, O_RDONLY, 0) : -1;
+    if(fd >= 0) {
+        setenv("FAKEROOT_SHM", shm, 1);
+        close(fd);
+    }
+
+    if(ns) {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%u", (unsigned) ns);
+        setenv("FAKEROOT_NS", buf, 1);
+    }
+
+    execvp(argv[0], argv);
+    fatal("exec");
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
 static struct option cmdLineOpts[] = {
     { "help",       no_argument,        NULL,   'h' },
     { "version",    no_argument,        NULL,   'v' },
     { "libpath",    required_argument,  NULL,   'l' },
     { "persist",    required_argument,  NULL,   'p' },
+    { "threads",    required_argument,  NULL,   't' },
+    { "stats",      no_argument,        NULL,   's' },
+    { "query",      required_argument,  NULL,   'q' },
+    { "backlog",    required_argument,  NULL,   'b' },
+    { "owner",      required_argument,  NULL,   'o' },
+    { "device-owner", required_argument, NULL,  'O' },
+    { "daemon",     no_argument,        NULL,   'd' },
+    { "attach",     required_argument,  NULL,   'a' },
+    { "namespace",  required_argument,  NULL,   'n' },
+    { "checkpoint", required_argument,  NULL,   'c' },
+    { "trace",      required_argument,  NULL,   'T' },
     { NULL, 0, NULL, 0},
 };
 
-static int exit_flag = 0;
-static int lsock = -1;
-static char sockpath[256] = "";
-static const char *persistPath = NULL,
-                  *libPath = STR(LIBINSTALLPATH) "/libfakeroot.dylib";
-
 void cleanup(void)
 {
     if(sockpath[0] && unlink(sockpath) < 0)
         perror("unlink");
 
-    if(nodeData) {
-        nodeData->close(nodeData);
-    }
+    if(ctlpath[0])
+        unlink(ctlpath);
+
+    if(shmname[0])
+        shm_unlink(shmname);
+
+    if(stats)
+        print_stats(stderr);
+
+    if(persistPath)
+        persist_close(persistPath);
 }
 
 void sigint(int sig)
 {
     exit_flag = 1;
+
+    // It may not be the main thread the signal interrupts.
+    if(wakefd[1] >= 0)
+        write(wakefd[1], "", 1);
 }
 
 static void usage(void)
 {
     fprintf(stderr,
             "Usage: fakeroot [options] cmd [args...]\n"
+            "       fakeroot [options] --daemon\n"
+            "       fakeroot --attach=[session] [--namespace=n] cmd "
+            "[args...]\n"
             "\n"
             "Options:\n"
             "    -h,  --help            Print this message\n"
             "    -v,  --version         Version information\n"
-            "    -l,  --libpath=[path]  Use alternate libfakeroot.dylib\n"
+            "    -l,  --libpath=[path]  Use alternate " LIBFAKEROOT "\n"
             "    -p,  --persist=[path]  Save/load ownership to file\n"
+            "    -t,  --threads=[n]     Serve clients from n threads\n"
+            "    -s,  --stats           Print where hooked calls spent time\n"
+            "    -q,  --query=[session] Report on a running daemon (its pid\n"
+            "                           or $FAKEROOT_SOCKET)\n"
+            "    -b,  --backlog=[n]     Let n connections wait to be accepted\n"
+            "    -o,  --owner=[uid:gid] Show files really owned by you (so\n"
+            "                           new ones too) as owned by uid:gid\n"
+            "    -O,  --device-owner=[path:uid:gid]\n"
+            "                           Show files on path's filesystem as\n"
+            "                           owned by uid:gid, unless chowned\n"
+            "    -d,  --daemon          Serve sessions that --attach until\n"
+            "                           SIGTERM; prints the session's socket\n"
+            "    -a,  --attach=[session] Run cmd under a --daemon's session\n"
+            "    -n,  --namespace=[n]   With --attach, keep to namespace n's\n"
+            "                           records (0, the default, is shared)\n"
+            "    -c,  --checkpoint=[session]\n"
+            "                           Save a running daemon's --persist file\n"
+            "    -T,  --trace=[path]    Record cmd's calls and requests for\n"
+            "                           fakeroot-replay\n"
            );
     exit(1);
 }
 
+// Processes we start may chdir() before they use it.
+static const char *absolute(const char *path)
+{
+    char cwd[PATH_MAX], buf[PATH_MAX * 2];
+
+    if(path[0] == '/')
+        return path;
+
+    if(!getcwd(cwd, sizeof(cwd)))
+        fatal("getcwd");
+    snprintf(buf, sizeof(buf), "%s/%s", cwd, path);
+    return strdup(buf);
+}
+
 int main(int argc, char **argv, char **envp)
 {
     int ch;
+    const char *attach_to = NULL;
+    uint32_t ns = 0;
 
     int had_posixly_correct = 0;
     if(getenv("POSIXLY_CORRECT")) {
@@ -154,7 +1189,9 @@ int main(int argc, char **argv, char **envp)
         putenv("POSIXLY_CORRECT=1");
     }
 
-    while((ch = getopt_long(argc, argv, "hvl:p:", cmdLineOpts, NULL)) != -1) {
+    while((ch = getopt_long(argc, argv, "hvl:p:t:sq:b:o:O:da:n:c:T:",
+                    cmdLineOpts,
+                    NULL)) != -1) {
         switch(ch) {
             case 'h':
                 usage();
@@ -167,21 +1204,93 @@ int main(int argc, char **argv, char **envp)
                 break;
 
             case 'l':
-                if(optarg[0] == '/') {
-                    libPath = optarg;
-                } else {
-                    char buf[PATH_MAX];
-                    getcwd(buf, sizeof(buf));
-                    strlcat(buf, "/", sizeof(buf));
-                    strlcat(buf, optarg, sizeof(buf));
-                    libPath = strdup(buf);
-                }
+                libPath = absolute(optarg);
+                break;
+
+            case 'T':
+                tracePath = absolute(optarg);
                 break;
 
             case 'p':
                 persistPath = optarg;
                 break;
 
+            case 't':
+                nworkers = atoi(optarg);
+                if(nworkers < 1)
+                    usage();
+                break;
+
+            case 's':
+                stats = 1;
+                break;
+
+            case 'q':
+                exit(control(optarg, "query"));
+
+            case 'c':
+                exit(control(optarg, "checkpoint"));
+
+            case 'd':
+                daemon_mode = 1;
+                break;
+
+            case 'a':
+                attach_to = optarg;
+                break;
+
+            case 'n':
+            {
+                unsigned long n;
+                char end;
+                if(sscanf(optarg, "%lu%c", &n, &end) != 1 || n > UINT32_MAX)
+                    usage();
+                ns = n;
+            }
+                break;
+
+            case 'b':
+                backlog = atoi(optarg);
+                if(backlog < 1)
+                    usage();
+                break;
+
+            case 'o':
+            {
+                unsigned uid, gid;
+                char end;
+                if(sscanf(optarg, "%u:%u%c", &uid, &gid, &end) != 2)
+                    usage();
+                policy_set_default(uid, gid);
+            }
+                break;
+
+            case 'O':
+            {
+                // The path may have colons of its own.
+                char *owner = NULL, *group = strrchr(optarg, ':');
+                unsigned uid, gid;
+                struct stat sbuf;
+
+                if(group) {
+                    *group = 0;
+                    owner = strrchr(optarg, ':');
+                    *group = ':';
+                }
+                if(!owner || owner == optarg ||
+                   sscanf(owner + 1, "%u:%u", &uid, &gid) != 2)
+                    usage();
+
+                *owner = 0;
+                if(stat(optarg, &sbuf) < 0)
+                    fatal(optarg);
+                if(policy_add_device(sbuf.st_dev, uid, gid) < 0) {
+                    fprintf(stderr, "fakeroot: too many --device-owner\n");
+                    exit(1);
+                }
+            }
+                break;
+
             default:
                 usage();
         }
@@ -193,22 +1302,81 @@ int main(int argc, char **argv, char **envp)
     argc -= optind;
     argv += optind;
     
-    if(argc < 1)
+    if(daemon_mode ? argc > 0 || attach_to : argc < 1)
         usage();
 
+    if(attach_to)
+        attach(attach_to, ns, argv);
+
+    // The parent waits until we're listening before it says where, so
+    // whoever started us can go straight on to --attach.
+    int ready[2] = { -1, -1 };
+    if(daemon_mode) {
+        if(pipe(ready) < 0)
+            fatal("pipe");
+
+        pid_t pid = fork();
+        if(pid < 0)
+            fatal("fork");
+
+        if(pid > 0) {
+            char buf[300];
+            ssize_t n;
+
+            close(ready[1]);
+            n = read(ready[0], buf, sizeof(buf));
+            if(n <= 0)
+                exit(1);
+            fwrite(buf, 1, n, stdout);
+            exit(0);
+        }
+
+        close(ready[0]);
+        setsid();
+    }
+
     lsock = socket(PF_LOCAL, SOCK_STREAM, PF_UNSPEC);
     if(lsock < 0)
         fatal("socket");
 
-    nodeData = dbopen(persistPath, O_RDWR | O_CREAT, 0666, DB_HASH, NULL);
+    if(persistPath)
+        persist_open(persistPath);
+    else
+        init_shards(0);
 
     snprintf(sockpath, sizeof(sockpath), "/tmp/fakeroot.%d.sock", getpid());
 
+    // Publish the shared page. Clients can live without it (they just
+    // won't cache), so failure here isn't fatal.
+    {
+        snprintf(shmname, sizeof(shmname), "/fakeroot.%d", getpid());
+        int fd = shm_open(shmname, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if(fd < 0) {
+            perror("shm_open");
+            shmname[0] = 0;
+        } else {
+            void *page = MAP_FAILED;
+            if(ftruncate(fd, sizeof(*shared)) == 0)
+                page = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0);
+            close(fd);
+
+            if(page == MAP_FAILED) {
+                perror("mmap");
+                shm_unlink(shmname);
+                shmname[0] = 0;
+            } else {
+                shared = page;
+                shared->magic = SHARED_MAGIC;
+                publish_policy();
+                rebuild_filter();
+            }
+        }
+    }
+
     {
         struct sockaddr_un uaddr;
-        strncpy(uaddr.sun_path, sockpath, sizeof(uaddr.sun_path));
-        uaddr.sun_family = PF_LOCAL;
-        uaddr.sun_len = SUN_LEN(&uaddr);
+        unix_addr(&uaddr, sockpath);
 
         if(bind(lsock, (struct sockaddr *) &uaddr, sizeof(uaddr)) < 0)
             fatal("bind");
@@ -216,29 +1384,72 @@ int main(int argc, char **argv, char **envp)
 
     atexit(cleanup);
 
-    if(listen(lsock, 4) < 0)
+    // Non-blocking, so accept_clients() can take them until there are
+    // no more.
+    fcntl(lsock, F_SETFL, O_NONBLOCK);
+    fcntl(lsock, F_SETFD, 1); // close-on-exec
+
+    if(listen(lsock, backlog) < 0)
         fatal("listen");
 
-    int kq = kqueue();
-    if(kq < 0)
-        fatal("kqueue");
+    start_time = last_query.time = now_ns();
 
+    // The control socket is only for watching us, so we can do without.
+    snprintf(ctlpath, sizeof(ctlpath), "/tmp/fakeroot.%d.ctl", getpid());
     {
-        struct kevent ev = {
-            .ident  = lsock,
-            .filter = EVFILT_READ,
-            .flags  = EV_ADD,
-        };
-            
-        if(kevent(kq, &ev, 1, NULL, 0, NULL) < 0)
-            fatal("kevent (add lsock)");
+        struct sockaddr_un uaddr;
+        unix_addr(&uaddr, ctlpath);
+
+        ctlsock = socket(PF_LOCAL, SOCK_STREAM, PF_UNSPEC);
+        if(ctlsock < 0 ||
+           bind(ctlsock, (struct sockaddr *) &uaddr, sizeof(uaddr)) < 0 ||
+           listen(ctlsock, 4) < 0) {
+            perror(ctlpath);
+            if(ctlsock >= 0)
+                close(ctlsock);
+            ctlsock = -1;
+        } else {
+            fcntl(ctlsock, F_SETFD, 1); // close-on-exec
+        }
     }
 
+    int loop = evloop_create();
+    if(loop < 0)
+        fatal("evloop_create");
+
+    if(pipe(wakefd) < 0)
+        fatal("pipe");
+    fcntl(wakefd[0], F_SETFD, 1); // close-on-exec
+    fcntl(wakefd[1], F_SETFD, 1);
+
+    // Our own fds are told apart from clients by their udata.
+    add_event(loop, lsock, &lsock);
+    add_event(loop, wakefd[0], wakefd);
+    if(ctlsock >= 0)
+        add_event(loop, ctlsock, &ctlsock);
+
+    start_workers(loop);
+
     signal(SIGINT, sigint);
 
-    if(fork() == 0) {
+    if(daemon_mode) {
+        signal(SIGTERM, sigint);
+        signal(SIGHUP, SIG_IGN);
+
+        dprintf(ready[1], "%s\n", sockpath);
+        close(ready[1]);
+
+        int null = open("/dev/null", O_RDWR);
+        if(null >= 0) {
+            dup2(null, 0);
+            dup2(null, 1);
+            close(null);
+        }
+    } else if(fork() == 0) {
         setenv("FAKEROOT_SOCKET", sockpath, 1);
-        setenv("DYLD_INSERT_LIBRARIES", libPath, 1);
+        if(shmname[0])
+            setenv("FAKEROOT_SHM", shmname, 1);
+        client_environ();
 
         execvp(argv[0], argv);
 
@@ -248,61 +1459,41 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
 
-    int connections = 0;
+    // A client may hang up before we get around to answering it; that's
+    // a send() error, not a reason to die. (Not for the child, though.)
+    signal(SIGPIPE, SIG_IGN);
+
+    void *events[BATCH_MAX];
+    int batch = BATCH_MIN, migrating = 0;
 
     while(!exit_flag) {
-        struct kevent events[16];
-        int nevent = kevent(kq, NULL, 0, events, 16, NULL);
+        // While the table is being resized, don't sleep; use the idle time
+        // to move buckets over instead.
+        int nevent = wait_events(loop, events, &batch,
+                migrating && connections ? 0 : -1);
         if(nevent < 0 && errno != EINTR)
-            fatal("kevent (waiting)");
-
-        for(int i = 0; i < nevent; i++) {
-            if(events[i].filter != EVFILT_READ)
-                continue; // wtf?
-
-            if(events[i].ident == lsock) {
-                int csock = accept(lsock, NULL, NULL);
-                if(csock < 0) {
-                    perror("accept");
-                    continue;
-                }
-
-                struct kevent ev = {
-                    .ident  = csock,
-                    .filter = EVFILT_READ,
-                    .flags  = EV_ADD,
-                };
+            fatal("evloop_wait (waiting)");
 
-                if(kevent(kq, &ev, 1, NULL, 0, NULL) < 0)
-                    fatal("kevent (add csock)");
+        count_wakeup(&workers[0], nevent);
 
-                connections++;
+        for(int i = 0; i < nevent; i++) {
+            if(events[i] == &lsock) {
+                accept_clients();
+            } else if(events[i] == &ctlsock) {
+                serve_query();
+            } else if(events[i] == wakefd) {
+                char buf[16];
+                read(wakefd[0], buf, sizeof(buf));
             } else {
                 // must be a connected sock!
-                if(events[i].flags & EV_EOF) { // socket closed!
-                    close(events[i].ident);
-                    connections--;
-                    continue;
-                }
-
-                struct comm_pkt pkt;
-
-                if(recv(events[i].ident, &pkt, sizeof(pkt), 0) != sizeof(pkt)) {
-                    close(events[i].ident);
-                    connections--;
-                    continue;
-                }
-
-                process_pkt(&pkt);
-
-                if(send(events[i].ident, &pkt, sizeof(pkt), 0) != sizeof(pkt)) {
-                    close(events[i].ident);
-                    connections--;
-                }
+                client_event(events, i, nevent);
             }
         }
 
-        if(connections == 0)
+        migrating = migrate_shards();
+        refresh_filter();
+
+        if(connections == 0 && !daemon_mode)
             break;
     }
 
@@ -0,0 +1,507 @@
+#include "hooks.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+int hooks_ready;
+int fake_uid = 0, fake_gid = 0, fake_euid = 0, fake_egid = 0;
+
+static const char *insert_environ[INSERT_MAX];
+
+static const char *strip_environ[] = {
+    PRELOAD_VAR,
+    "FAKEROOT_SOCKET",
+    "FAKEROOT_STATE",
+    "FAKEROOT_SHM",
+    "FAKEROOT_FD",
+    "FAKEROOT_STATS",
+    "FAKEROOT_NS",
+    "FAKEROOT_TRACE",
+    NULL
+};
+
+static size_t strip_len[sizeof(strip_environ) / sizeof(strip_environ[0])];
+static int ninsert;
+
+static char env_preload_string[512], env_sock_string[512], env_shm_string[64];
+static char env_ns_string[32], env_trace_string[512];
+
+static void flush_at_exit(void)
+{
+    flush_owners();
+    trace_flush();
+}
+
+static void print_cache_stats(void)
+{
+    unsigned long hits, misses, skipped;
+    get_cache_stats(&hits, &misses, &skipped);
+    fprintf(stderr, "fakeroot[%d]: owner cache: %lu hits, %lu misses, "
+            "%lu skipped by the filter\n", getpid(), hits, misses, skipped);
+}
+
+
+// FAKEROOT_STATS (fakeroot --stats): every thread counts its own calls,
+// so the hook never takes a lock. Threads' counts stay on all_stats after
+// they exit, and get added up and sent to the daemon when the process
+// exits or execs.
+struct thread_stats {
+    struct thread_stats *next;
+    struct comm_stat *calls[STAT_CALLS];
+};
+
+int stats_on, timing_on;
+static pthread_key_t stats_key;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_stats *all_stats;
+
+static struct comm_stat *call_stats(int callno)
+{
+    struct thread_stats *ts = pthread_getspecific(stats_key);
+
+    if(!ts) {
+        if(!(ts = calloc(1, sizeof(*ts))))
+            return NULL;
+
+        pthread_mutex_lock(&stats_lock);
+        ts->next = all_stats;
+        all_stats = ts;
+        pthread_mutex_unlock(&stats_lock);
+
+        pthread_setspecific(stats_key, ts);
+    }
+
+    if(!ts->calls[callno]) {
+        if(!(ts->calls[callno] = calloc(1, sizeof(struct comm_stat))))
+            return NULL;
+        ts->calls[callno]->callno = callno;
+    }
+
+    return ts->calls[callno];
+}
+
+static int stat_bucket(uint64_t ns)
+{
+    int b = ns ? 64 - __builtin_clzll(ns) : 0;
+    return b < STAT_BUCKETS ? b : STAT_BUCKETS - 1;
+}
+
+void count_call(int callno, uint64_t start, uint64_t total, uint64_t ipc)
+{
+    if(callno < 0 || callno >= STAT_CALLS)
+        return;
+
+    if(trace_on)
+        trace_call(callno, start, total, ipc);
+    if(!stats_on)
+        return;
+
+    struct comm_stat *st = call_stats(callno);
+    if(!st)
+        return;
+
+    uint64_t real = total > ipc ? total - ipc : 0;
+
+    st->count++;
+    st->real_ns += real;
+    st->ipc_ns += ipc;
+    st->real_hist[stat_bucket(real)]++;
+    if(ipc)
+        st->ipc_hist[stat_bucket(ipc)]++;
+}
+
+// Add up every thread's counts, and start them all over.
+static void report_stats(void)
+{
+    struct comm_stat *sum = calloc(STAT_CALLS, sizeof(*sum));
+    uint32_t n = 0;
+
+    if(!sum)
+        return;
+
+    pthread_mutex_lock(&stats_lock);
+    for(struct thread_stats *ts = all_stats; ts; ts = ts->next) {
+        for(int c = 0; c < STAT_CALLS; c++) {
+            struct comm_stat *st = ts->calls[c];
+            if(!st || !st->count)
+                continue;
+
+            sum[c].count += st->count;
+            sum[c].real_ns += st->real_ns;
+            sum[c].ipc_ns += st->ipc_ns;
+            for(int b = 0; b < STAT_BUCKETS; b++) {
+                sum[c].real_hist[b] += st->real_hist[b];
+                sum[c].ipc_hist[b] += st->ipc_hist[b];
+            }
+
+            memset(st, 0, sizeof(*st));
+            st->callno = c;
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    // Squeeze out the calls nobody made.
+    for(int c = 0; c < STAT_CALLS; c++) {
+        if(sum[c].count) {
+            sum[n] = sum[c];
+            sum[n++].callno = c;
+        }
+    }
+
+    if(n)
+        send_stats(sum, n);
+    free(sum);
+}
+
+static void stats_prepare(void)
+{
+    pthread_mutex_lock(&stats_lock);
+}
+
+static void stats_parent(void)
+{
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// A forked child starts counting from nothing.
+static void stats_child(void)
+{
+    for(struct thread_stats *ts = all_stats; ts; ts = ts->next) {
+        for(int c = 0; c < STAT_CALLS; c++) {
+            if(ts->calls[c]) {
+                memset(ts->calls[c], 0, sizeof(struct comm_stat));
+                ts->calls[c]->callno = c;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void hooks_init(void)
+{
+    const char *fakeroot_socket = getenv("FAKEROOT_SOCKET");
+    if(!fakeroot_socket) {
+        fprintf(stderr, "Missing FAKEROOT_SOCKET... can't continue\n");
+        abort();
+    }
+
+    // Our parent may have handed us its connection across exec().
+    const char *fakeroot_fd = getenv("FAKEROOT_FD");
+    int fd = fakeroot_fd ? atoi(fakeroot_fd) : -1;
+
+    // Every process appends to the same file. This goes first so that
+    // at fork() time, what the daemon is still owed gets flushed before
+    // the trace is held still.
+    const char *fakeroot_trace = getenv("FAKEROOT_TRACE");
+    if(fakeroot_trace && trace_open(fakeroot_trace) < 0)
+        perror(fakeroot_trace);
+
+    // Set by fakeroot --attach.
+    const char *fakeroot_ns = getenv("FAKEROOT_NS");
+    uint32_t ns = fakeroot_ns ? strtoul(fakeroot_ns, NULL, 10) : 0;
+
+    if(comm_init(fakeroot_socket, fd, ns) < 0) {
+        perror("comm_init");
+        abort();
+    }
+
+    snprintf(env_preload_string, sizeof(env_preload_string),
+            PRELOAD_VAR "=%s", getenv(PRELOAD_VAR));
+    snprintf(env_sock_string, sizeof(env_sock_string),
+            "FAKEROOT_SOCKET=%s", fakeroot_socket);
+
+    insert_environ[0] = env_preload_string;
+    insert_environ[1] = env_sock_string;
+    insert_environ[2] = NULL;
+
+    // Without the shared page we just go to the daemon for everything.
+    const char *fakeroot_shm = getenv("FAKEROOT_SHM");
+    if(fakeroot_shm && init_shared(fakeroot_shm) == 0) {
+        snprintf(env_shm_string, sizeof(env_shm_string),
+                "FAKEROOT_SHM=%s", fakeroot_shm);
+        insert_environ[2] = env_shm_string;
+        insert_environ[3] = NULL;
+
+        // Falls back to the socket on its own if this doesn't work out.
+        if(!getenv("FAKEROOT_NO_RING"))
+            init_ring(fakeroot_shm);
+    }
+
+    if(ns) {
+        int i = 0;
+        while(insert_environ[i]) i++;
+        snprintf(env_ns_string, sizeof(env_ns_string), "FAKEROOT_NS=%u",
+                (unsigned) ns);
+        insert_environ[i++] = env_ns_string;
+        insert_environ[i] = NULL;
+    }
+
+    if(getenv("FAKEROOT_STATS") && pthread_key_create(&stats_key, NULL) == 0) {
+        int i = 0;
+        while(insert_environ[i]) i++;
+        insert_environ[i++] = "FAKEROOT_STATS=1";
+        insert_environ[i] = NULL;
+
+        stats_on = timing_on = 1;
+        comm_timing(1);
+        pthread_atfork(stats_prepare, stats_parent, stats_child);
+        atexit(report_stats);
+    }
+
+    if(trace_on) {
+        int i = 0;
+        while(insert_environ[i]) i++;
+        snprintf(env_trace_string, sizeof(env_trace_string),
+                "FAKEROOT_TRACE=%s", fakeroot_trace);
+        insert_environ[i++] = env_trace_string;
+        insert_environ[i] = NULL;
+
+        timing_on = 1;
+        comm_timing(1);
+    }
+
+    for(ninsert = 0; insert_environ[ninsert]; ninsert++) {}
+    for(int i = 0; strip_environ[i]; i++)
+        strip_len[i] = strlen(strip_environ[i]);
+
+    if(getenv("FAKEROOT_CACHE_STATS"))
+        atexit(print_cache_stats);
+
+    atexit(flush_at_exit);
+
+    const char *old_state = getenv("FAKEROOT_STATE");
+    if(old_state)
+        sscanf(old_state, "%d:%d:%d:%d",
+                &fake_uid, &fake_gid, &fake_euid, &fake_egid);
+
+    hooks_ready = 1;
+}
+
+
+int is_our_fd(int fd)
+{
+    return is_comm_fd(fd) || is_trace_fd(fd);
+}
+
+
+int count_environ(const char **envp)
+{
+    int n = 0;
+    if(envp)
+        while(envp[n]) n++;
+    return n;
+}
+
+
+// Fill envbuf with envp minus our own variables, then the current ones.
+// With fd >= 0 the new image is told it can pick up our connection.
+static void build_environ(const char **envbuf, const char **envp,
+        struct exec_env *x, int fd)
+{
+    int envptr = 0;
+
+    for(int i = 0; envp && envp[i]; i++) {
+        const char *env = envp[i];
+
+        for(int j = 0; strip_environ[j]; j++) {
+            size_t len = strip_len[j];
+            if(env[0] == strip_environ[j][0] &&
+               memcmp(env, strip_environ[j], len) == 0 && env[len] == '=')
+                goto skip;
+        }
+        envbuf[envptr++] = env;
+skip: {}
+    }
+
+    memcpy(&envbuf[envptr], insert_environ, ninsert * sizeof(envbuf[0]));
+    envptr += ninsert;
+
+    snprintf(x->state, sizeof(x->state), "FAKEROOT_STATE=%d:%d:%d:%d",
+            fake_uid, fake_gid, fake_euid, fake_egid);
+    envbuf[envptr++] = x->state;
+
+    if(fd >= 0) {
+        snprintf(x->fd, sizeof(x->fd), "FAKEROOT_FD=%d", fd);
+        envbuf[envptr++] = x->fd;
+    }
+
+    envbuf[envptr++] = NULL;
+}
+
+
+int exec_begin(const char **envbuf, const char **envp, struct exec_env *x)
+{
+    // Whatever we've counted goes with this image.
+    if(stats_on)
+        report_stats();
+
+    // Flushes anything we still owe the daemon, too.
+    int fd = comm_exec_fd();
+    trace_flush();
+
+    build_environ(envbuf, envp, x, fd);
+    return fd;
+}
+
+
+// The child starts out with a fresh image and nothing of ours, so it has
+// to connect for itself; all we can do is make sure it sees what we did.
+void spawn_begin(const char **envbuf, const char **envp, struct exec_env *x)
+{
+    build_environ(envbuf, envp, x, -1);
+    flush_owners();
+}
+
+
+int create_or_open(int *created, int (*open_fn)(void *arg, int oflag),
+        void *arg, int oflag)
+{
+    // No O_CREAT? Easy.
+    if(!(oflag & O_CREAT)) {
+        *created = 0;
+        return open_fn(arg, oflag);
+    }
+
+    int result;
+retry:
+    // Try force-creating the file first...
+    result = open_fn(arg, oflag | O_EXCL);
+    if(result >= 0) {
+        // Success! Created.
+        *created = 1;
+        return result;
+    }
+
+    if(errno != EEXIST) {
+        // Not an error we expected. Throw it.
+        return -1;
+    }
+
+    if(oflag & O_EXCL) {
+        // This error would have been passed on to the user anyway.
+        // Let 'em have it.
+        *created = 0;
+        return -1;
+    }
+
+    // Try just opening the file?
+    result = open_fn(arg, oflag & ~O_CREAT);
+    if(result >= 0) {
+        // Success! Opened.
+        *created = 0;
+        return result;
+    }
+
+    if(errno != ENOENT)
+        return -1; // meh.
+
+    // Weirdness... someone must have managed to delete this file
+    // between our two open() calls.
+    //
+    // Try again and see if we can win the race.
+    goto retry;
+}
+
+
+void set_fresh(dev_t dev, ino_t ino, const struct fake_attrs *extra)
+{
+    struct fake_attrs attrs = { 0 };
+
+    if(extra)
+        attrs = *extra;
+
+    attrs.known |= FAKE_FRESH | FAKE_OWNER;
+    attrs.uid = fake_euid;
+    attrs.gid = fake_egid;
+
+    // Usually the owner policy already says so.
+    uid_t uid;
+    gid_t gid;
+    if(fresh_owner(dev, &uid, &gid) && uid == attrs.uid && gid == attrs.gid)
+        attrs.known &= ~FAKE_OWNER;
+
+    set_attrs(dev, ino, &attrs);
+}
+
+// There's no way to read the umask without setting it.
+static mode_t umask_peek(void)
+{
+    mode_t mask = umask(022);
+    umask(mask);
+    return mask;
+}
+
+void set_node(dev_t dev, ino_t ino, mode_t mode, dev_t rdev)
+{
+    if(!S_ISCHR(mode) && !S_ISBLK(mode)) {
+        set_fresh(dev, ino, NULL);
+        return;
+    }
+
+    struct fake_attrs attrs = {
+        .known = FAKE_MODE | FAKE_TYPE,
+        .mode = (mode & ~umask_peek() & 07777) | (mode & S_IFMT),
+        .rdev = rdev,
+    };
+
+    set_fresh(dev, ino, &attrs);
+}
+
+// Once the last name is gone, we forget about the inode, or whatever gets
+// its number next would inherit our record. (Directories only ever have
+// the one name that counts.)
+void removed(dev_t dev, ino_t ino, mode_t mode, nlink_t nlink)
+{
+    if(S_ISDIR(mode) || nlink <= 1)
+        del_attrs(dev, ino);
+}
+
+// -1 leaves the owner or group as it is (or as we've been saying it is).
+void fake_chown(dev_t dev, ino_t ino, uid_t st_uid, gid_t st_gid,
+        uid_t uid, gid_t gid)
+{
+    if(uid == (uid_t) -1 || gid == (gid_t) -1) {
+        struct fake_attrs attrs;
+        if(get_attrs(dev, ino, &attrs) > 0 && (attrs.known & FAKE_OWNER)) {
+            st_uid = attrs.uid;
+            st_gid = attrs.gid;
+        } else {
+            implied_owner(dev, &st_uid, &st_gid);
+        }
+
+        if(uid == (uid_t) -1)
+            uid = st_uid;
+        if(gid == (gid_t) -1)
+            gid = st_gid;
+    }
+
+    set_owner(dev, ino, uid, gid);
+}
+
+void fake_chmod(dev_t dev, ino_t ino, mode_t mode)
+{
+    struct fake_attrs attrs = {
+        .known = FAKE_MODE,
+        .mode = mode & 07777,
+    };
+
+    set_attrs(dev, ino, &attrs);
+}
+
+// We still need to be able to get at whatever we chmod(), and setuid bits
+// on files we really own would be a hazard, so the real file only gets
+// the plain permission bits plus owner access.
+mode_t real_mode(mode_t st_mode, mode_t mode)
+{
+    mode = (mode & 0777) | S_IRUSR | S_IWUSR;
+    if(S_ISDIR(st_mode))
+        mode |= S_IXUSR;
+    return mode;
+}
@@ -0,0 +1,93 @@
+#ifndef HOOKS_H
+#define HOOKS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "communicate.h"
+
+// What libfakeroot does about the calls it catches, whichever way it
+// catches them: libfakeroot.c patches syscall stubs (Darwin), preload.c
+// stands in for libc's functions (Linux, LD_PRELOAD). The frontends make
+// the real calls and tell us what happened; nothing in here knows how a
+// call got to us.
+
+// Set once hooks_init() is done; until then the Linux frontend passes
+// everything straight through.
+extern int hooks_ready;
+
+// Who we're pretending to be.
+extern int fake_uid, fake_gid, fake_euid, fake_egid;
+
+// Connect to the daemon and pick up the state our parent left us.
+void hooks_init(void);
+
+// FAKEROOT_STATS and FAKEROOT_TRACE: with timing_on, frontends time each
+// call and count it under callno.
+extern int stats_on, timing_on;
+void count_call(int callno, uint64_t start, uint64_t total, uint64_t ipc);
+
+// Our daemon connections and trace file, which the program mustn't close
+// or dup2() over.
+int is_our_fd(int fd);
+
+// exec() and posix_spawn(): build the new image's environment in envbuf,
+// with room for count_environ(envp) + ENV_EXTRA entries. exec_begin()
+// also hands over our connection, and returns it for comm_exec_failed()
+// in case the exec doesn't happen.
+#define INSERT_MAX  16
+#define ENV_EXTRA   (INSERT_MAX + 3)
+
+struct exec_env {
+    char state[128], fd[32];
+};
+
+int count_environ(const char **envp);
+int exec_begin(const char **envbuf, const char **envp, struct exec_env *x);
+void spawn_begin(const char **envbuf, const char **envp, struct exec_env *x);
+
+// Open the way open() would, but find out whether the file was created.
+// open_fn makes the real call with the flags it's given.
+int create_or_open(int *created, int (*open_fn)(void *arg, int oflag),
+        void *arg, int oflag);
+
+// Record a file we just made as ours, along with anything else in extra.
+void set_fresh(dev_t dev, ino_t ino, const struct fake_attrs *extra);
+
+// ...and one mknod() just made. Device nodes are faked, with an empty file
+// standing in for them.
+void set_node(dev_t dev, ino_t ino, mode_t mode, dev_t rdev);
+
+// A name for this inode has just gone away.
+void removed(dev_t dev, ino_t ino, mode_t mode, nlink_t nlink);
+
+// chown() and chmod() of a file whose real owner and mode are given.
+void fake_chown(dev_t dev, ino_t ino, uid_t st_uid, gid_t st_gid,
+        uid_t uid, gid_t gid);
+void fake_chmod(dev_t dev, ino_t ino, mode_t mode);
+
+// What the real file gets chmod()ed to instead of mode.
+mode_t real_mode(mode_t st_mode, mode_t mode);
+
+// Overlay what we fake about an inode on a stat buffer (struct stat or
+// struct stat64): its owner is the recorded one, or else the policy's. A
+// faked device node is an empty file underneath.
+#define OVERLAY_ATTRS(sbuf, attrs) do { \
+    if((attrs)->known & FAKE_OWNER) { \
+        (sbuf)->st_uid = (attrs)->uid; \
+        (sbuf)->st_gid = (attrs)->gid; \
+    } else { \
+        implied_owner((sbuf)->st_dev, &(sbuf)->st_uid, &(sbuf)->st_gid); \
+    } \
+    if((attrs)->known & FAKE_MODE) \
+        (sbuf)->st_mode = ((sbuf)->st_mode & S_IFMT) | \
+            ((attrs)->mode & 07777); \
+    if((attrs)->known & FAKE_TYPE) { \
+        (sbuf)->st_mode = ((sbuf)->st_mode & 07777) | \
+            ((attrs)->mode & S_IFMT); \
+        (sbuf)->st_rdev = (attrs)->rdev; \
+    } \
+} while(0)
+
+#endif
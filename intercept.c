@@ -1,6 +1,7 @@
 #include "libfakeroot.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <dlfcn.h>
 #include <errno.h>
@@ -12,33 +13,50 @@
 
 void libfakeroot_sysenter_landing(void);
 
-int libfakeroot_patch_func(const char *name)
+#define STUB_SIZE   32
+#define RUN_GAP     4       // pages we'll cover between two stubs
+
+struct stub {
+    uintptr_t addr;
+    int index;
+};
+
+// Find a syscall stub and make sure it looks like one we know how to patch.
+static uint8_t *find_stub(const char *name, int *err)
 {
     // get the call stub
     uint8_t *fptr = dlsym(RTLD_DEFAULT, name);
-    if(!fptr) return ESRCH;
+    if(!fptr) {
+        *err = ESRCH;
+        return NULL;
+    }
 
     // Check signature
 #if defined(__i386__)
     if(fptr[0]  != 0xb8 ||  // mov -> eax
        fptr[5]  != 0xe8 ||  // call
        fptr[26] != 0xc3     // ret
-      ) return EINVAL;
+      ) {
+        *err = EINVAL;
+        return NULL;
+    }
 #elif defined(__x86_64__)
     if(fptr[0]  != 0xb8 ||  // mov -> rax
        fptr[8]  != 0x0f ||  // syscall (first byte)
        fptr[17] != 0xc3     // ret
-      ) return EINVAL;
+      ) {
+        *err = EINVAL;
+        return NULL;
+    }
 #endif
 
-    mach_error_t err;
-
-    err = vm_protect(mach_task_self(),
-            (vm_address_t) fptr, 32, false,
-            VM_PROT_READ | VM_PROT_WRITE | VM_PROT_EXECUTE);
-
-    if(err) return EFAULT;
+    *err = 0;
+    return fptr;
+}
 
+// Point a (writable) stub at our landing pad.
+static void patch_stub(uint8_t *fptr)
+{
 #if defined(__i386__)
     {
         void *target = libfakeroot_sysenter_landing;
@@ -55,12 +73,98 @@ int libfakeroot_patch_func(const char *name)
         fptr[17] = 0xe3;
     }
 #endif
+}
+
+static mach_error_t protect(uintptr_t start, uintptr_t end, vm_prot_t prot)
+{
+    return vm_protect(mach_task_self(),
+            (vm_address_t) start, end - start, false, prot);
+}
+
+int libfakeroot_patch_func(const char *name)
+{
+    int err;
+    uint8_t *fptr = find_stub(name, &err);
+    if(!fptr) return err;
+
+    uintptr_t start = (uintptr_t) fptr;
 
-    err = vm_protect(mach_task_self(),
-            (vm_address_t) fptr, 32, false,
-            VM_PROT_READ | VM_PROT_EXECUTE);
+    if(protect(start, start + STUB_SIZE,
+                VM_PROT_READ | VM_PROT_WRITE | VM_PROT_EXECUTE))
+        return EFAULT;
 
-    if(err) return EFAULT;
+    patch_stub(fptr);
+
+    if(protect(start, start + STUB_SIZE, VM_PROT_READ | VM_PROT_EXECUTE))
+        return EFAULT;
 
     return 0;
 }
+
+
+static int cmp_stub(const void *a, const void *b)
+{
+    const struct stub *x = a, *y = b;
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+int libfakeroot_patch_funcs(const char **names, int *res)
+{
+    int n = 0, failed = 0;
+    while(names[n]) n++;
+
+    struct stub stubs[n > 0 ? n : 1];
+    int nstubs = 0;
+
+    for(int i = 0; i < n; i++) {
+        uint8_t *fptr = find_stub(names[i], &res[i]);
+        if(fptr) {
+            stubs[nstubs].addr = (uintptr_t) fptr;
+            stubs[nstubs].index = i;
+            nstubs++;
+        } else {
+            failed++;
+        }
+    }
+
+    // The stubs all live together in libsystem_kernel, so rather than
+    // flipping protections twice per stub, do it once per run of pages.
+    qsort(stubs, nstubs, sizeof(stubs[0]), cmp_stub);
+
+    uintptr_t page = getpagesize();
+
+    for(int i = 0; i < nstubs; ) {
+        uintptr_t start = stubs[i].addr & ~(page - 1);
+        uintptr_t end = stubs[i].addr + STUB_SIZE;
+        int j = i + 1;
+
+        while(j < nstubs && stubs[j].addr <= end + RUN_GAP * page) {
+            end = stubs[j].addr + STUB_SIZE;
+            j++;
+        }
+        end = (end + page - 1) & ~(page - 1);
+
+        int err = 0;
+        if(protect(start, end,
+                    VM_PROT_READ | VM_PROT_WRITE | VM_PROT_EXECUTE))
+            err = EFAULT;
+
+        for(int k = i; k < j; k++) {
+            if(!err)
+                patch_stub((uint8_t *) stubs[k].addr);
+            res[stubs[k].index] = err;
+        }
+
+        if(!err && protect(start, end, VM_PROT_READ | VM_PROT_EXECUTE)) {
+            for(int k = i; k < j; k++)
+                res[stubs[k].index] = EFAULT;
+            err = EFAULT;
+        }
+
+        if(err)
+            failed += j - i;
+        i = j;
+    }
+
+    return failed;
+}
@@ -1,4 +1,6 @@
 #include "libfakeroot.h"
+#include "hooks.h"
+#include "attrlist.h"
 
 #include <stdio.h>
 #include <errno.h>
@@ -13,40 +15,12 @@
 
 void cthread_set_errno_self(int error); // Libc SPI
 
-static int uid = 0, euid = 0, gid = 0, egid = 0;
-
-static int comm_fd;
-
-static const char *insert_environ[16];
-
-static const char *strip_environ[] = {
-    "DYLD_INSERT_LIBRARIES",
-    "FAKEROOT_SOCKET",
-    "FAKEROOT_STATE",
-    NULL
-};
-
-
-static void try_patch(const char *func)
-{
-    int res = libfakeroot_patch_func(func);
-#ifdef DEBUG
-    if(res != 0) {
-        if(strchr(func, '$')) return; // fewer crazy aliases on 64-bit
-        fprintf(stderr, "failed to patch %s - err = %d\n", func, res);
-    }
-#else
-    (void) res;
-#endif
-}
-
-
 const char *patch_funcs[] = {
     "getuid", "getgid", "geteuid", "getegid",
     "setuid", "setgid", "seteuid", "setegid",
     "setreuid", "setregid", "issetugid",
 
-    "execve",
+    "execve", "__posix_spawn",
 
     "open", "open$UNIX2003", "open$NOCANCEL", "open$NOCANCEL$UNIX2003",
 
@@ -61,11 +35,16 @@ const char *patch_funcs[] = {
 */
 
     "chown", "fchown", "lchown",
+    "chmod", "fchmod", "chmod$UNIX2003", "fchmod$UNIX2003",
+    "mknod",
+    "unlink", "rmdir", "rename",
 
-/*
     "getattrlist", "fgetattrlist", "getattrlist$UNIX2003",
-    "setattrlist", "fsetattrlist", "setattrlist$UNIX2003",
+    "getattrlistat", "getattrlistbulk",
     "getdirentriesattr",
+
+/*
+    "setattrlist", "fsetattrlist", "setattrlist$UNIX2003",
 */
 
     // We override these to make our control FD "play dead"
@@ -83,39 +62,25 @@ const char *patch_funcs[] = {
         "open_extended", "mkdir_extended", "access_extended",
         "chmod_extended", "fchmod_extended",
 */
+    NULL
 };
 
-static char env_dyld_string[512], env_sock_string[512];
+#define NPATCH  (sizeof(patch_funcs) / sizeof(patch_funcs[0]) - 1)
 
 void libfakeroot_init(void)
 {
-    const char *fakeroot_socket = getenv("FAKEROOT_SOCKET");
-    if(!fakeroot_socket) {
-        fprintf(stderr, "Missing FAKEROOT_SOCKET... can't continue\n");
-        abort();
-    }
-
-    comm_fd = init_commfd(fakeroot_socket);
-    if(!comm_fd) {
-        perror("init_commfd");
-        abort();
-    }
-
-    snprintf(env_dyld_string, sizeof(env_dyld_string),
-            "DYLD_INSERT_LIBRARIES=%s", getenv("DYLD_INSERT_LIBRARIES"));
-    snprintf(env_sock_string, sizeof(env_sock_string),
-            "FAKEROOT_SOCKET=%s", fakeroot_socket);
-
-    insert_environ[0] = env_dyld_string;
-    insert_environ[1] = env_sock_string;
-    insert_environ[2] = NULL;
+    hooks_init();
 
-    const char *old_state = getenv("FAKEROOT_STATE");
-    if(old_state)
-        sscanf(old_state, "%d:%d:%d:%d", &uid, &gid, &euid, &egid);
+    int res[NPATCH];
+    libfakeroot_patch_funcs(patch_funcs, res);
 
-    for(int i = 0; patch_funcs[i]; i++)
-        try_patch(patch_funcs[i]);
+#ifdef DEBUG
+    for(int i = 0; patch_funcs[i]; i++) {
+        if(res[i] != 0 && !strchr(patch_funcs[i], '$')) // fewer crazy aliases
+            fprintf(stderr, "failed to patch %s - err = %d\n",
+                    patch_funcs[i], res[i]);
+    }
+#endif
 
 #ifdef DEBUG
     // mainly to get stdio initialization out of our hair
@@ -130,108 +95,157 @@ static cpuword_t do_execve(void *stack[])
     const char ** argv = (const char **) stack[1];
     const char ** envp = (const char **) stack[2];
 
-    const char *envbuf[512];
-    char statebuf[128];
+    const char *envbuf[count_environ(envp) + ENV_EXTRA];
+    struct exec_env x;
+    int fd = exec_begin(envbuf, envp, &x);
 
-    int envptr = 0;
+    syscall(SYS_execve, path, argv, envbuf);
 
-    for(int i = 0; i < 512; i++) {
-        if(!envp[i]) break;
-        for(int j = 0; strip_environ[j]; j++) {
-            const char *ent = strip_environ[j];
-            int len = strlen(ent);
-            if(memcmp(envp[i], ent, len) == 0 && ent[len] == '=') {
-                goto skip;
-            }
-        }
-        envbuf[envptr++] = envp[i];
-skip: {}
-    }
+    // no such thing as a successful return
+    int err = errno;
+    comm_exec_failed(fd);
+    return err;
+}
 
-    for(int i = 0; insert_environ[i]; i++) {
-        envbuf[envptr++] = insert_environ[i];
-    }
 
-    snprintf(statebuf, sizeof(statebuf),
-            "FAKEROOT_STATE=%d:%d:%d:%d", uid, gid, euid, egid);
-    envbuf[envptr++] = statebuf;
+static cpuword_t do_posix_spawn(void *stack[])
+{
+    pid_t *pid = (pid_t *) stack[0];
+    const char *path = (const char *) stack[1];
+    void *attrs = stack[2];
+    const char ** argv = (const char **) stack[3];
+    const char ** envp = (const char **) stack[4];
 
-    envbuf[envptr++] = NULL;
+    const char *envbuf[count_environ(envp) + ENV_EXTRA];
+    struct exec_env x;
+    spawn_begin(envbuf, envp, &x);
 
-    syscall(SYS_execve, path, argv, envbuf);
-    return errno; // no such thing as a successful return
+    if(syscall(SYS_posix_spawn, pid, path, attrs, argv, envbuf) < 0)
+        return errno;
+
+    return 0;
 }
 
 
-static int create_or_open(int *created, int call,
-        const char *path, int oflag, mode_t mode)
+struct open_args {
+    int call;
+    const char *path;
+    mode_t mode;
+};
+
+static int real_open(void *arg, int oflag)
 {
-    // No O_CREAT? Easy.
-    if(!(oflag & O_CREAT)) {
-        *created = 0;
-        return syscall(call, path, oflag, mode);
-    }
+    struct open_args *a = arg;
+    return syscall(a->call, a->path, oflag, a->mode);
+}
+
 
-    int result;
-retry:
-    // Try force-creating the file first...
-    result = syscall(call, path, oflag | O_EXCL, mode);
-    if(result >= 0) {
-        // Success! Created.
-        *created = 1;
+// getattrlist() and friends, with what attr_begin() says to ask for. The
+// single-object calls get a buffer with room for our extras, so the caller
+// never gets less than they would have; the bulk ones just fit fewer
+// entries into theirs.
+static cpuword_t do_getattrlist(int call, cpuword_t *stack,
+        cpuword_t *error)
+{
+    int a = 0, bulk = call == SYS_getdirentriesattr;
+#ifdef SYS_getattrlistat
+    a = call == SYS_getattrlistat;      // a directory fd comes first
+#endif
+#ifdef SYS_getattrlistbulk
+    bulk |= call == SYS_getattrlistbulk;
+#endif
+
+    struct attr_fixup f;
+    unsigned long options =
+        call == SYS_getdirentriesattr ? 0 : stack[a + 4];
+    cpuword_t result;
+
+    if(!attr_begin(&f, (struct attrlist *) stack[a + 1], options)) {
+        result = syscall(call, stack[0], stack[1], stack[2], stack[3],
+                stack[4], stack[5], stack[6], stack[7]);
+        if((int) result == -1)
+            *error = errno;
         return result;
     }
 
-    if(errno != EEXIST) {
-        // Not an error we expected. Throw it.
-        return -1;
+    char *buf = (char *) stack[a + 2], *tmp = NULL;
+    size_t size = stack[a + 3];
+    cpuword_t args[8];
+
+    memcpy(args, stack, sizeof(args));
+    args[a + 1] = (cpuword_t) &f.al;
+
+    if(!bulk) {
+        if(!(tmp = malloc(size + ATTR_EXTRA))) {
+            *error = ENOMEM;
+            return -1;
+        }
+        args[a + 2] = (cpuword_t) tmp;
+        args[a + 3] = size + ATTR_EXTRA;
     }
 
-    if(oflag & O_EXCL) {
-        // This error would have been passed on to the user anyway.
-        // Let 'em have it.
-        *created = 0;
-        return -1;
+    result = syscall(call, args[0], args[1], args[2], args[3],
+            args[4], args[5], args[6], args[7]);
+    if((int) result == -1) {
+        *error = errno;
+        free(tmp);
+        return result;
     }
 
-    // Try just opening the file?
-    result = syscall(call, path, oflag & ~O_CREAT, mode);
-    if(result >= 0) {
-        // Success! Opened.
-        *created = 0;
+    if(bulk) {
+        int n = call == SYS_getdirentriesattr ?
+            *(unsigned int *) stack[4] : (int) result;
+        if(attr_finish(&f, buf, size, n) < 0)
+            *error = errno;
         return result;
     }
 
-    if(errno != ENOENT)
-        return -1; // meh.
+    int res = attr_finish(&f, tmp, size + ATTR_EXTRA, 1);
+    if(res < 0) {
+        *error = errno;
+    } else if(res > 0) {
+        // Too little room to find the attributes; there's none to fake
+        // in what the caller will get either.
+        result = syscall(call, stack[0], stack[1], stack[2], stack[3],
+                stack[4], stack[5], stack[6], stack[7]);
+        if((int) result == -1)
+            *error = errno;
+    } else {
+        uint32_t len;
+        memcpy(&len, tmp, sizeof(len));
+        memcpy(buf, tmp, len < size ? len : size);
+    }
 
-    // Weirdness... someone must have managed to delete this file
-    // between our two open() calls.
-    //
-    // Try again and see if we can win the race.
-    goto retry;
+    free(tmp);
+    return result;
 }
 
 
-syscall_return_t libfakeroot_sysenter_hook(cpuword_t callno, cpuword_t *stack)
+static syscall_return_t handle_call(cpuword_t callno, cpuword_t *stack)
 {
     int realCall = callno & 0xffff;
     cpuword_t error = 0, result = 0, result2 = 0;
 
     switch(realCall) {
 
-        case SYS_getuid: result = uid; break;
-        case SYS_getgid: result = gid; break;
-        case SYS_geteuid: result = euid; break;
-        case SYS_getegid: result = egid; break;
+        case SYS_getuid: result = fake_uid; break;
+        case SYS_getgid: result = fake_gid; break;
+        case SYS_geteuid: result = fake_euid; break;
+        case SYS_getegid: result = fake_egid; break;
 
-        case SYS_setuid: uid = euid = stack[0]; break;
-        case SYS_setgid: gid = egid = stack[0]; break;
-        case SYS_seteuid: euid = stack[0]; break;
-        case SYS_setegid: egid = stack[0]; break;
+        case SYS_setuid: fake_uid = fake_euid = stack[0]; break;
+        case SYS_setgid: fake_gid = fake_egid = stack[0]; break;
+        case SYS_seteuid: fake_euid = stack[0]; break;
+        case SYS_setegid: fake_egid = stack[0]; break;
 
-        case SYS_setreuid: uid = stack[0]; euid = stack[1]; break;
-        case SYS_setregid: gid = stack[0]; egid = stack[1]; break;
+        case SYS_setreuid:
+            if((int) stack[0] != -1) fake_uid = stack[0];
+            if((int) stack[1] != -1) fake_euid = stack[1];
+            break;
+        case SYS_setregid:
+            if((int) stack[0] != -1) fake_gid = stack[0];
+            if((int) stack[1] != -1) fake_egid = stack[1];
+            break;
 
         case SYS_issetugid:
             // we're kind of setugid no matter what. Meh.
@@ -242,6 +256,10 @@ syscall_return_t libfakeroot_sysenter_hook(cpuword_t callno, cpuword_t *stack)
             error = do_execve((void **) stack);
             break;
 
+        case SYS_posix_spawn:
+            error = do_posix_spawn((void **) stack);
+            break;
+
         case SYS_open:
         case SYS_open_nocancel:
         {
@@ -249,8 +267,9 @@ syscall_return_t libfakeroot_sysenter_hook(cpuword_t callno, cpuword_t *stack)
             int oflag = (int) stack[1];
             mode_t mode = (mode_t) stack[2];
 
+            struct open_args args = { realCall, path, mode };
             int created;
-            int fd = create_or_open(&created, realCall, path, oflag, mode);
+            int fd = create_or_open(&created, real_open, &args, oflag);
 
             if(fd < 0) {
                 error = errno;
@@ -268,7 +287,7 @@ syscall_return_t libfakeroot_sysenter_hook(cpuword_t callno, cpuword_t *stack)
                     break;
                 }
 
-                set_owner(comm_fd, sbuf.st_dev, sbuf.st_ino, euid, egid);
+                set_fresh(sbuf.st_dev, sbuf.st_ino, NULL);
             }
         }
             break;
@@ -292,7 +311,7 @@ syscall_return_t libfakeroot_sysenter_hook(cpuword_t callno, cpuword_t *stack)
                 break;
             }
 
-            set_owner(comm_fd, sbuf.st_dev, sbuf.st_ino, euid, egid);
+            set_fresh(sbuf.st_dev, sbuf.st_ino, NULL);
         }
             break;
 
@@ -315,7 +334,7 @@ syscall_return_t libfakeroot_sysenter_hook(cpuword_t callno, cpuword_t *stack)
                 break;
             }
 
-            set_owner(comm_fd, sbuf.st_dev, sbuf.st_ino, euid, egid);
+            set_fresh(sbuf.st_dev, sbuf.st_ino, NULL);
         }
             break;
 
@@ -330,7 +349,7 @@ syscall_return_t libfakeroot_sysenter_hook(cpuword_t callno, cpuword_t *stack)
             }
 
             // Get the "real" owner
-            if(get_owner(comm_fd, sbuf->st_dev, sbuf->st_ino,
+            if(get_owner(sbuf->st_dev, sbuf->st_ino,
                         &sbuf.st_uid, &sbuf.st_gid) < 0) {
                 error = EIO;
                 break;
@@ -362,10 +381,13 @@ syscall_return_t libfakeroot_sysenter_hook(cpuword_t callno, cpuword_t *stack)
                 break;
             }
 
-            if(get_owner(comm_fd, sbuf->st_dev, sbuf->st_ino,
-                        &(sbuf->st_uid), &(sbuf->st_gid)) < 0) {
+            struct fake_attrs attrs;
+            if(get_attrs(sbuf->st_dev, sbuf->st_ino, &attrs) < 0) {
                 error = EIO;
+                break;
             }
+
+            OVERLAY_ATTRS(sbuf, &attrs);
         }
             break;
 
@@ -382,11 +404,14 @@ syscall_return_t libfakeroot_sysenter_hook(cpuword_t callno, cpuword_t *stack)
             }
 
             // Stat buffer now contains dev/inode, so we can use it
-            // to get the "real" owner
-            if(get_owner(comm_fd, sbuf->st_dev, sbuf->st_ino,
-                        &(sbuf->st_uid), &(sbuf->st_gid)) < 0) {
+            // to get the "real" owner, mode and so on
+            struct fake_attrs attrs;
+            if(get_attrs(sbuf->st_dev, sbuf->st_ino, &attrs) < 0) {
                 error = EIO;
+                break;
             }
+
+            OVERLAY_ATTRS(sbuf, &attrs);
         }
             break;
 
@@ -411,15 +436,133 @@ syscall_return_t libfakeroot_sysenter_hook(cpuword_t callno, cpuword_t *stack)
                 break;
             }
 
-            set_owner(comm_fd, sbuf.st_dev, sbuf.st_ino, stack[1], stack[2]);
+            fake_chown(sbuf.st_dev, sbuf.st_ino, sbuf.st_uid, sbuf.st_gid,
+                    stack[1], stack[2]);
         }
             break;
 
 
+        case SYS_chmod:
+        case SYS_fchmod:
+        {
+            mode_t mode = (mode_t) stack[1] & 07777;
+
+            struct stat64 sbuf;
+            result = syscall(realCall == SYS_chmod ? SYS_stat64 : SYS_fstat64,
+                    stack[0], &sbuf);
+            if((int) result != 0) {
+                error = errno;
+                break;
+            }
+
+            // The real file gets a mode we can live with; the one asked
+            // for is what stat() will show.
+            result = syscall(realCall, stack[0], real_mode(sbuf.st_mode, mode));
+            if((int) result != 0) {
+                error = errno;
+                break;
+            }
+
+            fake_chmod(sbuf.st_dev, sbuf.st_ino, mode);
+        }
+            break;
+
+
+        case SYS_mknod:
+        {
+            const char *path = (const char *) stack[0];
+            mode_t mode = (mode_t) stack[1];
+            dev_t rdev = (dev_t) stack[2];
+
+            // Only root gets to mknod() anything, so we make what we can
+            // with other calls. Device nodes are faked, with an empty file
+            // standing in for them.
+            int isdev = S_ISCHR(mode) || S_ISBLK(mode);
+
+            if(S_ISFIFO(mode)) {
+                result = syscall(SYS_mkfifo, path, mode & 07777);
+            } else if(isdev || S_ISREG(mode) || (mode & S_IFMT) == 0) {
+                result = syscall(SYS_open, path, O_WRONLY | O_CREAT | O_EXCL,
+                        isdev ? 0600 : mode & 07777);
+                if((int) result >= 0)
+                    result = syscall(SYS_close, (int) result);
+            } else {
+                result = syscall(realCall, path, mode, rdev);
+            }
+
+            if((int) result < 0) {
+                error = errno;
+                break;
+            }
+
+            struct stat64 sbuf;
+            if(syscall(SYS_lstat64, path, &sbuf) < 0) {
+                perror("stat failed after mknod()");
+                break;
+            }
+
+            set_node(sbuf.st_dev, sbuf.st_ino, mode, rdev);
+        }
+            break;
+
+
+        case SYS_unlink:
+        case SYS_rmdir:
+        {
+            // Look before it's gone.
+            struct stat64 sbuf;
+            int sres = syscall(SYS_lstat64, stack[0], &sbuf);
+
+            result = syscall(realCall, stack[0]);
+            if((int) result < 0) {
+                error = errno;
+                break;
+            }
+
+            if(sres == 0)
+                removed(sbuf.st_dev, sbuf.st_ino, sbuf.st_mode, sbuf.st_nlink);
+        }
+            break;
+
+
+        case SYS_rename:
+        {
+            // Whatever the new name referred to goes away, unless it's
+            // the same file.
+            struct stat64 from, to;
+            int fres = syscall(SYS_lstat64, stack[0], &from);
+            int tres = syscall(SYS_lstat64, stack[1], &to);
+
+            result = syscall(realCall, stack[0], stack[1]);
+            if((int) result < 0) {
+                error = errno;
+                break;
+            }
+
+            if(tres == 0 && !(fres == 0 && from.st_dev == to.st_dev &&
+                              from.st_ino == to.st_ino))
+                removed(to.st_dev, to.st_ino, to.st_mode, to.st_nlink);
+        }
+            break;
+
+
+        case SYS_getattrlist:
+        case SYS_fgetattrlist:
+        case SYS_getdirentriesattr:
+#ifdef SYS_getattrlistat
+        case SYS_getattrlistat:
+#endif
+#ifdef SYS_getattrlistbulk
+        case SYS_getattrlistbulk:
+#endif
+            result = do_getattrlist(realCall, stack, &error);
+            break;
+
+
         case SYS_close:
         case SYS_close_nocancel:
-            // Hide comm_fd - part I
-            if(stack[0] == comm_fd)
+            // Hide our daemon connections - part I
+            if(is_our_fd(stack[0]))
                 error = EBADF;
             else {
                 result = syscall(realCall, stack[0]);
@@ -429,8 +572,8 @@ syscall_return_t libfakeroot_sysenter_hook(cpuword_t callno, cpuword_t *stack)
 
 
         case SYS_dup2:
-            // Hide comm_fd - part II
-            if(stack[0] == comm_fd || stack[1] == comm_fd)
+            // Hide our daemon connections - part II
+            if(is_our_fd(stack[0]) || is_our_fd(stack[1]))
                 error = EBADF;
             else {
                 result = syscall(realCall, stack[0], stack[1]);
@@ -468,3 +611,17 @@ syscall_return_t libfakeroot_sysenter_hook(cpuword_t callno, cpuword_t *stack)
         return (syscall_return_t) {result, result2};
     }
 }
+
+
+syscall_return_t libfakeroot_sysenter_hook(cpuword_t callno, cpuword_t *stack)
+{
+    if(!timing_on)
+        return handle_call(callno, stack);
+
+    uint64_t start = comm_clock(), ipc = comm_ipc_time();
+    syscall_return_t ret = handle_call(callno, stack);
+    uint64_t total = comm_clock() - start;
+
+    count_call(callno & 0xffff, start, total, comm_ipc_time() - ipc);
+    return ret;
+}
@@ -9,3 +9,7 @@ typedef struct {
 } syscall_return_t;
 
 int libfakeroot_patch_func(const char *name);
+
+// Patch every stub in the NULL-terminated names, leaving each one's result
+// in res. Returns how many couldn't be patched.
+int libfakeroot_patch_funcs(const char **names, int *res);
@@ -0,0 +1,256 @@
+#include "nodetable.h"
+
+#include <string.h>
+#include <sys/mman.h>
+
+// An entry with ino == 0 is free: dev == 0 marks it empty (ends a probe
+// sequence), dev == 1 marks a tombstone (probing continues past it).
+#define IS_FREE(e)      ((e)->key.ino == 0)
+#define IS_EMPTY(e)     (IS_FREE(e) && (e)->key.dev == 0)
+
+#define MIN_BUCKETS     64
+#define MIGRATE_STEP    4       // old buckets moved per write
+
+uint64_t nodetable_hash(const struct dbKey *key)
+{
+    uint64_t h = (uint64_t) key->ino * 0x9e3779b97f4a7c15ULL;
+    h ^= (uint64_t) key->dev * 0xc2b2ae3d27d4eb4fULL;
+    return h ^ (h >> 31);
+}
+
+static inline int over_load(size_t used, size_t nbuckets)
+{
+    return used * 4 >= nbuckets * NODE_SLOTS * 3;
+}
+
+// Bucket arrays come straight from mmap(): they're page-aligned and the
+// kernel zeroes them lazily, so allocating a big one is not a big stall.
+static struct node_bucket *alloc_buckets(size_t n)
+{
+    void *mem = mmap(NULL, n * sizeof(struct node_bucket),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+
+    return mem == MAP_FAILED ? NULL : mem;
+}
+
+static void free_buckets(struct node_bucket *b, size_t n)
+{
+    if(b)
+        munmap(b, n * sizeof(struct node_bucket));
+}
+
+// Look for key in one bucket array. If it isn't there and slot is non-NULL,
+// *slot is set to the first reusable entry on the probe path (or NULL if
+// the array is completely full).
+//
+// Buckets below skip have already been migrated out of an old array and
+// emptied; a probe passes over them instead of stopping there, since the
+// rest of its cluster may not have been moved yet.
+static struct node_entry *probe(struct node_bucket *b, size_t n, size_t skip,
+        const struct dbKey *key, uint64_t h, struct node_entry **slot)
+{
+    struct node_entry *reuse = NULL;
+    size_t mask = n - 1;
+
+    for(size_t probes = 0; probes < n; probes++) {
+        size_t i = (h + probes) & mask;
+
+        if(i < skip) {
+            probes += skip - i - 1;
+            continue;
+        }
+
+        for(int j = 0; j < NODE_SLOTS; j++) {
+            struct node_entry *e = &b[i].ent[j];
+
+            if(IS_FREE(e)) {
+                if(!reuse)
+                    reuse = e;
+                if(IS_EMPTY(e))
+                    goto out;
+                continue;
+            }
+
+            if(e->key.ino == key->ino && e->key.dev == key->dev)
+                return e;
+        }
+    }
+
+out:
+    if(slot)
+        *slot = reuse;
+    return NULL;
+}
+
+// Claim a free entry for key in the current bucket array.
+static struct node_entry *place(struct node_table *t, struct node_entry *e,
+        const struct dbKey *key)
+{
+    if(IS_EMPTY(e))
+        t->used++;
+
+    e->key = *key;
+    memset(&e->val, 0, sizeof(e->val));
+    return e;
+}
+
+static void migrate(struct node_table *t, size_t n)
+{
+    while(t->old && n--) {
+        struct node_bucket *b = &t->old[t->migrate_pos];
+
+        for(int j = 0; j < NODE_SLOTS; j++) {
+            struct node_entry *e = &b->ent[j], *slot;
+            if(IS_FREE(e))
+                continue;
+
+            // Can't already be in the new array: writes to keys that still
+            // live in the old one are done in place.
+            probe(t->buckets, t->nbuckets, 0, &e->key,
+                    nodetable_hash(&e->key), &slot);
+            place(t, slot, &e->key)->val = e->val;
+        }
+
+        memset(b, 0, sizeof(*b));
+
+        if(++t->migrate_pos == t->old_nbuckets) {
+            free_buckets(t->old, t->old_nbuckets);
+            t->old = NULL;
+        }
+    }
+}
+
+static int grow(struct node_table *t)
+{
+    // Should never happen at our migration rate, but finish up rather than
+    // stacking resizes.
+    if(t->old)
+        migrate(t, t->old_nbuckets);
+
+    // If it's mostly tombstones that filled us up, a rehash at the same
+    // size clears them out.
+    size_t n = t->nbuckets;
+    if(over_load(t->count * 2, n))
+        n *= 2;
+
+    struct node_bucket *nb = alloc_buckets(n);
+    if(!nb)
+        return -1;
+
+    t->old = t->buckets;
+    t->old_nbuckets = t->nbuckets;
+    t->migrate_pos = 0;
+
+    t->buckets = nb;
+    t->nbuckets = n;
+    t->used = 0;
+
+    return 0;
+}
+
+
+int nodetable_init(struct node_table *t, size_t hint)
+{
+    memset(t, 0, sizeof(*t));
+
+    t->nbuckets = MIN_BUCKETS;
+    while(over_load(hint, t->nbuckets))
+        t->nbuckets *= 2;
+
+    t->buckets = alloc_buckets(t->nbuckets);
+    return t->buckets ? 0 : -1;
+}
+
+
+void nodetable_free(struct node_table *t)
+{
+    free_buckets(t->buckets, t->nbuckets);
+    free_buckets(t->old, t->old_nbuckets);
+    memset(t, 0, sizeof(*t));
+}
+
+
+struct dbVal *nodetable_get(struct node_table *t, const struct dbKey *key)
+{
+    uint64_t h = nodetable_hash(key);
+    struct node_entry *e = probe(t->buckets, t->nbuckets, 0, key, h, NULL);
+
+    if(!e && t->old)
+        e = probe(t->old, t->old_nbuckets, t->migrate_pos, key, h, NULL);
+
+    return e ? &e->val : NULL;
+}
+
+
+struct dbVal *nodetable_upsert(struct node_table *t, const struct dbKey *key,
+        int *created)
+{
+    migrate(t, MIGRATE_STEP);
+
+    if(!t->old && over_load(t->used + 1, t->nbuckets))
+        grow(t); // if this fails, keep going until we're actually full
+
+    uint64_t h = nodetable_hash(key);
+    struct node_entry *slot, *e;
+
+    e = probe(t->buckets, t->nbuckets, 0, key, h, &slot);
+
+    if(!e && t->old)
+        e = probe(t->old, t->old_nbuckets, t->migrate_pos, key, h, NULL);
+
+    if(created)
+        *created = !e;
+
+    if(e)
+        return &e->val;
+
+    if(!slot)
+        return NULL;
+
+    t->count++;
+    return &place(t, slot, key)->val;
+}
+
+
+int nodetable_del(struct node_table *t, const struct dbKey *key)
+{
+    uint64_t h = nodetable_hash(key);
+    struct node_entry *e = probe(t->buckets, t->nbuckets, 0, key, h, NULL);
+
+    if(!e && t->old)
+        e = probe(t->old, t->old_nbuckets, t->migrate_pos, key, h, NULL);
+
+    if(!e)
+        return 0;
+
+    // Tombstone: later keys on the same probe path must still be found.
+    e->key.ino = 0;
+    e->key.dev = 1;
+    memset(&e->val, 0, sizeof(e->val));
+
+    t->count--;
+    return 1;
+}
+
+
+int nodetable_migrate(struct node_table *t, size_t n)
+{
+    migrate(t, n);
+    return t->old != NULL;
+}
+
+
+void nodetable_foreach(struct node_table *t,
+        void (*fn)(const struct node_entry *ent, void *arg), void *arg)
+{
+    for(size_t i = 0; i < t->nbuckets; i++)
+        for(int j = 0; j < NODE_SLOTS; j++)
+            if(!IS_FREE(&t->buckets[i].ent[j]))
+                fn(&t->buckets[i].ent[j], arg);
+
+    if(t->old)
+        for(size_t i = t->migrate_pos; i < t->old_nbuckets; i++)
+            for(int j = 0; j < NODE_SLOTS; j++)
+                if(!IS_FREE(&t->old[i].ent[j]))
+                    fn(&t->old[i].ent[j], arg);
+}
@@ -0,0 +1,75 @@
+#ifndef NODETABLE_H
+#define NODETABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// In-memory ownership store used by the daemon.
+//
+// Open addressing with linear probing over cache-line-sized buckets, so a
+// lookup usually touches a single line. When the table grows, the old
+// bucket array is kept around and drained a few buckets at a time by every
+// operation (and by nodetable_migrate() when the daemon is idle), so no
+// single call ever has to rehash the whole table.
+
+struct dbKey {
+    uint64_t dev;       // namespaced; see NS_DEV
+    ino_t ino;
+};
+
+// A virtual inode: flags says which of the fields are in use.
+struct dbVal {
+    uid_t uid;
+    gid_t gid;
+    uint32_t rdev;
+    uint16_t mode;
+    uint16_t flags;
+};
+
+struct node_entry {
+    struct dbKey key;
+    struct dbVal val;
+};
+
+#define NODE_BUCKET_SIZE    64
+#define NODE_SLOTS          (NODE_BUCKET_SIZE / sizeof(struct node_entry))
+
+struct node_bucket {
+    struct node_entry ent[NODE_SLOTS];
+} __attribute__((aligned(NODE_BUCKET_SIZE)));
+
+struct node_table {
+    struct node_bucket *buckets;
+    size_t nbuckets;            // always a power of two
+    size_t count, used;         // live entries; live + tombstones
+
+    // Previous bucket array while a resize is in progress.
+    struct node_bucket *old;
+    size_t old_nbuckets, migrate_pos;
+};
+
+// The hash the table uses; the high bits are free for sharding.
+uint64_t nodetable_hash(const struct dbKey *key);
+
+int nodetable_init(struct node_table *t, size_t hint);
+void nodetable_free(struct node_table *t);
+
+struct dbVal *nodetable_get(struct node_table *t, const struct dbKey *key);
+
+// Find the entry for key, creating it (with a zeroed value) if needed. Sets
+// *created accordingly if it isn't NULL. Returns NULL if out of memory.
+struct dbVal *nodetable_upsert(struct node_table *t, const struct dbKey *key,
+        int *created);
+
+// Remove key's entry. Returns nonzero if there was one.
+int nodetable_del(struct node_table *t, const struct dbKey *key);
+
+// Move up to n buckets out of the old array. Returns nonzero if a resize is
+// still in progress afterwards.
+int nodetable_migrate(struct node_table *t, size_t n);
+
+void nodetable_foreach(struct node_table *t,
+        void (*fn)(const struct node_entry *ent, void *arg), void *arg);
+
+#endif
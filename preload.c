@@ -0,0 +1,919 @@
+// libfakeroot for Linux: loaded with LD_PRELOAD, it stands in for libc's
+// versions of the calls hooks.c cares about. Only calls that go through
+// the dynamic linker are caught; libc calling itself (fopen()'s open(),
+// say) isn't, which is why there are wrappers for some of those too.
+
+#include "hooks.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+#define EXPORT  __attribute__((visibility("default")))
+
+extern char **environ;
+
+// The next one along, i.e. libc's. Looked up the first time it's needed,
+// since we can be called before our constructor runs.
+#define REAL(name) \
+    ((__typeof__(real_##name)) next_sym((void **) &real_##name, #name))
+
+static void *next_sym(void **sym, const char *name)
+{
+    if(!*sym)
+        *sym = dlsym(RTLD_NEXT, name);
+    return *sym;
+}
+
+static int (*real_fstatat)(int, const char *, struct stat *, int);
+static int (*real_fstatat64)(int, const char *, struct stat64 *, int);
+static int (*real___fxstatat)(int, int, const char *, struct stat *, int);
+static int (*real___fxstatat64)(int, int, const char *, struct stat64 *,
+        int);
+static int (*real___xstat)(int, const char *, struct stat *);
+static int (*real___lxstat)(int, const char *, struct stat *);
+static int (*real___fxstat)(int, int, struct stat *);
+static int (*real___xstat64)(int, const char *, struct stat64 *);
+static int (*real___lxstat64)(int, const char *, struct stat64 *);
+static int (*real___fxstat64)(int, int, struct stat64 *);
+static int (*real_statx)(int, const char *, int, unsigned, struct statx *);
+static int (*real_openat)(int, const char *, int, ...);
+static FILE *(*real_fopen)(const char *, const char *);
+static FILE *(*real_fopen64)(const char *, const char *);
+static int (*real_mkdirat)(int, const char *, mode_t);
+static int (*real_symlinkat)(const char *, int, const char *);
+static int (*real_mknodat)(int, const char *, mode_t, dev_t);
+static int (*real___xmknodat)(int, int, const char *, mode_t, dev_t *);
+static int (*real_fchownat)(int, const char *, uid_t, gid_t, int);
+static int (*real_fchmodat)(int, const char *, mode_t, int);
+static int (*real_fchmod)(int, mode_t);
+static int (*real_unlinkat)(int, const char *, int);
+static int (*real_renameat2)(int, const char *, int, const char *,
+        unsigned);
+static int (*real_renameat)(int, const char *, int, const char *);
+static int (*real_close)(int);
+static int (*real_dup2)(int, int);
+static int (*real_dup3)(int, int, int);
+static int (*real_execve)(const char *, char *const [], char *const []);
+static int (*real_execvpe)(const char *, char *const [], char *const []);
+static int (*real_posix_spawn)(pid_t *, const char *,
+        const posix_spawn_file_actions_t *, const posix_spawnattr_t *,
+        char *const [], char *const []);
+static int (*real_posix_spawnp)(pid_t *, const char *,
+        const posix_spawn_file_actions_t *, const posix_spawnattr_t *,
+        char *const [], char *const []);
+
+// What __fxstatat() and friends want as their first argument. Only the
+// older glibcs that need it still say so in their headers.
+#ifdef _STAT_VER
+#define STAT_VER    _STAT_VER
+#elif defined(__x86_64__)
+#define STAT_VER    1
+#elif defined(__i386__)
+#define STAT_VER    3
+#else
+#define STAT_VER    0
+#endif
+
+// Calls are counted under the syscall that does the work for them.
+#ifdef SYS_newfstatat
+#define CALL_STATAT SYS_newfstatat
+#else
+#define CALL_STATAT SYS_fstatat64
+#endif
+
+#ifdef SYS_renameat2
+#define CALL_RENAME SYS_renameat2
+#else
+#define CALL_RENAME SYS_renameat
+#endif
+
+// With FAKEROOT_STATS or FAKEROOT_TRACE, time body (which sets the
+// result) and count it.
+#define TIMED(callno, body) do { \
+    if(!timing_on) { \
+        body; \
+        break; \
+    } \
+    uint64_t start_ = comm_clock(), ipc_ = comm_ipc_time(); \
+    body; \
+    int err_ = errno; \
+    count_call(callno, start_, comm_clock() - start_, \
+            comm_ipc_time() - ipc_); \
+    errno = err_; \
+} while(0)
+
+
+__attribute__((constructor))
+static void preload_init(void)
+{
+    hooks_init();
+}
+
+
+// Stat without our overlay. glibc before 2.33 only has the __fxstatat()s.
+static int lookup(int dirfd, const char *path, struct stat *sbuf, int flags)
+{
+    if(REAL(fstatat))
+        return real_fstatat(dirfd, path, sbuf, flags);
+    return REAL(__fxstatat)(STAT_VER, dirfd, path, sbuf, flags);
+}
+
+static int lookup64(int dirfd, const char *path, struct stat64 *sbuf,
+        int flags)
+{
+    if(REAL(fstatat64))
+        return real_fstatat64(dirfd, path, sbuf, flags);
+    return REAL(__fxstatat64)(STAT_VER, dirfd, path, sbuf, flags);
+}
+
+static int lookup_fd(int fd, struct stat *sbuf)
+{
+    return lookup(fd, "", sbuf, AT_EMPTY_PATH);
+}
+
+static int overlay(int res, struct stat *sbuf)
+{
+    struct fake_attrs attrs;
+
+    if(res < 0 || !hooks_ready)
+        return res;
+
+    if(get_attrs(sbuf->st_dev, sbuf->st_ino, &attrs) < 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    OVERLAY_ATTRS(sbuf, &attrs);
+    return res;
+}
+
+static int overlay64(int res, struct stat64 *sbuf)
+{
+    struct fake_attrs attrs;
+
+    if(res < 0 || !hooks_ready)
+        return res;
+
+    if(get_attrs(sbuf->st_dev, sbuf->st_ino, &attrs) < 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    OVERLAY_ATTRS(sbuf, &attrs);
+    return res;
+}
+
+
+// The stat() family. Newer glibcs export these, older ones the __xstat()s
+// (which programs built against them still call).
+#define STAT_WRAPPERS(sfx, type, fix, dolookup) \
+EXPORT int stat##sfx(const char *path, type *sbuf) \
+{ \
+    int res; \
+    TIMED(CALL_STATAT, \
+          res = fix(dolookup(AT_FDCWD, path, sbuf, 0), sbuf)); \
+    return res; \
+} \
+\
+EXPORT int lstat##sfx(const char *path, type *sbuf) \
+{ \
+    int res; \
+    TIMED(CALL_STATAT, res = fix(dolookup(AT_FDCWD, path, sbuf, \
+                    AT_SYMLINK_NOFOLLOW), sbuf)); \
+    return res; \
+} \
+\
+EXPORT int fstat##sfx(int fd, type *sbuf) \
+{ \
+    int res; \
+    TIMED(SYS_fstat, res = fix(dolookup(fd, "", sbuf, AT_EMPTY_PATH), \
+                sbuf)); \
+    return res; \
+} \
+\
+EXPORT int fstatat##sfx(int dirfd, const char *path, type *sbuf, int flags) \
+{ \
+    int res; \
+    TIMED(CALL_STATAT, \
+          res = fix(dolookup(dirfd, path, sbuf, flags), sbuf)); \
+    return res; \
+} \
+\
+EXPORT int __xstat##sfx(int ver, const char *path, type *sbuf) \
+{ \
+    int res; \
+    TIMED(CALL_STATAT, \
+          res = fix(REAL(__xstat##sfx)(ver, path, sbuf), sbuf)); \
+    return res; \
+} \
+\
+EXPORT int __lxstat##sfx(int ver, const char *path, type *sbuf) \
+{ \
+    int res; \
+    TIMED(CALL_STATAT, \
+          res = fix(REAL(__lxstat##sfx)(ver, path, sbuf), sbuf)); \
+    return res; \
+} \
+\
+EXPORT int __fxstat##sfx(int ver, int fd, type *sbuf) \
+{ \
+    int res; \
+    TIMED(SYS_fstat, res = fix(REAL(__fxstat##sfx)(ver, fd, sbuf), sbuf)); \
+    return res; \
+} \
+\
+EXPORT int __fxstatat##sfx(int ver, int dirfd, const char *path, \
+        type *sbuf, int flags) \
+{ \
+    int res; \
+    TIMED(CALL_STATAT, res = fix(REAL(__fxstatat##sfx)(ver, dirfd, path, \
+                    sbuf, flags), sbuf)); \
+    return res; \
+}
+
+STAT_WRAPPERS(, struct stat, overlay, lookup)
+STAT_WRAPPERS(64, struct stat64, overlay64, lookup64)
+
+EXPORT int statx(int dirfd, const char *path, int flags, unsigned mask,
+        struct statx *sbuf)
+{
+    int res;
+
+    // We need to know which inode it is even if the caller doesn't.
+    TIMED(SYS_statx,
+          res = REAL(statx)(dirfd, path, flags, mask | STATX_INO, sbuf));
+
+    if(res < 0 || !hooks_ready)
+        return res;
+
+    struct fake_attrs attrs;
+    dev_t dev = makedev(sbuf->stx_dev_major, sbuf->stx_dev_minor);
+
+    if(get_attrs(dev, sbuf->stx_ino, &attrs) < 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    if(attrs.known & FAKE_OWNER) {
+        sbuf->stx_uid = attrs.uid;
+        sbuf->stx_gid = attrs.gid;
+    } else {
+        uid_t uid = sbuf->stx_uid;
+        gid_t gid = sbuf->stx_gid;
+        if(implied_owner(dev, &uid, &gid)) {
+            sbuf->stx_uid = uid;
+            sbuf->stx_gid = gid;
+        }
+    }
+    if(attrs.known & FAKE_MODE)
+        sbuf->stx_mode = (sbuf->stx_mode & S_IFMT) | (attrs.mode & 07777);
+    if(attrs.known & FAKE_TYPE) {
+        sbuf->stx_mode = (sbuf->stx_mode & 07777) | (attrs.mode & S_IFMT);
+        sbuf->stx_rdev_major = major(attrs.rdev);
+        sbuf->stx_rdev_minor = minor(attrs.rdev);
+    }
+
+    return res;
+}
+
+
+// Credentials. The set*id() calls take -1 as "leave it be".
+#define GET_ID(type, name, var) \
+EXPORT type name(void) \
+{ \
+    type res; \
+    TIMED(SYS_##name, res = var); \
+    return res; \
+}
+
+GET_ID(uid_t, getuid, fake_uid)
+GET_ID(gid_t, getgid, fake_gid)
+GET_ID(uid_t, geteuid, fake_euid)
+GET_ID(gid_t, getegid, fake_egid)
+
+static void set_ids(int *r, int *e, int rid, int eid)
+{
+    if(rid != -1) *r = rid;
+    if(eid != -1) *e = eid;
+}
+
+EXPORT int setuid(uid_t id)
+{
+    TIMED(SYS_setuid, fake_uid = fake_euid = id);
+    return 0;
+}
+
+EXPORT int setgid(gid_t id)
+{
+    TIMED(SYS_setgid, fake_gid = fake_egid = id);
+    return 0;
+}
+
+EXPORT int seteuid(uid_t id)
+{
+    TIMED(SYS_setresuid, set_ids(&fake_uid, &fake_euid, -1, id));
+    return 0;
+}
+
+EXPORT int setegid(gid_t id)
+{
+    TIMED(SYS_setresgid, set_ids(&fake_gid, &fake_egid, -1, id));
+    return 0;
+}
+
+EXPORT int setreuid(uid_t rid, uid_t eid)
+{
+    TIMED(SYS_setreuid, set_ids(&fake_uid, &fake_euid, rid, eid));
+    return 0;
+}
+
+EXPORT int setregid(gid_t rid, gid_t eid)
+{
+    TIMED(SYS_setregid, set_ids(&fake_gid, &fake_egid, rid, eid));
+    return 0;
+}
+
+// We don't keep a saved set-user-ID apart from the effective one.
+EXPORT int setresuid(uid_t rid, uid_t eid, uid_t sid)
+{
+    TIMED(SYS_setresuid, set_ids(&fake_uid, &fake_euid, rid, eid));
+    return 0;
+}
+
+EXPORT int setresgid(gid_t rid, gid_t eid, gid_t sid)
+{
+    TIMED(SYS_setresgid, set_ids(&fake_gid, &fake_egid, rid, eid));
+    return 0;
+}
+
+EXPORT int getresuid(uid_t *rid, uid_t *eid, uid_t *sid)
+{
+    TIMED(SYS_getresuid, (*rid = fake_uid, *eid = *sid = fake_euid));
+    return 0;
+}
+
+EXPORT int getresgid(gid_t *rid, gid_t *eid, gid_t *sid)
+{
+    TIMED(SYS_getresgid, (*rid = fake_gid, *eid = *sid = fake_egid));
+    return 0;
+}
+
+
+// open() and everything else that can create a file.
+struct open_args {
+    int dirfd;
+    const char *path;
+    mode_t mode;
+};
+
+static int real_open(void *arg, int oflag)
+{
+    struct open_args *a = arg;
+    return REAL(openat)(a->dirfd, a->path, oflag, a->mode);
+}
+
+static int do_openat(int dirfd, const char *path, int oflag, mode_t mode)
+{
+    struct open_args args = { dirfd, path, mode };
+
+    if(!hooks_ready)
+        return real_open(&args, oflag);
+
+    // An O_TMPFILE file is always new.
+    int tmpfile = (oflag & O_TMPFILE) == O_TMPFILE;
+    int created;
+    int fd = create_or_open(&created, real_open, &args, oflag);
+
+    if(fd >= 0 && (created || tmpfile)) {
+        struct stat sbuf;
+        if(lookup_fd(fd, &sbuf) < 0)
+            perror("stat failed after open()");
+        else
+            set_fresh(sbuf.st_dev, sbuf.st_ino, NULL);
+    }
+
+    return fd;
+}
+
+// The mode is only there with O_CREAT or O_TMPFILE.
+#define OPEN_MODE(oflag, mode) do { \
+    if((oflag) & (O_CREAT | O_TMPFILE)) { \
+        va_list ap; \
+        va_start(ap, oflag); \
+        mode = va_arg(ap, int); \
+        va_end(ap); \
+    } \
+} while(0)
+
+EXPORT int open(const char *path, int oflag, ...)
+{
+    mode_t mode = 0;
+    int res;
+
+    OPEN_MODE(oflag, mode);
+    TIMED(SYS_openat, res = do_openat(AT_FDCWD, path, oflag, mode));
+    return res;
+}
+
+EXPORT int open64(const char *path, int oflag, ...)
+{
+    mode_t mode = 0;
+    int res;
+
+    OPEN_MODE(oflag, mode);
+    TIMED(SYS_openat,
+          res = do_openat(AT_FDCWD, path, oflag | O_LARGEFILE, mode));
+    return res;
+}
+
+EXPORT int openat(int dirfd, const char *path, int oflag, ...)
+{
+    mode_t mode = 0;
+    int res;
+
+    OPEN_MODE(oflag, mode);
+    TIMED(SYS_openat, res = do_openat(dirfd, path, oflag, mode));
+    return res;
+}
+
+EXPORT int openat64(int dirfd, const char *path, int oflag, ...)
+{
+    mode_t mode = 0;
+    int res;
+
+    OPEN_MODE(oflag, mode);
+    TIMED(SYS_openat,
+          res = do_openat(dirfd, path, oflag | O_LARGEFILE, mode));
+    return res;
+}
+
+EXPORT int creat(const char *path, mode_t mode)
+{
+    int res;
+    TIMED(SYS_openat, res = do_openat(AT_FDCWD, path,
+                O_WRONLY | O_CREAT | O_TRUNC, mode));
+    return res;
+}
+
+EXPORT int creat64(const char *path, mode_t mode)
+{
+    int res;
+    TIMED(SYS_openat, res = do_openat(AT_FDCWD, path,
+                O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, mode));
+    return res;
+}
+
+// fopen() opens for itself, so all we can do is look before and after.
+static FILE *do_fopen(FILE *(*fn)(const char *, const char *),
+        const char *path, const char *mode)
+{
+    struct stat sbuf;
+    int existed = mode[0] == 'r' || lookup(AT_FDCWD, path, &sbuf, 0) == 0;
+
+    FILE *fp = fn(path, mode);
+
+    if(fp && !existed && hooks_ready && lookup_fd(fileno(fp), &sbuf) == 0)
+        set_fresh(sbuf.st_dev, sbuf.st_ino, NULL);
+
+    return fp;
+}
+
+EXPORT FILE *fopen(const char *path, const char *mode)
+{
+    FILE *res;
+    TIMED(SYS_openat, res = do_fopen(REAL(fopen), path, mode));
+    return res;
+}
+
+EXPORT FILE *fopen64(const char *path, const char *mode)
+{
+    FILE *res;
+    TIMED(SYS_openat, res = do_fopen(REAL(fopen64), path, mode));
+    return res;
+}
+
+static int do_mkdirat(int dirfd, const char *path, mode_t mode)
+{
+    int res = REAL(mkdirat)(dirfd, path, mode);
+    if(res < 0 || !hooks_ready)
+        return res;
+
+    struct stat sbuf;
+    if(lookup(dirfd, path, &sbuf, AT_SYMLINK_NOFOLLOW) < 0)
+        perror("stat failed after mkdir()");
+    else
+        set_fresh(sbuf.st_dev, sbuf.st_ino, NULL);
+
+    return res;
+}
+
+EXPORT int mkdir(const char *path, mode_t mode)
+{
+    int res;
+    TIMED(SYS_mkdirat, res = do_mkdirat(AT_FDCWD, path, mode));
+    return res;
+}
+
+EXPORT int mkdirat(int dirfd, const char *path, mode_t mode)
+{
+    int res;
+    TIMED(SYS_mkdirat, res = do_mkdirat(dirfd, path, mode));
+    return res;
+}
+
+static int do_symlinkat(const char *target, int dirfd, const char *linkname)
+{
+    int res = REAL(symlinkat)(target, dirfd, linkname);
+    if(res < 0 || !hooks_ready)
+        return res;
+
+    struct stat sbuf;
+    if(lookup(dirfd, linkname, &sbuf, AT_SYMLINK_NOFOLLOW) < 0)
+        perror("stat failed after symlink()");
+    else
+        set_fresh(sbuf.st_dev, sbuf.st_ino, NULL);
+
+    return res;
+}
+
+EXPORT int symlink(const char *target, const char *linkname)
+{
+    int res;
+    TIMED(SYS_symlinkat, res = do_symlinkat(target, AT_FDCWD, linkname));
+    return res;
+}
+
+EXPORT int symlinkat(const char *target, int dirfd, const char *linkname)
+{
+    int res;
+    TIMED(SYS_symlinkat, res = do_symlinkat(target, dirfd, linkname));
+    return res;
+}
+
+// Anyone may make FIFOs, sockets and plain files with mknod() here; only
+// device nodes need faking, with an empty file standing in.
+static int do_mknodat(int ver, int dirfd, const char *path, mode_t mode,
+        dev_t rdev)
+{
+    int isdev = hooks_ready && (S_ISCHR(mode) || S_ISBLK(mode)), res;
+
+    if(isdev) {
+        res = REAL(openat)(dirfd, path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if(res >= 0)
+            res = REAL(close)(res);
+    } else if(ver >= 0) {
+        res = REAL(__xmknodat)(ver, dirfd, path, mode, &rdev);
+    } else {
+        res = REAL(mknodat)(dirfd, path, mode, rdev);
+    }
+
+    if(res < 0 || !hooks_ready)
+        return res;
+
+    struct stat sbuf;
+    if(lookup(dirfd, path, &sbuf, AT_SYMLINK_NOFOLLOW) < 0)
+        perror("stat failed after mknod()");
+    else
+        set_node(sbuf.st_dev, sbuf.st_ino, mode, rdev);
+
+    return res;
+}
+
+EXPORT int mknod(const char *path, mode_t mode, dev_t rdev)
+{
+    int res;
+    TIMED(SYS_mknodat, res = do_mknodat(-1, AT_FDCWD, path, mode, rdev));
+    return res;
+}
+
+EXPORT int mknodat(int dirfd, const char *path, mode_t mode, dev_t rdev)
+{
+    int res;
+    TIMED(SYS_mknodat, res = do_mknodat(-1, dirfd, path, mode, rdev));
+    return res;
+}
+
+EXPORT int __xmknod(int ver, const char *path, mode_t mode, dev_t *rdev)
+{
+    int res;
+    TIMED(SYS_mknodat, res = do_mknodat(ver, AT_FDCWD, path, mode, *rdev));
+    return res;
+}
+
+EXPORT int __xmknodat(int ver, int dirfd, const char *path, mode_t mode,
+        dev_t *rdev)
+{
+    int res;
+    TIMED(SYS_mknodat, res = do_mknodat(ver, dirfd, path, mode, *rdev));
+    return res;
+}
+
+
+// chown() never touches the real file.
+static int do_chown(int dirfd, const char *path, uid_t uid, gid_t gid,
+        int flags)
+{
+    struct stat sbuf;
+
+    if(!hooks_ready)
+        return REAL(fchownat)(dirfd, path, uid, gid, flags);
+
+    // ...and if this is EPERM, you're now thoroughly confused!
+    if(lookup(dirfd, path, &sbuf, flags) < 0)
+        return -1;
+
+    fake_chown(sbuf.st_dev, sbuf.st_ino, sbuf.st_uid, sbuf.st_gid, uid, gid);
+    return 0;
+}
+
+EXPORT int chown(const char *path, uid_t uid, gid_t gid)
+{
+    int res;
+    TIMED(SYS_fchownat, res = do_chown(AT_FDCWD, path, uid, gid, 0));
+    return res;
+}
+
+EXPORT int lchown(const char *path, uid_t uid, gid_t gid)
+{
+    int res;
+    TIMED(SYS_fchownat, res = do_chown(AT_FDCWD, path, uid, gid,
+                AT_SYMLINK_NOFOLLOW));
+    return res;
+}
+
+EXPORT int fchown(int fd, uid_t uid, gid_t gid)
+{
+    int res;
+    TIMED(SYS_fchown, res = do_chown(fd, "", uid, gid, AT_EMPTY_PATH));
+    return res;
+}
+
+EXPORT int fchownat(int dirfd, const char *path, uid_t uid, gid_t gid,
+        int flags)
+{
+    int res;
+    TIMED(SYS_fchownat, res = do_chown(dirfd, path, uid, gid, flags));
+    return res;
+}
+
+// The real file gets a mode we can live with; the one asked for is what
+// stat() will show.
+static int do_chmod(int fd, int dirfd, const char *path, mode_t mode,
+        int flags)
+{
+    if(!hooks_ready)
+        return fd >= 0 ? REAL(fchmod)(fd, mode)
+                       : REAL(fchmodat)(dirfd, path, mode, flags);
+
+    struct stat sbuf;
+    int res = fd >= 0 ? lookup_fd(fd, &sbuf)
+                      : lookup(dirfd, path, &sbuf, flags);
+    if(res < 0)
+        return -1;
+
+    mode_t rmode = real_mode(sbuf.st_mode, mode);
+    res = fd >= 0 ? REAL(fchmod)(fd, rmode)
+                  : REAL(fchmodat)(dirfd, path, rmode, flags);
+    if(res < 0)
+        return res;
+
+    fake_chmod(sbuf.st_dev, sbuf.st_ino, mode);
+    return 0;
+}
+
+EXPORT int chmod(const char *path, mode_t mode)
+{
+    int res;
+    TIMED(SYS_fchmodat, res = do_chmod(-1, AT_FDCWD, path, mode, 0));
+    return res;
+}
+
+EXPORT int fchmod(int fd, mode_t mode)
+{
+    int res;
+    TIMED(SYS_fchmod, res = do_chmod(fd, -1, NULL, mode, 0));
+    return res;
+}
+
+EXPORT int fchmodat(int dirfd, const char *path, mode_t mode, int flags)
+{
+    int res;
+    TIMED(SYS_fchmodat, res = do_chmod(-1, dirfd, path, mode, flags));
+    return res;
+}
+
+
+static int do_unlinkat(int dirfd, const char *path, int flags)
+{
+    // Look before it's gone.
+    struct stat sbuf;
+    int sres = lookup(dirfd, path, &sbuf, AT_SYMLINK_NOFOLLOW);
+
+    int res = REAL(unlinkat)(dirfd, path, flags);
+    if(res == 0 && sres == 0 && hooks_ready)
+        removed(sbuf.st_dev, sbuf.st_ino, sbuf.st_mode, sbuf.st_nlink);
+
+    return res;
+}
+
+EXPORT int unlink(const char *path)
+{
+    int res;
+    TIMED(SYS_unlinkat, res = do_unlinkat(AT_FDCWD, path, 0));
+    return res;
+}
+
+EXPORT int rmdir(const char *path)
+{
+    int res;
+    TIMED(SYS_unlinkat, res = do_unlinkat(AT_FDCWD, path, AT_REMOVEDIR));
+    return res;
+}
+
+EXPORT int unlinkat(int dirfd, const char *path, int flags)
+{
+    int res;
+    TIMED(SYS_unlinkat, res = do_unlinkat(dirfd, path, flags));
+    return res;
+}
+
+// Whatever the new name referred to goes away, unless it's the same file
+// (or the two are only being swapped).
+static int do_renameat(int olddir, const char *from, int newdir,
+        const char *to, unsigned flags)
+{
+    struct stat fbuf, tbuf;
+    int fres = lookup(olddir, from, &fbuf, AT_SYMLINK_NOFOLLOW);
+    int tres = lookup(newdir, to, &tbuf, AT_SYMLINK_NOFOLLOW);
+
+    int res = flags ? REAL(renameat2)(olddir, from, newdir, to, flags)
+                    : REAL(renameat)(olddir, from, newdir, to);
+    if(res < 0 || !hooks_ready || (flags & RENAME_EXCHANGE))
+        return res;
+
+    if(tres == 0 && !(fres == 0 && fbuf.st_dev == tbuf.st_dev &&
+                      fbuf.st_ino == tbuf.st_ino))
+        removed(tbuf.st_dev, tbuf.st_ino, tbuf.st_mode, tbuf.st_nlink);
+
+    return res;
+}
+
+EXPORT int rename(const char *from, const char *to)
+{
+    int res;
+    TIMED(CALL_RENAME, res = do_renameat(AT_FDCWD, from, AT_FDCWD, to, 0));
+    return res;
+}
+
+EXPORT int renameat(int olddir, const char *from, int newdir, const char *to)
+{
+    int res;
+    TIMED(CALL_RENAME, res = do_renameat(olddir, from, newdir, to, 0));
+    return res;
+}
+
+EXPORT int renameat2(int olddir, const char *from, int newdir,
+        const char *to, unsigned flags)
+{
+    int res;
+    TIMED(CALL_RENAME, res = do_renameat(olddir, from, newdir, to, flags));
+    return res;
+}
+
+
+// Hide our daemon connections (and trace file).
+EXPORT int close(int fd)
+{
+    int res;
+
+    if(hooks_ready && is_our_fd(fd)) {
+        errno = EBADF;
+        return -1;
+    }
+
+    TIMED(SYS_close, res = REAL(close)(fd));
+    return res;
+}
+
+EXPORT int dup2(int fd, int fd2)
+{
+    int res;
+
+    if(hooks_ready && (is_our_fd(fd) || is_our_fd(fd2))) {
+        errno = EBADF;
+        return -1;
+    }
+
+    TIMED(SYS_dup3, res = REAL(dup2)(fd, fd2));
+    return res;
+}
+
+EXPORT int dup3(int fd, int fd2, int flags)
+{
+    int res;
+
+    if(hooks_ready && (is_our_fd(fd) || is_our_fd(fd2))) {
+        errno = EBADF;
+        return -1;
+    }
+
+    TIMED(SYS_dup3, res = REAL(dup3)(fd, fd2, flags));
+    return res;
+}
+
+
+// exec(). glibc's own exec*()s call execve() without going through us,
+// so execv() and the PATH-searching ones have to be here too.
+static int do_exec(int (*fn)(const char *, char *const [], char *const []),
+        const char *path, char *const argv[], char *const envp[])
+{
+    if(!hooks_ready)
+        return fn(path, argv, envp);
+
+    const char *envbuf[count_environ((const char **) envp) + ENV_EXTRA];
+    struct exec_env x;
+    int fd = exec_begin(envbuf, (const char **) envp, &x);
+
+    fn(path, argv, (char *const *) envbuf);
+
+    // no such thing as a successful return
+    int err = errno;
+    comm_exec_failed(fd);
+    errno = err;
+    return -1;
+}
+
+EXPORT int execve(const char *path, char *const argv[], char *const envp[])
+{
+    int res;
+    TIMED(SYS_execve, res = do_exec(REAL(execve), path, argv, envp));
+    return res;
+}
+
+EXPORT int execv(const char *path, char *const argv[])
+{
+    int res;
+    TIMED(SYS_execve, res = do_exec(REAL(execve), path, argv, environ));
+    return res;
+}
+
+EXPORT int execvpe(const char *file, char *const argv[], char *const envp[])
+{
+    int res;
+    TIMED(SYS_execve, res = do_exec(REAL(execvpe), file, argv, envp));
+    return res;
+}
+
+EXPORT int execvp(const char *file, char *const argv[])
+{
+    int res;
+    TIMED(SYS_execve, res = do_exec(REAL(execvpe), file, argv, environ));
+    return res;
+}
+
+static int do_spawn(__typeof__(real_posix_spawn) fn, pid_t *pid,
+        const char *path, const posix_spawn_file_actions_t *actions,
+        const posix_spawnattr_t *attrs, char *const argv[],
+        char *const envp[])
+{
+    if(!hooks_ready)
+        return fn(pid, path, actions, attrs, argv, envp);
+
+    const char *envbuf[count_environ((const char **) envp) + ENV_EXTRA];
+    struct exec_env x;
+    spawn_begin(envbuf, (const char **) envp, &x);
+
+    return fn(pid, path, actions, attrs, argv, (char *const *) envbuf);
+}
+
+EXPORT int posix_spawn(pid_t *pid, const char *path,
+        const posix_spawn_file_actions_t *actions,
+        const posix_spawnattr_t *attrs, char *const argv[],
+        char *const envp[])
+{
+    int res;
+    TIMED(SYS_execve, res = do_spawn(REAL(posix_spawn), pid, path, actions,
+                attrs, argv, envp));
+    return res;
+}
+
+EXPORT int posix_spawnp(pid_t *pid, const char *file,
+        const posix_spawn_file_actions_t *actions,
+        const posix_spawnattr_t *attrs, char *const argv[],
+        char *const envp[])
+{
+    int res;
+    TIMED(SYS_execve, res = do_spawn(REAL(posix_spawnp), pid, file, actions,
+                attrs, argv, envp));
+    return res;
+}
@@ -0,0 +1,156 @@
+#include "ring.h"
+
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__APPLE__)
+// Libc SPI, available since 10.12
+extern int __ulock_wait(uint32_t operation, void *addr, uint64_t value,
+        uint32_t timeout_us);
+extern int __ulock_wake(uint32_t operation, void *addr, uint64_t wake_value);
+#define UL_COMPARE_AND_WAIT_SHARED  3
+#define ULF_WAKE_ALL                0x100
+#elif defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+// Spin this many times before going to sleep on an empty queue. Round
+// trips are short enough that we usually catch the answer while spinning,
+// but only if the other side has a CPU of its own to run on.
+#define RING_SPIN       4000
+
+static int spin_limit = -1;
+
+// Never sleep longer than this without rechecking ring->closed, so a peer
+// that died without closing the ring can't hang us forever.
+#define RING_WAIT_MS    50
+
+static inline void cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__("pause");
+#endif
+}
+
+static void ring_wait(volatile uint32_t *addr, uint32_t val)
+{
+#if defined(__APPLE__)
+    __ulock_wait(UL_COMPARE_AND_WAIT_SHARED, (void *) addr, val,
+            RING_WAIT_MS * 1000);
+#elif defined(__linux__)
+    struct timespec ts = { 0, RING_WAIT_MS * 1000000L };
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+#else
+    struct timespec ts = { 0, 100000L };
+    if(*addr == val)
+        nanosleep(&ts, NULL);
+#endif
+}
+
+static void ring_wake(volatile uint32_t *addr)
+{
+#if defined(__APPLE__)
+    __ulock_wake(UL_COMPARE_AND_WAIT_SHARED | ULF_WAKE_ALL, (void *) addr, 0);
+#elif defined(__linux__)
+    syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+}
+
+
+void ring_init(struct comm_ring *ring)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->magic = RING_MAGIC;
+}
+
+
+int ring_push(struct comm_ring *ring, struct ring_queue *q,
+        const struct comm_pkt *pkt)
+{
+    uint32_t tail = q->tail;
+
+    while(tail - q->head >= RING_SLOTS) {
+        if(ring->closed)
+            return -1;
+        sched_yield();
+    }
+
+    q->slots[tail & (RING_SLOTS - 1)] = *pkt;
+    __sync_synchronize();
+    q->tail = tail + 1;
+    __sync_synchronize();
+
+    if(q->sleeping)
+        ring_wake(&q->tail);
+
+    return 0;
+}
+
+
+int ring_pop(struct comm_ring *ring, struct ring_queue *q,
+        struct comm_pkt *pkt)
+{
+    uint32_t head = q->head;
+
+    if(spin_limit < 0)
+        spin_limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? RING_SPIN : 0;
+
+    for(int spin = 0; q->tail == head; spin++) {
+        if(ring->closed)
+            return -1;
+
+        if(spin < spin_limit) {
+            cpu_relax();
+            continue;
+        }
+
+        q->sleeping = 1;
+        __sync_synchronize();
+        if(q->tail == head)
+            ring_wait(&q->tail, head);
+        q->sleeping = 0;
+    }
+
+    __sync_synchronize();
+    *pkt = q->slots[head & (RING_SLOTS - 1)];
+    __sync_synchronize();
+    q->head = head + 1;
+
+    return 0;
+}
+
+
+void ring_close(struct comm_ring *ring)
+{
+    ring->closed = 1;
+    __sync_synchronize();
+    ring_wake(&ring->sq.tail);
+    ring_wake(&ring->cq.tail);
+}
+
+
+int ring_call(struct comm_ring *ring, struct comm_pkt *pkt, int want_reply)
+{
+    if(ring_push(ring, &ring->sq, pkt) < 0)
+        return -1;
+
+    if(want_reply && ring_pop(ring, &ring->cq, pkt) < 0)
+        return -1;
+
+    return 0;
+}
+
+
+void ring_serve(struct comm_ring *ring,
+        int (*handler)(struct comm_pkt *pkt, void *arg), void *arg)
+{
+    struct comm_pkt pkt;
+
+    while(ring_pop(ring, &ring->sq, &pkt) == 0) {
+        if(handler(&pkt, arg) && ring_push(ring, &ring->cq, &pkt) < 0)
+            break;
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef RING_H
+#define RING_H
+
+#include "communicate.h"
+
+// Shared-memory transport. Each client process that asks for it (OPEN_RING
+// over its socket) gets its own mapping holding a submission queue, which
+// only the client produces into, and a completion queue, which only the
+// daemon produces into. Both are single-producer/single-consumer, so the
+// only synchronization needed is ordering between the slot contents and the
+// head/tail counters, plus a futex-style sleep when a queue is empty.
+
+#define RING_MAGIC  0x666b7274524e47ULL
+#define RING_SLOTS  64      // must be a power of two
+
+struct ring_queue {
+    volatile uint32_t head;         // next slot the consumer will read
+    char pad0[60];
+    volatile uint32_t tail;         // next slot the producer will write
+    volatile uint32_t sleeping;     // consumer is (about to be) asleep
+    char pad1[56];
+    struct comm_pkt slots[RING_SLOTS];
+};
+
+struct comm_ring {
+    uint64_t magic;
+    volatile uint32_t closed;
+    char pad[52];
+    struct ring_queue sq, cq;
+};
+
+void ring_init(struct comm_ring *ring);
+
+// Producer side. Blocks while the queue is full; returns -1 if the ring has
+// been closed in the meantime.
+int ring_push(struct comm_ring *ring, struct ring_queue *q,
+        const struct comm_pkt *pkt);
+
+// Consumer side. Blocks until a packet is available; returns -1 if the ring
+// has been closed.
+int ring_pop(struct comm_ring *ring, struct ring_queue *q,
+        struct comm_pkt *pkt);
+
+void ring_close(struct comm_ring *ring);
+
+// Client: submit a packet and, if want_reply, wait for its completion.
+int ring_call(struct comm_ring *ring, struct comm_pkt *pkt, int want_reply);
+
+// Daemon: service the submission queue until the ring is closed. The
+// handler returns nonzero if the packet should be posted as a completion.
+void ring_serve(struct comm_ring *ring,
+        int (*handler)(struct comm_pkt *pkt, void *arg), void *arg);
+
+#endif
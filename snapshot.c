@@ -0,0 +1,174 @@
+#include "snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+int snapshot_open(struct snapshot *s, const char *path)
+{
+    memset(s, 0, sizeof(*s));
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return -1;
+
+    struct stat sbuf;
+    struct snapshot_header hdr;
+
+    if(fstat(fd, &sbuf) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    if(pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+       memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0 ||
+       hdr.version != SNAPSHOT_VERSION ||
+       hdr.reclen != sizeof(struct snapshot_rec)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint64_t room = (sbuf.st_size - sizeof(hdr)) / sizeof(struct snapshot_rec);
+    if(hdr.count > room) {
+        fprintf(stderr, "%s: truncated state file\n", path);
+        hdr.count = room;
+    }
+
+    if(hdr.count) {
+        s->maplen = sizeof(hdr) + hdr.count * sizeof(struct snapshot_rec);
+        s->map = mmap(NULL, s->maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if(s->map == MAP_FAILED) {
+            int err = errno;
+            close(fd);
+            memset(s, 0, sizeof(*s));
+            errno = err;
+            return -1;
+        }
+
+        // Lookups jump all over the place; don't bother reading ahead.
+        madvise(s->map, s->maplen, MADV_RANDOM);
+
+        s->recs = (const struct snapshot_rec *)
+            ((const char *) s->map + sizeof(hdr));
+        s->count = hdr.count;
+    }
+
+    close(fd);
+    return 0;
+}
+
+
+void snapshot_close(struct snapshot *s)
+{
+    if(s->map)
+        munmap(s->map, s->maplen);
+    memset(s, 0, sizeof(*s));
+}
+
+
+int snapshot_cmp(uint64_t dev1, uint64_t ino1, uint64_t dev2, uint64_t ino2)
+{
+    if(dev1 != dev2)
+        return dev1 < dev2 ? -1 : 1;
+    if(ino1 != ino2)
+        return ino1 < ino2 ? -1 : 1;
+    return 0;
+}
+
+
+int snapshot_get(const struct snapshot *s, const struct dbKey *key,
+        struct dbVal *val)
+{
+    uint64_t lo = 0, hi = s->count;
+
+    while(lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        const struct snapshot_rec *rec = &s->recs[mid];
+        int c = snapshot_cmp(key->dev, key->ino, rec->dev, rec->ino);
+
+        if(c == 0) {
+            if(val) {
+                val->uid = rec->uid;
+                val->gid = rec->gid;
+                val->rdev = rec->rdev;
+                val->mode = rec->mode;
+                val->flags = rec->flags;
+            }
+            return 1;
+        }
+
+        if(c < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return 0;
+}
+
+
+int snapshot_begin(struct snapshot_writer *w, const char *path)
+{
+    memset(w, 0, sizeof(*w));
+    strncpy(w->path, path, sizeof(w->path) - 1);
+    snprintf(w->tmppath, sizeof(w->tmppath), "%s.tmp", path);
+
+    w->fp = fopen(w->tmppath, "wb");
+    if(!w->fp)
+        return -1;
+
+    // The count gets filled in at the end.
+    struct snapshot_header hdr = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .reclen = sizeof(struct snapshot_rec),
+    };
+
+    if(fwrite(&hdr, sizeof(hdr), 1, w->fp) != 1)
+        w->error = 1;
+
+    return 0;
+}
+
+
+void snapshot_add(struct snapshot_writer *w, const struct snapshot_rec *rec)
+{
+    if(fwrite(rec, sizeof(*rec), 1, w->fp) != 1)
+        w->error = 1;
+    w->count++;
+}
+
+
+int snapshot_finish(struct snapshot_writer *w)
+{
+    struct snapshot_header hdr = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .reclen = sizeof(struct snapshot_rec),
+        .count = w->count,
+    };
+
+    if(fseek(w->fp, 0, SEEK_SET) != 0 ||
+       fwrite(&hdr, sizeof(hdr), 1, w->fp) != 1 ||
+       fflush(w->fp) != 0 || fsync(fileno(w->fp)) != 0)
+        w->error = 1;
+
+    if(fclose(w->fp) != 0 || w->error) {
+        perror(w->tmppath);
+        unlink(w->tmppath);
+        return -1;
+    }
+
+    if(rename(w->tmppath, w->path) < 0) {
+        perror(w->path);
+        unlink(w->tmppath);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,62 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "nodetable.h"
+
+// The --persist file: a header followed by one record per inode, sorted by
+// (dev, ino) and all fixed-width so the file is the same for 32- and
+// 64-bit daemons. The daemon maps it read-only and looks records up in
+// place, so opening one costs the same however big it is. Changes made
+// during a session live in memory until they're merged into a new file.
+
+#define SNAPSHOT_MAGIC      "fkrtnode"
+#define SNAPSHOT_VERSION    3
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version, reclen;
+    uint64_t count;
+};
+
+struct snapshot_rec {
+    uint64_t dev, ino;
+    uint32_t uid, gid, rdev;
+    uint16_t mode, flags;
+};
+
+struct snapshot {
+    const struct snapshot_rec *recs;
+    uint64_t count;
+    void *map;
+    size_t maplen;
+};
+
+// Returns -1 with errno set on failure; EINVAL means the file isn't a
+// snapshot (it may be in one of the older formats).
+int snapshot_open(struct snapshot *s, const char *path);
+void snapshot_close(struct snapshot *s);
+
+// Copy key's record into *val (if val isn't NULL). Returns nonzero if
+// there is one.
+int snapshot_get(const struct snapshot *s, const struct dbKey *key,
+        struct dbVal *val);
+
+int snapshot_cmp(uint64_t dev1, uint64_t ino1, uint64_t dev2, uint64_t ino2);
+
+// Writing a new snapshot: records have to be added in order. The file is
+// only put in place by snapshot_finish(), if everything went well.
+struct snapshot_writer {
+    FILE *fp;
+    uint64_t count;
+    int error;
+    char path[1024], tmppath[1024];
+};
+
+int snapshot_begin(struct snapshot_writer *w, const char *path);
+void snapshot_add(struct snapshot_writer *w, const struct snapshot_rec *rec);
+int snapshot_finish(struct snapshot_writer *w);
+
+#endif
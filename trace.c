@@ -0,0 +1,174 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+// Records pile up here, under trace_lock, and go out when it fills. A
+// forked child drops what it inherited: the parent will write that.
+#define TRACE_BUF   1024
+
+int trace_on;
+
+static int trace_fd = -1;
+static uint32_t trace_pid;
+static pthread_key_t tid_key;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_rec trace_buf[TRACE_BUF];
+static int trace_len;
+
+static uint32_t thread_id(void)
+{
+    uintptr_t tid = (uintptr_t) pthread_getspecific(tid_key);
+    if(tid)
+        return tid;
+
+#ifdef __linux__
+    tid = syscall(SYS_gettid);
+#else
+    uint64_t id;
+    pthread_threadid_np(NULL, &id);
+    tid = (uint32_t) id;
+#endif
+    pthread_setspecific(tid_key, (void *) tid);
+    return tid;
+}
+
+// Call with trace_lock held.
+static void write_out(void)
+{
+    const char *p = (const char *) trace_buf;
+    size_t len = trace_len * sizeof(trace_buf[0]);
+
+    while(len) {
+        ssize_t n = write(trace_fd, p, len);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            perror("fakeroot: trace");
+            trace_on = 0;
+            break;
+        }
+        p += n;
+        len -= n;
+    }
+
+    trace_len = 0;
+}
+
+// Call with trace_lock held.
+static struct trace_rec *new_rec(int kind, int what, uint64_t start)
+{
+    if(trace_len == TRACE_BUF)
+        write_out();
+
+    struct trace_rec *r = &trace_buf[trace_len++];
+    memset(r, 0, sizeof(*r));
+    r->time = start;
+    r->pid = trace_pid;
+    r->tid = thread_id();
+    r->kind = kind;
+    r->what = what;
+    return r;
+}
+
+static void start_rec(void)
+{
+    trace_pid = getpid();
+
+    pthread_mutex_lock(&trace_lock);
+    struct trace_rec *r = new_rec(TRACE_START, TRACE_VERSION, comm_clock());
+    r->pkt.dev = getppid();
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_prepare(void)
+{
+    pthread_mutex_lock(&trace_lock);
+}
+
+static void trace_parent(void)
+{
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_child(void)
+{
+    trace_len = 0;
+    pthread_mutex_unlock(&trace_lock);
+
+    // Only the forking thread made it over, with a new tid.
+    pthread_setspecific(tid_key, NULL);
+    start_rec();
+}
+
+int trace_open(const char *path)
+{
+    if(pthread_key_create(&tid_key, NULL) != 0)
+        return -1;
+
+    trace_fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if(trace_fd < 0)
+        return -1;
+    fcntl(trace_fd, F_SETFD, 1); // close-on-exec
+
+    pthread_atfork(trace_prepare, trace_parent, trace_child);
+    trace_on = 1;
+    start_rec();
+    return 0;
+}
+
+void trace_flush(void)
+{
+    if(trace_fd < 0)
+        return;
+
+    pthread_mutex_lock(&trace_lock);
+    if(trace_on && trace_len)
+        write_out();
+    pthread_mutex_unlock(&trace_lock);
+}
+
+int is_trace_fd(int fd)
+{
+    return fd >= 0 && fd == trace_fd;
+}
+
+void trace_call(int callno, uint64_t start, uint64_t total, uint64_t ipc)
+{
+    pthread_mutex_lock(&trace_lock);
+    struct trace_rec *r = new_rec(TRACE_CALL, callno, start);
+    r->ns = total < UINT32_MAX ? total : UINT32_MAX;
+    r->call.ipc_ns = ipc;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_pkts(const struct comm_pkt *ents, int n, uint64_t start,
+        uint64_t end)
+{
+    uint64_t ns = end - start < UINT32_MAX ? end - start : UINT32_MAX;
+
+    pthread_mutex_lock(&trace_lock);
+
+    for(int i = 0; i < n; i++) {
+        struct trace_rec *r = new_rec(TRACE_PKT, ents[i].action, start);
+        r->known = ents[i].known;
+        r->count = i ? 0 : n;
+        r->ns = ns;
+        r->pkt.uid = ents[i].uid;
+        r->pkt.gid = ents[i].gid;
+        r->pkt.mode = ents[i].mode;
+        r->pkt.rdev = ents[i].rdev;
+        r->pkt.dev = ents[i].dev;
+        r->pkt.ino = ents[i].ino;
+    }
+
+    pthread_mutex_unlock(&trace_lock);
+}
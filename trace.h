@@ -0,0 +1,50 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include "communicate.h"
+
+// FAKEROOT_TRACE (fakeroot --trace): every process in the session appends
+// what it did to one file, for fakeroot-replay to play back later. Records
+// are all the same size and go out a buffer at a time with O_APPEND, so
+// processes' buffers interleave but no record is ever torn; a thread's own
+// records are in order. There's no header: each process starts with a
+// TRACE_START record, whose what is TRACE_VERSION.
+
+#define TRACE_VERSION   1
+
+#define TRACE_START     1   // ppid in dev
+#define TRACE_CALL      2   // a hooked call; what is its callno
+#define TRACE_PKT       3   // an entry sent to the daemon; what is its action
+
+struct trace_rec {
+    uint64_t time;          // comm_clock() when it started
+    uint32_t pid, tid;
+    uint16_t kind, what;
+    uint32_t count;         // entries in the exchange, on its first entry
+    uint32_t ns;            // how long it took, the whole exchange for PKT
+    uint16_t known, pad;    // TRACE_PKT: as sent, or as answered for a GET
+    union {
+        struct {
+            uint32_t uid, gid, mode, rdev;
+            uint64_t dev, ino;
+        } pkt;
+        struct {
+            uint64_t ipc_ns;    // of ns, how much was the daemon's
+        } call;
+    };
+};
+
+// The recorder, in libfakeroot. trace_open() starts this process off;
+// trace_flush() writes out what's buffered (at exit, and before exec).
+int trace_open(const char *path);
+void trace_flush(void);
+int is_trace_fd(int fd);
+
+extern int trace_on;
+void trace_call(int callno, uint64_t start, uint64_t total, uint64_t ipc);
+void trace_pkts(const struct comm_pkt *ents, int n, uint64_t start,
+        uint64_t end);
+
+#endif
@@ -0,0 +1,351 @@
+#include "wal.h"
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#define WAL_MAGIC       "fkrtwal"
+#define WAL_VERSION     1
+
+struct wal_header {
+    char magic[8];
+    uint32_t version, reclen;
+};
+
+static uint32_t rec_sum(const struct wal_rec *rec)
+{
+    const unsigned char *p = (const unsigned char *) rec;
+    uint32_t h = 2166136261u;
+
+    for(size_t i = 0; i < offsetof(struct wal_rec, sum); i++)
+        h = (h ^ p[i]) * 16777619u;
+
+    return h;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while(len > 0) {
+        ssize_t n = write(fd, p, len);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+// Run fn over the good records in a log. Returns where they end (a crash
+// can leave a torn record at the end), or -1 if this isn't a log at all.
+static off_t scan(int fd, void (*fn)(const struct wal_rec *rec, void *arg),
+        void *arg)
+{
+    struct wal_header hdr;
+    ssize_t n = pread(fd, &hdr, sizeof(hdr), 0);
+
+    if(n == 0)
+        return 0;
+
+    if(n != sizeof(hdr) ||
+       memcmp(hdr.magic, WAL_MAGIC, sizeof(hdr.magic)) != 0 ||
+       hdr.version != WAL_VERSION || hdr.reclen != sizeof(struct wal_rec)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    off_t off = sizeof(hdr);
+    struct wal_rec recs[1024];
+
+    while((n = pread(fd, recs, sizeof(recs), off)) > 0) {
+        size_t nrec = n / sizeof(recs[0]);
+
+        for(size_t i = 0; i < nrec; i++) {
+            if(recs[i].sum != rec_sum(&recs[i]))
+                return off;
+            if(fn)
+                fn(&recs[i], arg);
+            off += sizeof(recs[0]);
+        }
+
+        if(nrec * sizeof(recs[0]) != n)
+            break;
+    }
+
+    return off;
+}
+
+// Fold what a crashed checkpoint left behind (a .old segment, maybe with
+// a newer one next to it) back into a single log.
+static int recover(struct wal *w)
+{
+    int ofd = open(w->oldpath, O_RDWR);
+    if(ofd < 0)
+        return errno == ENOENT ? 0 : -1;
+
+    off_t end = scan(ofd, NULL, NULL);
+    int fd = open(w->path, O_RDONLY);
+
+    if(end >= 0 && fd >= 0) {
+        struct wal_rec rec;
+        off_t off = sizeof(struct wal_header), stop = scan(fd, NULL, NULL);
+
+        for(; off < stop; off += sizeof(rec)) {
+            if(pread(fd, &rec, sizeof(rec), off) != sizeof(rec) ||
+               pwrite(ofd, &rec, sizeof(rec), end) != sizeof(rec)) {
+                end = -1;
+                break;
+            }
+            end += sizeof(rec);
+        }
+    }
+
+    if(fd >= 0)
+        close(fd);
+
+    if(end < 0 || ftruncate(ofd, end) < 0 || fsync(ofd) < 0 ||
+       rename(w->oldpath, w->path) < 0) {
+        close(ofd);
+        return -1;
+    }
+
+    close(ofd);
+    return 0;
+}
+
+static int open_segment(struct wal *w)
+{
+    w->fd = open(w->path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if(w->fd < 0)
+        return -1;
+
+    fcntl(w->fd, F_SETFD, 1); // close-on-exec
+
+    struct wal_header hdr = {
+        .magic = WAL_MAGIC,
+        .version = WAL_VERSION,
+        .reclen = sizeof(struct wal_rec),
+    };
+
+    if(lseek(w->fd, 0, SEEK_END) == 0 &&
+       (write_all(w->fd, &hdr, sizeof(hdr)) < 0 || fsync(w->fd) < 0)) {
+        close(w->fd);
+        return -1;
+    }
+
+    w->size = 0;
+    return 0;
+}
+
+static void *flusher(void *arg)
+{
+    struct wal *w = arg;
+
+    pthread_mutex_lock(&w->io_lock);
+    pthread_mutex_lock(&w->lock);
+
+    while(!w->stop || w->len) {
+        if(w->len < WAL_BATCH && !w->stop) {
+            struct timeval now;
+            struct timespec until;
+
+            gettimeofday(&now, NULL);
+            until.tv_sec = now.tv_sec;
+            until.tv_nsec = now.tv_usec * 1000L + WAL_INTERVAL_MS * 1000000L;
+            if(until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+
+            // Let go of io_lock while we wait so wal_rotate() can run.
+            pthread_mutex_unlock(&w->io_lock);
+            pthread_cond_timedwait(&w->kick, &w->lock, &until);
+            pthread_mutex_unlock(&w->lock);
+            pthread_mutex_lock(&w->io_lock);
+            pthread_mutex_lock(&w->lock);
+        }
+
+        if(!w->len)
+            continue;
+
+        // Swap buffers so appends can carry on while we write.
+        char *buf = w->buf;
+        size_t len = w->len, cap = w->cap;
+
+        w->buf = w->spare;
+        w->cap = w->spare_cap;
+        w->len = 0;
+        pthread_mutex_unlock(&w->lock);
+
+        if(write_all(w->fd, buf, len) < 0 || fsync(w->fd) < 0)
+            perror(w->path);
+
+        pthread_mutex_lock(&w->lock);
+        w->spare = buf;
+        w->spare_cap = cap;
+        w->size += len;
+    }
+
+    pthread_mutex_unlock(&w->lock);
+    pthread_mutex_unlock(&w->io_lock);
+    return NULL;
+}
+
+
+int wal_open(struct wal *w, const char *path,
+        void (*fn)(const struct wal_rec *rec, void *arg), void *arg)
+{
+    memset(w, 0, sizeof(*w));
+    snprintf(w->path, sizeof(w->path), "%s.wal", path);
+    snprintf(w->oldpath, sizeof(w->oldpath), "%s.wal.old", path);
+
+    if(recover(w) < 0) {
+        perror(w->oldpath);
+        return -1;
+    }
+
+    if(open_segment(w) < 0) {
+        perror(w->path);
+        return -1;
+    }
+
+    off_t end = scan(w->fd, fn, arg);
+    if(end < 0) {
+        fprintf(stderr, "%s: not a fakeroot log\n", w->path);
+        close(w->fd);
+        return -1;
+    }
+
+    // Cut off anything torn, so new records follow on from good ones.
+    if(ftruncate(w->fd, end) < 0) {
+        perror(w->path);
+        close(w->fd);
+        return -1;
+    }
+    w->size = end - sizeof(struct wal_header);
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_mutex_init(&w->io_lock, NULL);
+    pthread_cond_init(&w->kick, NULL);
+
+    if(pthread_create(&w->thread, NULL, flusher, w) != 0) {
+        perror("pthread_create (wal)");
+        close(w->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void wal_append(struct wal *w, struct wal_rec *rec)
+{
+    rec->sum = rec_sum(rec);
+
+    pthread_mutex_lock(&w->lock);
+
+    if(w->len + sizeof(*rec) > w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : WAL_BATCH;
+        char *buf = realloc(w->buf, cap);
+
+        if(!buf) {
+            // Not much else we can do; the record will be in the
+            // snapshot we write at exit, if we get there.
+            pthread_mutex_unlock(&w->lock);
+            perror("realloc (wal)");
+            return;
+        }
+
+        w->buf = buf;
+        w->cap = cap;
+    }
+
+    memcpy(w->buf + w->len, rec, sizeof(*rec));
+    w->len += sizeof(*rec);
+
+    if(w->len >= WAL_BATCH)
+        pthread_cond_signal(&w->kick);
+
+    pthread_mutex_unlock(&w->lock);
+}
+
+
+uint64_t wal_size(struct wal *w)
+{
+    pthread_mutex_lock(&w->lock);
+    uint64_t size = w->size + w->len;
+    pthread_mutex_unlock(&w->lock);
+    return size;
+}
+
+
+int wal_rotate(struct wal *w)
+{
+    int res = 0;
+
+    // Still waiting for a snapshot to cover the last one.
+    if(access(w->oldpath, F_OK) == 0)
+        return -1;
+
+    pthread_mutex_lock(&w->io_lock);
+    pthread_mutex_lock(&w->lock);
+
+    // Whatever's buffered belongs to the segment being closed.
+    if(write_all(w->fd, w->buf, w->len) < 0 || fsync(w->fd) < 0) {
+        perror(w->path);
+        res = -1;
+    } else {
+        w->len = 0;
+
+        int oldfd = w->fd;
+        if(rename(w->path, w->oldpath) < 0 || open_segment(w) < 0) {
+            perror(w->path);
+            w->fd = oldfd;
+            res = -1;
+        } else {
+            close(oldfd);
+        }
+    }
+
+    pthread_mutex_unlock(&w->lock);
+    pthread_mutex_unlock(&w->io_lock);
+    return res;
+}
+
+
+void wal_drop_old(struct wal *w)
+{
+    if(unlink(w->oldpath) < 0 && errno != ENOENT)
+        perror(w->oldpath);
+}
+
+
+void wal_close(struct wal *w, int remove)
+{
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_signal(&w->kick);
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_join(w->thread, NULL);
+    close(w->fd);
+
+    if(remove) {
+        unlink(w->path);
+        wal_drop_old(w);
+    }
+
+    free(w->buf);
+    free(w->spare);
+}
@@ -0,0 +1,61 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+// Write-ahead log for the --persist store: every SET and DEL the daemon
+// applies is appended to <persist>.wal, so a daemon that dies without
+// saving loses (at worst) the last WAL_INTERVAL_MS of changes. Appends
+// only copy into a buffer; a flusher thread writes the buffer out and
+// fsync()s once per interval (or sooner when WAL_BATCH bytes pile up), so
+// many requests share every sync and nobody waits for the disk.
+//
+// A checkpoint rotates the log to <persist>.wal.old and writes a new
+// snapshot covering everything up to that point; after which the old
+// segment can go.
+
+#define WAL_INTERVAL_MS     10
+#define WAL_BATCH           (256 * 1024)
+
+#define WAL_SET     1
+#define WAL_DEL     2
+
+struct wal_rec {
+    uint64_t dev, ino;
+    uint32_t uid, gid, rdev, known;
+    uint16_t mode, op;
+    uint32_t sum;           // of everything before it
+};
+
+struct wal {
+    int fd;
+    char path[1024], oldpath[1024];
+
+    // lock protects the buffer; io_lock is held while writing it out.
+    pthread_mutex_t lock, io_lock;
+    pthread_cond_t kick;
+    char *buf, *spare;
+    size_t len, cap, spare_cap;
+    uint64_t size;          // bytes in the current segment
+    int stop;
+    pthread_t thread;
+};
+
+// Open (or create) the log at path, replaying what's already in it (and
+// in a leftover .old segment) through fn first.
+int wal_open(struct wal *w, const char *path,
+        void (*fn)(const struct wal_rec *rec, void *arg), void *arg);
+
+void wal_append(struct wal *w, struct wal_rec *rec);
+uint64_t wal_size(struct wal *w);
+
+// Start a new segment; the current one becomes the .old one.
+int wal_rotate(struct wal *w);
+void wal_drop_old(struct wal *w);
+
+// Write out everything and stop. With remove, the log files go too (the
+// caller has saved everything elsewhere).
+void wal_close(struct wal *w, int remove);
+
+#endif